@@ -7,6 +7,7 @@
 require 'csv'
 require 'redis'
 require 'hiredis'
+require_relative 'nr-threads'
 
 $classes = {}
 
@@ -75,9 +76,10 @@ r.send('nr.train',:banking,:maxtime,0,:maxcycles,500,:autostop,:backtrack)
 oldinfo = nil
 while true
     info = r.send('nr.threads')
-    if (info != oldinfo)
-        puts info
-        oldinfo = info
+    lines = format_threads(info)
+    if (lines != oldinfo)
+        puts lines
+        oldinfo = lines
     end
     sleep 0.1
     if info.length == 0
@@ -22,6 +22,7 @@ def get_error(r)
 end
 
 def is_training(r)
+    r.send('nr.threads') # Store the weights of terminated trainings.
     a = r.send('nr.info',:iris)
     Hash[*a]["training"].to_i == 1
 end
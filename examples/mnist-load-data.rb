@@ -2,6 +2,7 @@
 
 require 'redis'
 require 'hiredis'
+require_relative 'nr-threads'
 
 def insert_data(r,prefix,target,count)
     puts "Loading #{target} data..."
@@ -38,9 +39,10 @@ r.send('nr.train',:mnist,:maxtime,0,:maxcycles,500,:autostop,:backtrack)
 oldinfo = nil
 while true
     info = r.send('nr.threads')
-    if (info != oldinfo)
-        puts info
-        oldinfo = info
+    lines = format_threads(info)
+    if (lines != oldinfo)
+        puts lines
+        oldinfo = lines
     end
     sleep 0.1
     if info.length == 0
@@ -0,0 +1,13 @@
+# Helpers shared by the examples to show the NR.THREADS training progress.
+
+# NR.THREADS entries are field/value pairs: show them in a single line,
+# without the training profile.
+def format_thread(t)
+    Hash[*t].reject{|k,v| k == 'profile'}.map{|k,v| "#{k}=#{v}"}.join(" ")
+end
+
+# The lines to show for a whole NR.THREADS reply. The profile changes at
+# every poll, so compare these, and not the reply, to print only changes.
+def format_threads(info)
+    info.map{|t| format_thread(t)}
+end
@@ -11,6 +11,7 @@ SentimentPos = 1
 
 require 'redis'
 require 'hiredis'
+require_relative 'nr-threads'
 require 'zlib'
 
 # Just return a list of sentences: the source files are already organized
@@ -135,11 +136,12 @@ oldinfo = nil
 start=Time.now
 while true
     info = r.send('nr.threads')
-    if (info.length != 0 && info != oldinfo)
+    lines = format_threads(info)
+    if (info.length != 0 && lines != oldinfo)
         timeinfo = " milliseconds_per_cycle=#{(Time.now-start)*1000}"
         start = Time.now
-        puts info[0] + timeinfo
-        oldinfo = info
+        puts lines[0] + timeinfo
+        oldinfo = lines
     end
     sleep 0.01
     if info.length == 0
@@ -22,6 +22,7 @@ r.send('nr.create',:sumnet,:regressor,2,10,'->',1,:DATASET,1000,:TEST,500,:NORMA
 
 r.send('nr.train',:sumnet,:maxtime,2000)
 sleep(3)
+r.send('nr.threads') # Store the weights of the terminated training.
 
 puts "50 + 100 = #{r.send('nr.run',:sumnet,50,100)}"
 puts "20 + 40 = #{r.send('nr.run',:sumnet,20,40)}"
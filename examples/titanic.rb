@@ -62,6 +62,7 @@ feed_data(r,test_dataset,:test)
 feed_data(r,training_dataset,:observe)
 r.send('nr.train',:mynet,:autostop,:maxtime,60000)
 while true
+    r.send('nr.threads') # Store the weights of terminated trainings.
     nninfo = r.send('nr.info',:mynet)
     break if nninfo[7] == 0
     puts "Still training..."
@@ -34,6 +34,7 @@
  */
 
 #define _DEFAULT_SOURCE /* for strcasecmp() */
+#define _GNU_SOURCE /* for CPU affinity */
 
 #include "redismodule.h"
 #include <stdio.h>
@@ -41,9 +42,20 @@
 #include <ctype.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 #include <sys/time.h>
+#include <time.h>
+#include <sys/resource.h>
 #include <math.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 
 #include "nn.h"
 
@@ -62,24 +74,101 @@ uint64_t NRNextId = 1; /* Next neural network unique ID. */
 #define NR_FLAG_AUTO_STOP (1<<4)        /* Auto stop on training. */
 #define NR_FLAG_OF_DETECTED (1<<5)      /* Auto stopped on overfitting. */
 #define NR_FLAG_BACKTRACK (1<<6)        /* Auto stop with backtracking. */
+#define NR_FLAG_ZSCORE (1<<7)           /* Normalize inputs by z-score. */
+#define NR_FLAG_TRAIN_SEED (1<<8)       /* Seed the training PRNG. */
+#define NR_FLAG_PROFILE (1<<9)          /* Sample hardware counters. */
 
 /* Flags to persist when saving the NN. */
 #define NR_FLAG_TO_PRESIST (NR_FLAG_REGRESSOR| \
                             NR_FLAG_CLASSIFIER| \
                             NR_FLAG_NORMALIZE| \
+                            NR_FLAG_ZSCORE| \
                             NR_FLAG_OF_DETECTED)
 
 /* Flags to transfer after training. */
 #define NR_FLAG_TO_TRANSFER (NR_FLAG_OF_DETECTED)
 
 #define NR_MAX_LAYERS 32
-#define NR_RDB_ENC_VER 2
+#define NR_RDB_ENC_VER 7
 
+/* The arrays of the datasets are read-mostly regions, see
+ * NRDatasetAlloc(). */
 typedef struct NRDataset {
     uint32_t len, maxlen;
+    uint32_t cap;       /* Rows allocated, see NRDatasetReserve(). */
     float *inputs, *outputs;
 } NRDataset;
 
+/* Running statistics of the training dataset, updated every time a sample
+ * is added or replaced, so that starting a training does not require to
+ * scan the dataset in order to compute the normalization factors. Mean and
+ * variance are computed with the Welford algorithm, and are exact for the
+ * samples currently in the dataset. The max absolute values can't be
+ * updated when a sample is replaced, so they are the max of all the
+ * samples the dataset contained. */
+typedef struct NRStats {
+    uint64_t count;     /* Number of samples in the training dataset. */
+    float *imax;        /* Max absolute value of every input. */
+    float *omax;        /* Max absolute value of every output. */
+    double *imean;      /* Mean of every input. */
+    double *im2;        /* Sum of squares of differences from the mean. */
+} NRStats;
+
+/* Profile of a training: where the time went, and how the errors changed.
+ * Times are in nanoseconds. The network phases are measured by nn.c, see
+ * AnnResilientBPEpoch(). Validation may run in a different thread, in
+ * parallel with the training, so 'validation_wait_ns' is the time the
+ * training thread was actually stalled waiting for it. */
+#define NR_ERROR_HISTORY 64
+
+/* Hardware performance counters of the training phases, sampled when
+ * NR.TRAIN is called with the PROFILE option, see NRPerfOpen(). The
+ * counters are read around the same samples nn.c times, so they are raw
+ * counts of the profiled samples, not of the whole training: only ratios
+ * like the IPC are meaningful. */
+#define NR_PERF_CYCLES 0
+#define NR_PERF_INSTRUCTIONS 1
+#define NR_PERF_LLC_MISSES 2
+#define NR_PERF_L1D_MISSES 3
+#define NR_PERF_COUNTERS 4
+
+#define NR_PERF_OFF 0           /* PROFILE not requested. */
+#define NR_PERF_ON 1            /* Counters opened. */
+#define NR_PERF_UNAVAILABLE 2   /* perf_event_open() failed, see 'err'. */
+
+typedef struct NRPerfProfile {
+    int status;                 /* NR_PERF_... */
+    int err;                    /* errno, if NR_PERF_UNAVAILABLE. */
+    uint32_t available;         /* Bitmap of the counters we could open. */
+    uint64_t weights;           /* Weights of the network. */
+    uint64_t enabled_ns;        /* Time the counters were enabled... */
+    uint64_t running_ns;        /* ...and actually counting (multiplexing). */
+    struct {
+        uint64_t measured;      /* Times the phase was measured. */
+        uint64_t count[NR_PERF_COUNTERS];
+    } phase[ANN_PHASES];
+} NRPerfProfile;
+
+typedef struct NRTrainingProfile {
+    uint64_t samples;           /* Samples presented to the network. */
+    uint64_t cycles;            /* Training cycles. */
+    uint64_t wall_ms;           /* Training time, not counting the time the
+                                   training was queued or paused. */
+    struct AnnProfile net;      /* Forward, backward, accumulate, update. */
+    uint64_t validation_ns;     /* Test dataset evaluation. */
+    uint64_t validation_wait_ns;/* Waiting for the validator thread. */
+    uint64_t normalization_ns;  /* Normalization of the datasets copies. */
+    uint64_t clone_ns;          /* Copy of the network and datasets. */
+    uint64_t transfer_ns;       /* Copy of the trained weights back. */
+    uint64_t peak_memory;       /* Bytes used by the training. */
+    NRPerfProfile perf;         /* Hardware counters, with PROFILE. */
+    uint32_t history_len;       /* Cycles added to the ring buffer. */
+    struct {
+        uint32_t cycle;
+        float train_error, test_error;
+    } history[NR_ERROR_HISTORY]; /* Errors of the last cycles. */
+} NRTrainingProfile;
+
 typedef struct {
     uint64_t id;        /* Neural network unique ID. */
     uint64_t training_total_steps; /* How many steps of trainig the network
@@ -89,6 +178,13 @@ typedef struct {
     uint64_t training_total_ms;   /* Total milliseconds time of training. */
     uint64_t training_max_cycles; /* Max cycles of a single training. */
     uint64_t training_max_ms; /* Max time of a single training. */
+    uint32_t training_priority; /* Scheduling priority of the training. */
+    uint64_t training_seed; /* PRNG seed if NR_FLAG_TRAIN_SEED is set. */
+    uint32_t training_test_sample; /* If non zero, with AUTOSTOP validate
+                                      every cycle on a stratified sample of
+                                      this many test entries, and evaluate
+                                      the full test dataset only when the
+                                      sample suggests a new best net. */
     uint32_t flags;     /* NR_FLAG_... */
     uint32_t epochs;    /* Number of training epochs so far. */
     struct Ann *nn;     /* Neural network structure. */
@@ -100,8 +196,18 @@ typedef struct {
                                    dataset. Only applicable to nets flagged with
                                    NR_FLAG_CLASSIFIER. */
     /* For normalized (NR_FLAG_NORMALIZE) networks. */
+    float *ishift;         /* Inputs normalization offsets (z-score only). */
     float *inorm;          /* Inputs normalization factors. */
     float *onorm;          /* Outputs normalization factors. */
+    NRStats stats;         /* Training dataset statistics. */
+    uint64_t weights_version;   /* Incremented every time weights change. */
+    struct NRCache *cache;      /* Inference results cache, or NULL. */
+    struct Ann *compiled;       /* Inference ready network, or NULL. */
+    uint64_t compiled_version;  /* Weights version of 'compiled'. */
+    uint64_t inference_calls;   /* Inference commands served, not persisted. */
+    uint64_t inference_rows;    /* Rows of inputs processed by the above. */
+    NRTrainingProfile *training_profile; /* Profile of the last training, or
+                                            NULL. Not persisted. */
 } NRTypeObject;
 
 struct {
@@ -110,24 +216,371 @@ struct {
     int db_id;              /* DB ID where the key is. */
     pthread_t tid;          /* Thread ID of the trainer. */
     int in_progress;        /* 0 if training terminated. */
+    int stop;               /* NR_STOP_... cancellation request. */
+    int paused;             /* True if NR.TRAIN PAUSE was called. */
+    int priority;           /* Scheduling priority, from 0 to 9. */
+    int sched_running;      /* True if holding a CPU of the quota. */
+    int placement;          /* Placement version the thread is using. */
+    uint64_t sched_seq;     /* Queue position among same priority jobs. */
+    long long slice_start;  /* Milliseconds time we got the CPU. */
     NRTypeObject *nr;       /* A copy of the NN we are training. */
     float dataset_error;    /* Dataset error in the last cycle. */
     float test_error;       /* Test error in the last cycle. */
     float class_error;      /* Percentage of wrong classifications. */
     int curcycle;           /* Current cycle. */
+    size_t memory;          /* Estimated memory, for the training budget. */
+    NRTrainingProfile profile; /* Updated by the thread at every cycle. */
 } typedef NRPendingTraining;
 
+/* Values for the 'stop' field of the pending training structure. The
+ * training thread checks it between epochs, and terminates ASAP if it
+ * is not NR_STOP_NONE. */
+#define NR_STOP_NONE 0          /* Keep training. */
+#define NR_STOP_REQUESTED 1     /* NR.TRAIN STOP: stop and keep the result. */
+#define NR_STOP_CANCELLED 2     /* Key deleted or reset: result discarded. */
+
 /* We take an array with NNs currently training in other threads.
  * Every time an NN command is called, we try to see if there are
  * finished trainings, in order to udpate weights of the original
- * NN stored into the key (we work on a copy on the other thread).*/
+ * NN stored into the key (we work on a copy on the other thread).
+ *
+ * The array holds pointers to heap allocated structures, since the
+ * training threads reference their own structure while the array is
+ * compacted when finished trainings are collected. */
 #define NR_PENDING_TRAINING_MAX_LEN 32
 
 static pthread_mutex_t NRPendingTrainingMutex = PTHREAD_MUTEX_INITIALIZER;
+/* Signaled when paused trainings should check their state again. */
+static pthread_cond_t NRPendingTrainingCond = PTHREAD_COND_INITIALIZER;
 /* All the followings must be accessed after acquiring the mutex. */
-static NRPendingTraining NRTrainings[NR_PENDING_TRAINING_MAX_LEN];
+static NRPendingTraining *NRTrainings[NR_PENDING_TRAINING_MAX_LEN];
 static int NRPendingTrainingCount = 0; /* Number of pending trainings. */
 
+/* NR.TRAIN calls refused because of the training memory budget. */
+static uint64_t NRTrainingBudgetRejections = 0;
+
+/* ============================ Module configuration ======================== */
+
+/* Module wide configuration. Options can be set passing <option> <value>
+ * pairs as arguments when loading the module, or at runtime using the
+ * NR.CONFIG SET command. */
+#define NR_CPU_NONE -1
+
+static struct {
+    int training_cpu_quota;     /* Max number of training threads running at
+                                   the same time. Zero means no limit. */
+    int training_cpu_quota_perc;/* If non zero, the quota is this percentage
+                                   of the CPUs available for training. */
+    int training_reserved_cpu;  /* CPU where training threads should not run
+                                   (the one the main thread is pinned to by
+                                   the user), or NR_CPU_NONE. */
+    int inference_threads;      /* Number of inference threads. */
+    long long inference_offload_flops; /* Inference requests needing at least
+                                   this number of floating point operations
+                                   are executed by the inference threads. */
+    long long training_memory_budget; /* Max bytes used by all the trainings
+                                   at the same time. Zero means no limit. */
+} NRConfig = {0, 0, NR_CPU_NONE, 2, 10000000, 0};
+
+/* =========================== Command statistics =========================== */
+
+/* Every command is called via NRDispatch_RedisCommand(), that counts the
+ * calls and records the latency of every command in an histogram. The time
+ * of every call is also split in phases: the commands mark the start of
+ * their phases calling NRStatsPhase(), and the time not belonging to any
+ * marked phase is accounted as "other". Statistics are reported by
+ * NR.STATS, and are only accessed by the main thread.
+ *
+ * Histograms are log-linear like HDR histograms: values below 16 have
+ * their own bucket, then every power of two is split in 8 buckets, so
+ * the error is below 12.5% at any scale, with a fixed size. Values are in
+ * nanoseconds, and the last bucket (about 18 minutes) collects anything
+ * greater. */
+#define NR_PHASE_OTHER 0        /* Not in any marked phase. */
+#define NR_PHASE_COLLECT 1      /* NRCollectThreads(). */
+#define NR_PHASE_PARSE 2        /* Arguments parsing and validation. */
+#define NR_PHASE_SIMULATE 3     /* Running the network. */
+#define NR_PHASE_REPLY 4        /* Building the reply. */
+#define NR_PHASES 5
+
+static const char *NRPhaseNames[NR_PHASES] = {
+    "other", "collect", "parse", "simulate", "reply"
+};
+
+#define NR_HIST_BUCKETS 320
+#define NR_MAX_COMMANDS 32
+
+typedef struct NRHistogram {
+    uint64_t count;         /* Number of values recorded. */
+    uint64_t sum;           /* Sum of the values. */
+    uint64_t max;           /* Greatest value. */
+    uint64_t buckets[NR_HIST_BUCKETS];
+} NRHistogram;
+
+typedef struct NRCommandStats {
+    const char *name;       /* Command name, like "nr.run". */
+    NRHistogram total;      /* Latency of the whole call. */
+    NRHistogram phase[NR_PHASES]; /* Latency of every phase, only for the
+                                     calls that entered the phase. */
+} NRCommandStats;
+
+static NRCommandStats NRCommandStatsTable[NR_MAX_COMMANDS];
+static int NRCommandsCount = 0;
+
+/* The call in progress. Saved and restored by the dispatcher, so commands
+ * called by other commands don't mix their phases. */
+typedef struct NRCall {
+    NRCommandStats *cmd;    /* NULL if no command is in progress. */
+    int phase;              /* Current phase. */
+    int entered;            /* Bitmap of the phases entered. */
+    uint64_t start;         /* Start time of the call. */
+    uint64_t mark;          /* Start time of the current phase. */
+    uint64_t phase_ns[NR_PHASES];
+} NRCall;
+
+static NRCall NRCurrentCall;
+
+uint64_t NRNanoseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+int NRHistogramBucket(uint64_t v) {
+    if (v < 16) return v;
+    int shift = 60-__builtin_clzll(v); /* So that v>>shift is in 8...15. */
+    int idx = 16+(shift-1)*8+(int)((v>>shift)-8);
+    return idx < NR_HIST_BUCKETS ? idx : NR_HIST_BUCKETS-1;
+}
+
+/* Return the greatest value falling in the bucket 'idx'. */
+uint64_t NRHistogramBucketMax(int idx) {
+    if (idx < 16) return idx;
+    int shift = (idx-16)/8+1;
+    uint64_t sub = (idx-16)%8+8;
+    return ((sub+1)<<shift)-1;
+}
+
+void NRHistogramAdd(NRHistogram *h, uint64_t v) {
+    h->count++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+    h->buckets[NRHistogramBucket(v)]++;
+}
+
+/* Return the value at the percentile 'perc' (0-100), as the greatest
+ * value of the bucket holding it. */
+uint64_t NRHistogramPercentile(NRHistogram *h, double perc) {
+    uint64_t target = ceil(h->count*perc/100), seen = 0;
+    if (target == 0) target = 1;
+    for (int j = 0; j < NR_HIST_BUCKETS; j++) {
+        seen += h->buckets[j];
+        if (seen >= target) {
+            uint64_t v = NRHistogramBucketMax(j);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* Enter the specified phase of the current call, returning the previous
+ * phase. Does nothing if called outside of a command. */
+int NRStatsPhase(int phase) {
+    NRCall *c = &NRCurrentCall;
+    int prev = c->phase;
+    if (c->cmd == NULL || phase == prev) return prev;
+
+    uint64_t now = NRNanoseconds();
+    c->phase_ns[prev] += now-c->mark;
+    c->mark = now;
+    c->phase = phase;
+    c->entered |= 1<<phase;
+    return prev;
+}
+
+/* Call the command 'proc' recording its statistics in 'cs'. */
+int NRStatsCall(NRCommandStats *cs, RedisModuleCmdFunc proc, RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    NRCall saved = NRCurrentCall, *c = &NRCurrentCall;
+
+    memset(c,0,sizeof(*c));
+    c->cmd = cs;
+    c->phase = NR_PHASE_OTHER;
+    c->entered = 1<<NR_PHASE_OTHER;
+    c->start = c->mark = NRNanoseconds();
+    int retval = proc(ctx,argv,argc);
+    uint64_t end = NRNanoseconds();
+    c->phase_ns[c->phase] += end-c->mark;
+
+    NRHistogramAdd(&cs->total,end-c->start);
+    for (int j = 0; j < NR_PHASES; j++) {
+        if (c->entered & (1<<j)) NRHistogramAdd(&cs->phase[j],c->phase_ns[j]);
+    }
+    NRCurrentCall = saved;
+    return retval;
+}
+
+/* Reset the statistics of all the commands. */
+void NRStatsReset(void) {
+    for (int j = 0; j < NRCommandsCount; j++) {
+        NRCommandStats *cs = &NRCommandStatsTable[j];
+        memset(&cs->total,0,sizeof(cs->total));
+        memset(cs->phase,0,sizeof(cs->phase));
+    }
+}
+
+/* ============================= Inference cache ============================ */
+
+/* Networks created with the CACHE option remember the outputs computed for
+ * the most recently used input vectors, so that when the inputs space is
+ * small (for instance a few categorical features) most NR.RUN / NR.CLASS
+ * calls are just an hash table lookup.
+ *
+ * Entries are keyed by the inputs vector. Every entry also
+ * stores the full inputs vector, so that hash collisions can't return
+ * wrong results. When the cache is full the least recently used entry is
+ * evicted. The cache is only accessed by the main thread, and it is
+ * flushed as soon as we notice the weights of the network changed. */
+typedef struct NRCacheEntry {
+    uint64_t hash;          /* Hash of the inputs vector. */
+    int32_t prev, next;     /* LRU list, from most recently used. */
+    int32_t bucket_next;    /* Next entry in the same bucket, or -1. */
+} NRCacheEntry;
+
+typedef struct NRCache {
+    uint32_t size;          /* Max number of entries. */
+    uint32_t used;          /* Number of entries in use. */
+    uint32_t mask;          /* Number of buckets minus one. */
+    int32_t *buckets;       /* First entry of every bucket, or -1. */
+    int32_t head, tail;     /* Most and least recently used entries. */
+    NRCacheEntry *entries;
+    float *data;            /* ilen inputs + olen outputs for every entry. */
+    int ilen, olen;
+    uint64_t version;       /* Weights version of the cached outputs. */
+    uint64_t hits, misses;
+} NRCache;
+
+#define NR_CACHE_MAX_SIZE (1<<24)
+
+NRCache *NRCacheCreate(uint32_t size, int ilen, int olen) {
+    NRCache *c = RedisModule_Calloc(1,sizeof(*c));
+    uint32_t buckets = 1;
+
+    while (buckets < size*2) buckets <<= 1;
+    c->size = size;
+    c->mask = buckets-1;
+    c->buckets = RedisModule_Alloc(sizeof(int32_t)*buckets);
+    c->entries = RedisModule_Alloc(sizeof(NRCacheEntry)*size);
+    c->data = RedisModule_Alloc(sizeof(float)*(ilen+olen)*size);
+    c->ilen = ilen;
+    c->olen = olen;
+    memset(c->buckets,0xff,sizeof(int32_t)*buckets);
+    c->head = c->tail = -1;
+    return c;
+}
+
+/* Return the bytes NRCacheCreate() allocates for the specified cache. */
+size_t NRCacheMemoryUsage(uint32_t size, int ilen, int olen) {
+    uint32_t buckets = 1;
+
+    while (buckets < size*2) buckets <<= 1;
+    return sizeof(NRCache) + sizeof(int32_t)*buckets +
+           (sizeof(NRCacheEntry) + sizeof(float)*(ilen+olen))*(size_t)size;
+}
+
+void NRCacheFree(NRCache *c) {
+    if (c == NULL) return;
+    RedisModule_Free(c->buckets);
+    RedisModule_Free(c->entries);
+    RedisModule_Free(c->data);
+    RedisModule_Free(c);
+}
+
+/* Remove all the entries. Statistics are retained. */
+void NRCacheFlush(NRCache *c) {
+    memset(c->buckets,0xff,sizeof(int32_t)*(c->mask+1));
+    c->used = 0;
+    c->head = c->tail = -1;
+}
+
+/* FNV-1a hash of the inputs vector. */
+uint64_t NRCacheHash(float *inputs, int ilen) {
+    unsigned char *p = (unsigned char*)inputs;
+    uint64_t h = 14695981039346656037ULL;
+
+    for (size_t j = 0; j < sizeof(float)*ilen; j++) {
+        h ^= p[j];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+void NRCacheUnlink(NRCache *c, int32_t e) {
+    NRCacheEntry *ce = c->entries+e;
+    if (ce->prev != -1) c->entries[ce->prev].next = ce->next;
+    else c->head = ce->next;
+    if (ce->next != -1) c->entries[ce->next].prev = ce->prev;
+    else c->tail = ce->prev;
+}
+
+void NRCacheLinkHead(NRCache *c, int32_t e) {
+    NRCacheEntry *ce = c->entries+e;
+    ce->prev = -1;
+    ce->next = c->head;
+    if (c->head != -1) c->entries[c->head].prev = e;
+    c->head = e;
+    if (c->tail == -1) c->tail = e;
+}
+
+/* Lookup the outputs for the specified inputs, computed with the weights
+ * having the specified version. On hit the outputs are returned, and the
+ * entry becomes the most recently used. Otherwise NULL is returned. The
+ * hash of the inputs is stored in '*hash' to be used by NRCacheAdd(). */
+float *NRCacheLookup(NRCache *c, uint64_t version, float *inputs, uint64_t *hash) {
+    if (c->version != version) {
+        NRCacheFlush(c);
+        c->version = version;
+    }
+    *hash = NRCacheHash(inputs,c->ilen);
+    int32_t e = c->buckets[*hash & c->mask];
+    while (e != -1) {
+        float *data = c->data+(size_t)e*(c->ilen+c->olen);
+        if (c->entries[e].hash == *hash &&
+            memcmp(data,inputs,sizeof(float)*c->ilen) == 0)
+        {
+            NRCacheUnlink(c,e);
+            NRCacheLinkHead(c,e);
+            c->hits++;
+            return data+c->ilen;
+        }
+        e = c->entries[e].bucket_next;
+    }
+    c->misses++;
+    return NULL;
+}
+
+/* Add the outputs for the specified inputs, after a failed lookup. */
+void NRCacheAdd(NRCache *c, uint64_t hash, float *inputs, float *outputs) {
+    int32_t e;
+
+    if (c->used < c->size) {
+        e = c->used++;
+    } else {
+        /* Evict the least recently used entry. */
+        e = c->tail;
+        NRCacheUnlink(c,e);
+        int32_t *link = &c->buckets[c->entries[e].hash & c->mask];
+        while (*link != e) link = &c->entries[*link].bucket_next;
+        *link = c->entries[e].bucket_next;
+    }
+    float *data = c->data+(size_t)e*(c->ilen+c->olen);
+    memcpy(data,inputs,sizeof(float)*c->ilen);
+    memcpy(data+c->ilen,outputs,sizeof(float)*c->olen);
+    c->entries[e].hash = hash;
+    c->entries[e].bucket_next = c->buckets[hash & c->mask];
+    c->buckets[hash & c->mask] = e;
+    NRCacheLinkHead(c,e);
+}
+
 /* ========================== Low level object API ========================== */
 
 long long NRMilliseconds(void) {
@@ -140,6 +593,66 @@ long long NRMilliseconds(void) {
     return ust/1000;
 }
 
+/* Allocate the statistics for a dataset of 'ilen' inputs and 'olen'
+ * outputs. */
+void NRStatsInit(NRStats *st, int ilen, int olen) {
+    st->count = 0;
+    st->imax = RedisModule_Calloc(1,sizeof(float)*ilen);
+    st->omax = RedisModule_Calloc(1,sizeof(float)*olen);
+    st->imean = RedisModule_Calloc(1,sizeof(double)*ilen);
+    st->im2 = RedisModule_Calloc(1,sizeof(double)*ilen);
+}
+
+void NRStatsFree(NRStats *st) {
+    RedisModule_Free(st->imax);
+    RedisModule_Free(st->omax);
+    RedisModule_Free(st->imean);
+    RedisModule_Free(st->im2);
+}
+
+/* Update the statistics with a sample added to the dataset. */
+void NRStatsAdd(NRStats *st, float *inputs, float *outputs, int ilen, int olen) {
+    st->count++;
+    for (int j = 0; j < ilen; j++) {
+        double delta = inputs[j] - st->imean[j];
+        st->imean[j] += delta / st->count;
+        st->im2[j] += delta * (inputs[j] - st->imean[j]);
+        if (fabs(inputs[j]) > st->imax[j]) st->imax[j] = fabs(inputs[j]);
+    }
+    for (int j = 0; j < olen; j++)
+        if (fabs(outputs[j]) > st->omax[j]) st->omax[j] = fabs(outputs[j]);
+}
+
+/* Update the statistics with a sample removed from the dataset. */
+void NRStatsRemove(NRStats *st, float *inputs, int ilen) {
+    if (st->count == 0) return;
+    st->count--;
+    for (int j = 0; j < ilen; j++) {
+        if (st->count == 0) {
+            st->imean[j] = 0;
+            st->im2[j] = 0;
+            continue;
+        }
+        double delta = inputs[j] - st->imean[j];
+        st->imean[j] -= delta / st->count;
+        st->im2[j] -= delta * (inputs[j] - st->imean[j]);
+        if (st->im2[j] < 0) st->im2[j] = 0; /* Rounding errors. */
+    }
+}
+
+/* Rebuild the statistics from the samples of the dataset 'ds'. Used when
+ * the dataset is loaded from disk. */
+void NRStatsRebuild(NRStats *st, NRDataset *ds, int ilen, int olen) {
+    st->count = 0;
+    memset(st->imax,0,sizeof(float)*ilen);
+    memset(st->omax,0,sizeof(float)*olen);
+    memset(st->imean,0,sizeof(double)*ilen);
+    memset(st->im2,0,sizeof(double)*ilen);
+    for (uint32_t j = 0; j < ds->len; j++)
+        NRStatsAdd(st,ds->inputs+(size_t)j*ilen,ds->outputs+(size_t)j*olen,
+                   ilen,olen);
+}
+
 /* Create a network with the specified parameters. Note that the layers
  * must be specified from the output layer[0] to the input
  * layer[N]. Each element in the integer array 'layer' specify how many
@@ -154,30 +667,76 @@ NRTypeObject *createNRTypeObject(int flags, int *layers, int numlayers, int dset
     o->test.maxlen = test_len;
     int ilen = INPUT_UNITS(o->nn);
     int olen = OUTPUT_UNITS(o->nn);
+    o->ishift = RedisModule_Calloc(1,sizeof(float)*ilen);
     o->inorm = RedisModule_Calloc(1,sizeof(float)*ilen);
     o->onorm = RedisModule_Calloc(1,sizeof(float)*olen);
     for (int j = 0; j < ilen; j++) o->inorm[j] = 1;
     for (int j = 0; j < olen; j++) o->onorm[j] = 1;
+    NRStatsInit(&o->stats,ilen,olen);
     return o;
 }
 
+/* Allocate the arrays of the dataset for 'rows' rows of 'ilen' inputs
+ * and 'olen' outputs, without setting its length. The arrays are allocated
+ * as read-mostly regions, see AnnAllocRegion(): datasets are written only
+ * when samples are added, so large datasets are kept in pages of their
+ * own, that inference and the child saving the RDB file never copy. */
+void NRDatasetAlloc(NRDataset *ds, uint32_t rows, int ilen, int olen) {
+    ds->cap = rows;
+    ds->inputs = rows ? AnnAllocRegion(sizeof(float)*ilen*rows) : NULL;
+    ds->outputs = rows ? AnnAllocRegion(sizeof(float)*olen*rows) : NULL;
+}
+
+/* Make sure the dataset has room for 'rows' rows. The capacity grows
+ * geometrically, up to the dataset maximum length, so that adding
+ * samples one by one does not copy the whole dataset every time. */
+#define NR_DATASET_MIN_CAP 16
+void NRDatasetReserve(NRDataset *ds, uint32_t rows, int ilen, int olen) {
+    if (rows <= ds->cap) return;
+    uint64_t cap = ds->cap < NR_DATASET_MIN_CAP ? NR_DATASET_MIN_CAP :
+                                                  (uint64_t)ds->cap*2;
+    if (cap > ds->maxlen) cap = ds->maxlen;
+    if (cap < rows) cap = rows;
+    ds->inputs = AnnReallocRegion(ds->inputs,sizeof(float)*ilen*ds->len,
+                                  sizeof(float)*ilen*cap);
+    ds->outputs = AnnReallocRegion(ds->outputs,sizeof(float)*olen*ds->len,
+                                   sizeof(float)*olen*cap);
+    ds->cap = cap;
+}
+
+/* Return the bytes allocated for the dataset arrays. */
+size_t NRDatasetMemoryUsage(NRDataset *ds) {
+    return AnnRegionSize(ds->inputs) + AnnRegionSize(ds->outputs);
+}
+
+/* Return the bytes NRDatasetAlloc() allocates for 'rows' rows. */
+size_t NRDatasetLayoutMemoryUsage(uint64_t rows, size_t ilen, size_t olen) {
+    if (rows == 0) return 0;
+    return AnnRegionAllocSize(sizeof(float)*ilen*rows) +
+           AnnRegionAllocSize(sizeof(float)*olen*rows);
+}
+
 /* Insert data (observations needed to train and test the NN) into the
  * NN object. While the learning and testing datasets are yet not full
  * the observed pattern is inserted evenly in one or the other side in
  * order to make sure the two datasets are populated evenly. When both
  * are already full, a random elmenet from one or the other (doing
  * a random weighted choice depending on the length) is substituted with
- * the new item. */
+ * the new item.
+ *
+ * The dataset the item was stored into is returned, and its position is
+ * set in '*pos', so that the caller can propagate the exact write. NULL
+ * is returned if the network has no dataset at all. */
 #define NR_INSERT_NO_TARGET 0   /* Auto select where to insert. */
 #define NR_INSERT_TRAIN 1       /* Insert in training dataset. */
 #define NR_INSERT_TEST 2        /* Insert in testing dataset. */
-void NRTypeInsertData(NRTypeObject *o, float *inputs, float *outputs,
-                      int target_ds) {
+NRDataset *NRTypeInsertData(NRTypeObject *o, float *inputs, float *outputs,
+                            int target_ds, uint32_t *pos) {
     NRDataset *target = NULL;
 
     /* Check if there is no dataset at all. This may be a valid setup
      * with online learning, sample by sample. */
-    if (o->dataset.maxlen == 0 && o->test.maxlen == 0) return;
+    if (o->dataset.maxlen == 0 && o->test.maxlen == 0) return NULL;
 
     /* If the user specified a target, select it. */
     if (target_ds == NR_INSERT_TRAIN) target = &o->dataset;
@@ -204,7 +763,7 @@ void NRTypeInsertData(NRTypeObject *o, float *inputs, float *outputs,
             float fill_b = (float)o->test.len / o->test.maxlen;
             target = (fill_a <= fill_b) ? &o->dataset : &o->test;
         } else {
-            double r = rand()/RAND_MAX;
+            double r = AnnRandomFloat(o->nn);
             double sumlen = o->dataset.maxlen + o->test.maxlen;
             if (r < (double)o->dataset.maxlen/sumlen) {
                 target = &o->dataset;
@@ -218,16 +777,20 @@ void NRTypeInsertData(NRTypeObject *o, float *inputs, float *outputs,
     size_t idx;
     int j, numin = INPUT_UNITS(o->nn),
            numout = OUTPUT_UNITS(o->nn);
+    int replace = target->maxlen == target->len;
 
-    if (target->maxlen == target->len) {
-        idx = rand() % target->maxlen;
+    if (replace) {
+        idx = AnnRandom(o->nn) % target->maxlen;
     } else {
         idx = target->len;
+        NRDatasetReserve(target,target->len+1,numin,numout);
         target->len++;
-        target->inputs = RedisModule_Realloc(target->inputs,
-            sizeof(float)*numin*target->len);
-        target->outputs = RedisModule_Realloc(target->outputs,
-            sizeof(float)*numout*target->len);
+    }
+
+    /* Keep the training dataset statistics updated. */
+    if (target == &o->dataset) {
+        if (replace) NRStatsRemove(&o->stats,target->inputs+idx*numin,numin);
+        NRStatsAdd(&o->stats,inputs,outputs,numin,numout);
     }
 
     /* Finally store the values at position. */
@@ -235,61 +798,817 @@ void NRTypeInsertData(NRTypeObject *o, float *inputs, float *outputs,
         target->inputs[idx*numin+j] = inputs[j];
     for (j = 0; j < numout; j++)
         target->outputs[idx*numout+j] = outputs[j];
+    *pos = idx;
+    return target;
 }
 
 /* Free the specified dataset. */
 void NRDatasetFree(NRDataset *dset) {
-    RedisModule_Free(dset->inputs);
-    RedisModule_Free(dset->outputs);
+    AnnFreeRegion(dset->inputs);
+    AnnFreeRegion(dset->outputs);
 }
 
 /* Free a whole NN object. */
 void NRTypeReleaseObject(NRTypeObject *o) {
-    AnnFree(o->nn);
+    AnnRelease(o->nn);
+    if (o->compiled) AnnRelease(o->compiled);
+    NRCacheFree(o->cache);
     NRDatasetFree(&o->dataset);
     NRDatasetFree(&o->test);
+    NRStatsFree(&o->stats);
+    RedisModule_Free(o->ishift);
     RedisModule_Free(o->inorm);
     RedisModule_Free(o->onorm);
+    RedisModule_Free(o->training_profile);
     RedisModule_Free(o);
 }
 
+/* Return the bytes used by the normalization vectors and the training
+ * dataset statistics of a network with the specified inputs and outputs. */
+size_t NRTypeVectorsMemoryUsage(size_t ilen, size_t olen) {
+    return sizeof(float)*(ilen*3+olen*2) + sizeof(double)*ilen*2;
+}
+
+/* Return the bytes of the NN object kept in read-mostly regions, see
+ * AnnAllocRegion(): the weights of the inference copy and the datasets. */
+size_t NRTypeReadMostlyMemoryUsage(NRTypeObject *o) {
+    size_t bytes = NRDatasetMemoryUsage(&o->dataset) +
+                   NRDatasetMemoryUsage(&o->test);
+    if (o->compiled) bytes += AnnRegionSize(o->compiled->region);
+    return bytes;
+}
+
+/* Return the bytes of the NN object that inference writes: the object
+ * itself, where the inference counters are, and the cache. While the
+ * child saving the RDB file is running, only the pages holding them may
+ * be copied because of inference. */
+size_t NRTypeCowExposedMemoryUsage(NRTypeObject *o) {
+    size_t bytes = sizeof(*o);
+    if (o->cache) bytes += NRCacheMemoryUsage(o->cache->size,
+        INPUT_UNITS(o->nn),OUTPUT_UNITS(o->nn));
+    return bytes;
+}
+
+/* Return the bytes used by the NN object and everything it references:
+ * the network, its inference copy, the datasets and the cache. */
+size_t NRTypeMemoryUsage(NRTypeObject *o) {
+    size_t ilen = INPUT_UNITS(o->nn), olen = OUTPUT_UNITS(o->nn);
+    size_t bytes = sizeof(*o) + AnnMemoryUsage(o->nn) +
+                   NRTypeVectorsMemoryUsage(ilen,olen);
+
+    if (o->compiled) bytes += AnnMemoryUsage(o->compiled);
+    if (o->cache) bytes += NRCacheMemoryUsage(o->cache->size,ilen,olen);
+    bytes += NRDatasetMemoryUsage(&o->dataset) + NRDatasetMemoryUsage(&o->test);
+    if (o->training_profile) bytes += sizeof(*o->training_profile);
+    return bytes;
+}
+
+/* ============================== Serialization ============================= */
+
+/* Networks and datasets are serialized with floats in little endian
+ * IEEE 754 format, regardless of the host byte order. */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define NR_BIG_ENDIAN 1
+#else
+#define NR_BIG_ENDIAN 0
+#endif
+
+/* Swap the bytes of every float of the array if we are on a big endian
+ * host, so that the array is converted from / to little endian. */
+void NRFloatsToLittleEndian(float *v, size_t len) {
+    if (!NR_BIG_ENDIAN) return;
+    uint32_t *u = (uint32_t*)v;
+    for (size_t j = 0; j < len; j++) u[j] = __builtin_bswap32(u[j]);
+}
+
+/* Datasets are often very compressible: bag of words inputs are mostly
+ * zeros, pixels are small integers, and so forth. So starting with RDB
+ * encoding version 7, datasets are saved in blocks of NR_CODEC_BLOCK_ROWS
+ * rows, and inside every block each column (every input and every output)
+ * is encoded with the smallest of the following lossless codecs:
+ *
+ * ZERO: all the values are zero, nothing else is stored.
+ * INT8 / INT16: all the values are integers in the int8 / int16 range.
+ * FP16: all the values are exactly representable as half floats.
+ * RAW: little endian floats.
+ * SPARSE: the number of non zero values, the codec used for them (one of
+ *         the above), the varint encoded row deltas of the non zero
+ *         values, and the non zero values.
+ *
+ * Every column starts with a byte with the codec type. Blocks are saved as
+ * RDB strings, so Redis will further compress them with LZF if RDB
+ * compression is enabled. Blocks are decoded one after the other while
+ * loading, directly into the dataset arrays. */
+#define NR_CODEC_BLOCK_ROWS 4096
+#define NR_CODEC_ZERO 0
+#define NR_CODEC_RAW 1
+#define NR_CODEC_FP16 2
+#define NR_CODEC_INT8 3
+#define NR_CODEC_INT16 4
+#define NR_CODEC_SPARSE 5
+
+typedef struct NRCodecBuf {
+    unsigned char *p;
+    size_t len, size;
+} NRCodecBuf;
+
+void NRCodecPut(NRCodecBuf *b, const void *src, size_t len) {
+    if (b->len+len > b->size) {
+        b->size = (b->len+len)*2;
+        b->p = RedisModule_Realloc(b->p,b->size);
+    }
+    memcpy(b->p+b->len,src,len);
+    b->len += len;
+}
+
+void NRCodecPutVarint(NRCodecBuf *b, uint32_t v) {
+    unsigned char buf[5];
+    int len = 0;
+    while (v >= 0x80) {
+        buf[len++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    buf[len++] = v;
+    NRCodecPut(b,buf,len);
+}
+
+int NRCodecVarintLen(uint32_t v) {
+    int len = 1;
+    while (v >= 0x80) {
+        len++;
+        v >>= 7;
+    }
+    return len;
+}
+
+/* Convert 'f' to an half float. Returns 0 if 'f' can't be represented
+ * exactly. */
+int NRFloatToHalf(float f, uint16_t *h) {
+    uint32_t bits;
+    memcpy(&bits,&f,sizeof(bits));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    int exp = (bits >> 23) & 0xff;
+    uint32_t mant = bits & 0x7fffff;
+
+    if (exp == 0 && mant == 0) {            /* Zero. */
+        *h = sign;
+        return 1;
+    }
+    if (exp == 0xff) {                      /* Inf, NaN is not supported. */
+        if (mant) return 0;
+        *h = sign | 0x7c00;
+        return 1;
+    }
+    if (exp == 0) return 0;                 /* Float subnormals are too small. */
+    int e = exp-127;
+    if (e > 15 || e < -24) return 0;
+    if (e >= -14) {                         /* Normal half. */
+        if (mant & 0x1fff) return 0;
+        *h = sign | ((e+15) << 10) | (mant >> 13);
+        return 1;
+    }
+    uint32_t m = mant | 0x800000;           /* Subnormal half. */
+    int shift = -(e+1);
+    if (m & ((1U<<shift)-1)) return 0;
+    *h = sign | (m >> shift);
+    return 1;
+}
+
+float NRHalfToFloat(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    int exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t bits;
+    float f;
+
+    if (exp == 0) {
+        f = mant * (1.0f/16777216.0f);      /* Zero or subnormal. */
+        return sign ? -f : f;
+    }
+    if (exp == 0x1f)
+        bits = sign | 0x7f800000 | (mant << 13);
+    else
+        bits = sign | ((uint32_t)(exp-15+127) << 23) | (mant << 13);
+    memcpy(&f,&bits,sizeof(f));
+    return f;
+}
+
+/* Bytes used by 'count' values with the specified codec. */
+size_t NRCodecValuesLen(int codec, size_t count) {
+    switch(codec) {
+    case NR_CODEC_INT8: return count;
+    case NR_CODEC_INT16: case NR_CODEC_FP16: return count*2;
+    case NR_CODEC_RAW: return count*4;
+    default: return 0;
+    }
+}
+
+/* Flags used to find the values codecs applicable to a set of values. */
+#define NR_CODEC_CAN_INT8 (1<<0)
+#define NR_CODEC_CAN_INT16 (1<<1)
+#define NR_CODEC_CAN_FP16 (1<<2)
+
+int NRCodecValueFlags(float v) {
+    int flags = 0;
+    uint16_t h;
+    if (v >= INT16_MIN && v <= INT16_MAX && v == (int16_t)v &&
+        !(v == 0 && signbit(v)))
+    {
+        flags |= NR_CODEC_CAN_INT16;
+        if (v >= INT8_MIN && v <= INT8_MAX) flags |= NR_CODEC_CAN_INT8;
+    }
+    if (NRFloatToHalf(v,&h)) flags |= NR_CODEC_CAN_FP16;
+    return flags;
+}
+
+/* Return the smallest codec for values with the specified flags. */
+int NRCodecForFlags(int flags) {
+    if (flags & NR_CODEC_CAN_INT8) return NR_CODEC_INT8;
+    if (flags & NR_CODEC_CAN_INT16) return NR_CODEC_INT16;
+    if (flags & NR_CODEC_CAN_FP16) return NR_CODEC_FP16;
+    return NR_CODEC_RAW;
+}
+
+void NRCodecPutValue(NRCodecBuf *b, int codec, float v) {
+    if (codec == NR_CODEC_INT8) {
+        int8_t i = v;
+        NRCodecPut(b,&i,1);
+    } else if (codec == NR_CODEC_INT16) {
+        uint16_t i = (uint16_t)(int16_t)v;
+        unsigned char le[2] = {i & 0xff, i >> 8};
+        NRCodecPut(b,le,2);
+    } else if (codec == NR_CODEC_FP16) {
+        uint16_t h;
+        NRFloatToHalf(v,&h);
+        unsigned char le[2] = {h & 0xff, h >> 8};
+        NRCodecPut(b,le,2);
+    } else {
+        NRFloatsToLittleEndian(&v,1);
+        NRCodecPut(b,&v,4);
+    }
+}
+
+/* Encode the 'rows' values of a column: the first value is at 'v', the
+ * next ones every 'stride' floats. */
+void NRCodecEncodeColumn(NRCodecBuf *b, float *v, size_t stride, uint32_t rows) {
+    int flags = NR_CODEC_CAN_INT8|NR_CODEC_CAN_INT16|NR_CODEC_CAN_FP16;
+    int nzflags = flags;
+    uint32_t nz = 0, last = 0;
+    size_t idxlen = 0;
+
+    for (uint32_t j = 0; j < rows; j++) {
+        float x = v[j*stride];
+        int f = NRCodecValueFlags(x);
+        flags &= f;
+        if (x == 0 && !signbit(x)) continue;
+        nzflags &= f;
+        idxlen += NRCodecVarintLen(j-last);
+        last = j;
+        nz++;
+    }
+
+    unsigned char codec;
+    if (nz == 0) {
+        codec = NR_CODEC_ZERO;
+        NRCodecPut(b,&codec,1);
+        return;
+    }
+
+    int dense = NRCodecForFlags(flags), nzcodec = NRCodecForFlags(nzflags);
+    size_t denselen = NRCodecValuesLen(dense,rows);
+    size_t sparselen = NRCodecVarintLen(nz)+1+idxlen+
+                       NRCodecValuesLen(nzcodec,nz);
+    if (sparselen < denselen) {
+        unsigned char vcodec = nzcodec;
+        codec = NR_CODEC_SPARSE;
+        NRCodecPut(b,&codec,1);
+        NRCodecPutVarint(b,nz);
+        NRCodecPut(b,&vcodec,1);
+        last = 0;
+        for (uint32_t j = 0; j < rows; j++) {
+            float x = v[j*stride];
+            if (x == 0 && !signbit(x)) continue;
+            NRCodecPutVarint(b,j-last);
+            last = j;
+        }
+        for (uint32_t j = 0; j < rows; j++) {
+            float x = v[j*stride];
+            if (x == 0 && !signbit(x)) continue;
+            NRCodecPutValue(b,nzcodec,x);
+        }
+    } else {
+        codec = dense;
+        NRCodecPut(b,&codec,1);
+        for (uint32_t j = 0; j < rows; j++)
+            NRCodecPutValue(b,dense,v[j*stride]);
+    }
+}
+
+/* Reader of an encoded block. On malformed input 'err' is set, and the
+ * read functions return zero from that point. */
+typedef struct NRCodecReader {
+    unsigned char *p, *end;
+    int err;
+} NRCodecReader;
+
+int NRCodecGet(NRCodecReader *r, void *dst, size_t len) {
+    if (r->err || (size_t)(r->end - r->p) < len) {
+        r->err = 1;
+        memset(dst,0,len);
+        return 0;
+    }
+    memcpy(dst,r->p,len);
+    r->p += len;
+    return 1;
+}
+
+uint32_t NRCodecGetVarint(NRCodecReader *r) {
+    uint32_t v = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        unsigned char c;
+        if (!NRCodecGet(r,&c,1)) return 0;
+        v |= (uint32_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) return v;
+    }
+    r->err = 1;
+    return 0;
+}
+
+float NRCodecGetValue(NRCodecReader *r, int codec) {
+    unsigned char le[4];
+    if (codec == NR_CODEC_INT8) {
+        NRCodecGet(r,le,1);
+        return (int8_t)le[0];
+    } else if (codec == NR_CODEC_INT16) {
+        NRCodecGet(r,le,2);
+        return (int16_t)(le[0] | (le[1] << 8));
+    } else if (codec == NR_CODEC_FP16) {
+        NRCodecGet(r,le,2);
+        return NRHalfToFloat(le[0] | (le[1] << 8));
+    } else if (codec == NR_CODEC_RAW) {
+        float f;
+        NRCodecGet(r,&f,4);
+        NRFloatsToLittleEndian(&f,1);
+        return f;
+    }
+    r->err = 1;
+    return 0;
+}
+
+/* Decode a column encoded by NRCodecEncodeColumn(). */
+void NRCodecDecodeColumn(NRCodecReader *r, float *v, size_t stride, uint32_t rows) {
+    unsigned char codec;
+    NRCodecGet(r,&codec,1);
+
+    if (codec == NR_CODEC_ZERO || codec == NR_CODEC_SPARSE) {
+        for (uint32_t j = 0; j < rows; j++) v[j*stride] = 0;
+        if (codec == NR_CODEC_ZERO) return;
+
+        uint32_t nz = NRCodecGetVarint(r);
+        unsigned char vcodec;
+        NRCodecGet(r,&vcodec,1);
+        if (nz > rows) r->err = 1;
+        if (r->err) return;
+
+        /* Indexes and values are stored in two different runs: we need a
+         * second reader for the values. */
+        unsigned char *idx = r->p;
+        for (uint32_t j = 0; j < nz; j++) NRCodecGetVarint(r);
+        NRCodecReader vr = *r;
+        r->p = idx;
+        uint32_t row = 0;
+        for (uint32_t j = 0; j < nz; j++) {
+            row += NRCodecGetVarint(r);
+            float x = NRCodecGetValue(&vr,vcodec);
+            if (r->err || vr.err || row >= rows) {
+                r->err = 1;
+                return;
+            }
+            v[row*stride] = x;
+        }
+        r->p = vr.p;
+    } else {
+        for (uint32_t j = 0; j < rows; j++)
+            v[j*stride] = NRCodecGetValue(r,codec);
+    }
+}
+
+/* Serialize the state of a network, without the datasets, appending it to
+ * 'b'. This is the format of the NR.SETWEIGHTS payload, used in order to
+ * propagate trained weights to replicas and AOF, and of the NR.EXPORT
+ * payload. All the values are little endian:
+ *
+ * "NRW" and the format version (one byte).
+ * Content flags (NR_NET_BLOB_...), only from version 2.
+ * The number of layers, and the units of every layer, without biases.
+ * Flags, datasets max length, cache size, training stats.
+ * For every layer of weights: the activation function (only from version
+ * 2), the init method, weights, and unless NR_NET_BLOB_WEIGHTS_ONLY is
+ * set the RPROP deltas and past gradients.
+ * The normalization vectors and the PRNG state. */
+#define NR_NET_BLOB_VER 2
+#define NR_NET_BLOB_WEIGHTS_ONLY (1<<0) /* No training state. */
+#define NR_ACT_SIGMOID 0                /* The only activation supported. */
+#define NR_MAX_WEIGHTS ((size_t)1<<30)  /* Max weights of a loaded network. */
+
+/* Add the weights of a rows x cols matrix to '*total'. Return 0 if the sum
+ * overflows or exceeds NR_MAX_WEIGHTS: layouts coming from a payload are
+ * checked with this function before allocating anything. */
+int NRAddWeights(size_t *total, size_t rows, size_t cols) {
+    size_t w;
+    if (__builtin_mul_overflow(rows,cols,&w) ||
+        __builtin_add_overflow(*total,w,total)) return 0;
+    return *total <= NR_MAX_WEIGHTS;
+}
+
+void NRCodecPutU32(NRCodecBuf *b, uint32_t v) {
+    unsigned char le[4] = {v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, v >> 24};
+    NRCodecPut(b,le,4);
+}
+
+void NRCodecPutU64(NRCodecBuf *b, uint64_t v) {
+    NRCodecPutU32(b,v & 0xffffffff);
+    NRCodecPutU32(b,v >> 32);
+}
+
+void NRCodecPutFloats(NRCodecBuf *b, float *v, size_t len) {
+    size_t start = b->len;
+    NRCodecPut(b,v,sizeof(float)*len);
+    NRFloatsToLittleEndian((float*)(b->p+start),len);
+}
+
+uint32_t NRCodecGetU32(NRCodecReader *r) {
+    unsigned char le[4];
+    NRCodecGet(r,le,4);
+    return le[0] | (le[1] << 8) | (le[2] << 16) | ((uint32_t)le[3] << 24);
+}
+
+uint64_t NRCodecGetU64(NRCodecReader *r) {
+    uint64_t lo = NRCodecGetU32(r);
+    return lo | ((uint64_t)NRCodecGetU32(r) << 32);
+}
+
+float NRCodecGetFloat(NRCodecReader *r) {
+    float f;
+    NRCodecGet(r,&f,4);
+    NRFloatsToLittleEndian(&f,1);
+    return f;
+}
+
+void NRCodecGetFloats(NRCodecReader *r, float *v, size_t len) {
+    NRCodecGet(r,v,sizeof(float)*len);
+    NRFloatsToLittleEndian(v,len);
+}
+
+void NRSerializeNet(NRCodecBuf *b, NRTypeObject *nr, uint32_t contents) {
+    struct Ann *nn = nr->nn;
+
+    NRCodecPut(b,"NRW",3);
+    unsigned char ver = NR_NET_BLOB_VER;
+    NRCodecPut(b,&ver,1);
+    NRCodecPutU32(b,contents);
+    NRCodecPutU32(b,LAYERS(nn));
+    for (int j = 0; j < LAYERS(nn); j++)
+        NRCodecPutU32(b,UNITS(nn,j) - (j != 0)); /* Don't count the bias. */
+
+    NRCodecPutU32(b,nr->flags & NR_FLAG_TO_PRESIST);
+    NRCodecPutU32(b,nr->dataset.maxlen);
+    NRCodecPutU32(b,nr->test.maxlen);
+    NRCodecPutU64(b,nr->cache ? nr->cache->size : 0);
+    NRCodecPutU64(b,nr->training_total_steps);
+    NRCodecPutU64(b,nr->training_total_ms);
+    NRCodecPutU64(b,nr->training_max_cycles);
+    NRCodecPutU64(b,nr->training_max_ms);
+    NRCodecPutFloats(b,&nr->dataset_error,1);
+    NRCodecPutFloats(b,&nr->test_error,1);
+    NRCodecPutFloats(b,&nr->test_class_error,1);
+
+    for (int j = 1; j < LAYERS(nn); j++) {
+        NRCodecPutU32(b,NR_ACT_SIGMOID);
+        NRCodecPutU32(b,nn->layer[j].init);
+        NRCodecPutFloats(b,nn->layer[j].weight,WEIGHTS(nn,j));
+        if (contents & NR_NET_BLOB_WEIGHTS_ONLY) continue;
+        NRCodecPutFloats(b,nn->layer[j].delta,WEIGHTS(nn,j));
+        NRCodecPutFloats(b,nn->layer[j].pgradient,WEIGHTS(nn,j));
+    }
+    NRCodecPutFloats(b,nr->inorm,INPUT_UNITS(nn));
+    NRCodecPutFloats(b,nr->onorm,OUTPUT_UNITS(nn));
+    NRCodecPutFloats(b,nr->ishift,INPUT_UNITS(nn));
+    for (int j = 0; j < 4; j++) NRCodecPutU64(b,nn->rng[j]);
+}
+
+/* Create a network from the state serialized by NRSerializeNet(). The
+ * datasets are empty. On error NULL is returned, and '*err' is set to
+ * the error message. */
+NRTypeObject *NRDeserializeNet(NRCodecReader *r, const char **err) {
+    unsigned char hdr[4];
+    int layers[NR_MAX_LAYERS];
+
+    *err = "ERR invalid neural network serialization format";
+    NRCodecGet(r,hdr,4);
+    if (r->err || memcmp(hdr,"NRW",3)) return NULL;
+    if (hdr[3] < 1 || hdr[3] > NR_NET_BLOB_VER) {
+        *err = "ERR unsupported neural network serialization version";
+        return NULL;
+    }
+    int ver = hdr[3];
+    uint32_t contents = (ver >= 2) ? NRCodecGetU32(r) : 0;
+    int arrays = (contents & NR_NET_BLOB_WEIGHTS_ONLY) ? 1 : 3;
+
+    /* Check the layout, and that the payload is big enough for the weights
+     * before allocating anything. */
+    uint32_t numlayers = NRCodecGetU32(r);
+    if (r->err || numlayers < 2 || numlayers > NR_MAX_LAYERS) return NULL;
+    for (uint32_t j = 0; j < numlayers; j++) {
+        uint32_t units = NRCodecGetU32(r);
+        if (r->err || units == 0 || units > INT32_MAX/2) return NULL;
+        layers[j] = units;
+    }
+    size_t weights = 0;
+    for (uint32_t j = 1; j < numlayers; j++) {
+        if (!NRAddWeights(&weights,(size_t)layers[j]+1,
+                          (size_t)layers[j-1]+(j-1 != 0))) return NULL;
+    }
+    if (weights > (size_t)(r->end - r->p)/(sizeof(float)*arrays)) return NULL;
+
+    uint32_t flags = NRCodecGetU32(r) & NR_FLAG_TO_PRESIST;
+    uint32_t dset_len = NRCodecGetU32(r);
+    uint32_t test_len = NRCodecGetU32(r);
+    uint64_t cache_size = NRCodecGetU64(r);
+    if (r->err || cache_size > NR_CACHE_MAX_SIZE) return NULL;
+
+    NRTypeObject *nr = createNRTypeObject(flags,layers,numlayers,
+                                          dset_len,test_len);
+    struct Ann *nn = nr->nn;
+    if (cache_size) nr->cache = NRCacheCreate(cache_size,
+        INPUT_UNITS(nn),OUTPUT_UNITS(nn));
+    nr->training_total_steps = NRCodecGetU64(r);
+    nr->training_total_ms = NRCodecGetU64(r);
+    nr->training_max_cycles = NRCodecGetU64(r);
+    nr->training_max_ms = NRCodecGetU64(r);
+    nr->dataset_error = NRCodecGetFloat(r);
+    nr->test_error = NRCodecGetFloat(r);
+    nr->test_class_error = NRCodecGetFloat(r);
+    for (int j = 1; j < LAYERS(nn); j++) {
+        if (ver >= 2 && NRCodecGetU32(r) != NR_ACT_SIGMOID) {
+            *err = "ERR unsupported activation function";
+            r->err = 1;
+        }
+        nn->layer[j].init = NRCodecGetU32(r);
+        if (nn->layer[j].init > ANN_INIT_HE) r->err = 1;
+        NRCodecGetFloats(r,nn->layer[j].weight,WEIGHTS(nn,j));
+        if (arrays == 1) continue; /* Keep the initial training state. */
+        NRCodecGetFloats(r,nn->layer[j].delta,WEIGHTS(nn,j));
+        NRCodecGetFloats(r,nn->layer[j].pgradient,WEIGHTS(nn,j));
+    }
+    NRCodecGetFloats(r,nr->inorm,INPUT_UNITS(nn));
+    NRCodecGetFloats(r,nr->onorm,OUTPUT_UNITS(nn));
+    NRCodecGetFloats(r,nr->ishift,INPUT_UNITS(nn));
+    for (int j = 0; j < 4; j++) nn->rng[j] = NRCodecGetU64(r);
+    if (r->err) {
+        NRTypeReleaseObject(nr);
+        return NULL;
+    }
+    return nr;
+}
+
+/* NR.EXPORT wraps the serialized network in an envelope with a checksum,
+ * so that corrupted or truncated blobs are detected by NR.IMPORT:
+ *
+ * "NRX" and the envelope version (one byte).
+ * The CRC32 (IEEE 802.3) of the payload, 4 bytes.
+ * The payload length, 8 bytes.
+ * The payload, a network serialized by NRSerializeNet(). */
+#define NR_EXPORT_VER 1
+#define NR_EXPORT_HDR_LEN 16
+
+uint32_t NRCrc32(const unsigned char *p, size_t len) {
+    static uint32_t table[256];
+    static int init = 0;
+
+    if (!init) {
+        for (uint32_t j = 0; j < 256; j++) {
+            uint32_t c = j;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+            table[j] = c;
+        }
+        init = 1;
+    }
+    uint32_t crc = 0xffffffff;
+    while (len--) crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffff;
+}
+
+/* Create the NR.EXPORT blob of 'nr' into 'b'. */
+void NRExportNet(NRCodecBuf *b, NRTypeObject *nr, uint32_t contents) {
+    unsigned char ver = NR_EXPORT_VER;
+    NRCodecPut(b,"NRX",3);
+    NRCodecPut(b,&ver,1);
+    NRCodecPutU32(b,0);     /* CRC, set later. */
+    NRCodecPutU64(b,0);     /* Length, set later. */
+    NRSerializeNet(b,nr,contents);
+
+    NRCodecBuf hdr = {NULL,0,0};
+    size_t len = b->len - NR_EXPORT_HDR_LEN;
+    NRCodecPutU32(&hdr,NRCrc32(b->p+NR_EXPORT_HDR_LEN,len));
+    NRCodecPutU64(&hdr,len);
+    memcpy(b->p+4,hdr.p,hdr.len);
+    RedisModule_Free(hdr.p);
+}
+
+/* Create a network from a blob created by NRExportNet(). On error NULL is
+ * returned, and '*err' is set to the error message. */
+NRTypeObject *NRImportNet(unsigned char *blob, size_t len, const char **err) {
+    NRCodecReader r = {blob, blob+len, 0};
+    unsigned char hdr[4];
+
+    *err = "ERR invalid export format";
+    NRCodecGet(&r,hdr,4);
+    if (r.err || memcmp(hdr,"NRX",3)) return NULL;
+    if (hdr[3] != NR_EXPORT_VER) {
+        *err = "ERR unsupported export format version";
+        return NULL;
+    }
+    uint32_t crc = NRCodecGetU32(&r);
+    uint64_t plen = NRCodecGetU64(&r);
+    if (r.err || plen != (uint64_t)(r.end - r.p)) {
+        *err = "ERR truncated export payload";
+        return NULL;
+    }
+    if (NRCrc32(r.p,plen) != crc) {
+        *err = "ERR export payload checksum mismatch";
+        return NULL;
+    }
+    NRTypeObject *nr = NRDeserializeNet(&r,err);
+    if (nr && r.p != r.end) {
+        NRTypeReleaseObject(nr);
+        *err = "ERR invalid export format";
+        return NULL;
+    }
+    return nr;
+}
+
+/* Propagate the current state of the network 'nr', stored at 'key', to
+ * replicas and AOF as an NR.SETWEIGHTS command. This is used every time
+ * the weights change in a way that can't be reproduced by replicating the
+ * command that caused the change, like random initialization or training. */
+void NRReplicateNet(RedisModuleCtx *ctx, RedisModuleString *key, NRTypeObject *nr) {
+    NRCodecBuf b = {NULL,0,0};
+    NRSerializeNet(&b,nr,0);
+    RedisModule_Replicate(ctx,"NR.SETWEIGHTS","sb",key,(char*)b.p,b.len);
+    RedisModule_Free(b.p);
+}
+
+/* Encode 'rows' rows of the dataset 'ds', starting at row 'first', as a
+ * block of columns (see the "Dataset encoding" section). */
+void NRDatasetEncodeBlock(NRCodecBuf *b, NRDataset *ds, uint32_t ilen, uint32_t olen, uint32_t first, uint32_t rows) {
+    for (uint32_t j = 0; j < ilen; j++)
+        NRCodecEncodeColumn(b,ds->inputs+(size_t)first*ilen+j,ilen,rows);
+    for (uint32_t j = 0; j < olen; j++)
+        NRCodecEncodeColumn(b,ds->outputs+(size_t)first*olen+j,olen,rows);
+}
+
+/* Decode a block encoded by NRDatasetEncodeBlock() into the rows starting
+ * at 'first', that must already be allocated. Returns REDISMODULE_ERR if
+ * the block is malformed. */
+int NRDatasetDecodeBlock(NRCodecReader *r, NRDataset *ds, uint32_t ilen, uint32_t olen, uint32_t first, uint32_t rows) {
+    for (uint32_t j = 0; j < ilen; j++)
+        NRCodecDecodeColumn(r,ds->inputs+(size_t)first*ilen+j,ilen,rows);
+    for (uint32_t j = 0; j < olen; j++)
+        NRCodecDecodeColumn(r,ds->outputs+(size_t)first*olen+j,olen,rows);
+    return (r->err || r->p != r->end) ? REDISMODULE_ERR : REDISMODULE_OK;
+}
+
 /* ================================ Training =============================== */
 
+/* Copy the dataset 'src' into 'dst'. If 'inorm' is not NULL the inputs
+ * are normalized while copying them, and the same for the outputs if
+ * 'onorm' is not NULL. See NRClone(). */
+void NRDatasetCopy(NRDataset *dst, NRDataset *src, int ilen, int olen,
+                   float *ishift, float *inorm, float *onorm)
+{
+    *dst = *src;
+    NRDatasetAlloc(dst,src->len,ilen,olen);
+    if (inorm) {
+        float *s = src->inputs, *d = dst->inputs;
+        for (uint32_t j = 0; j < src->len; j++) {
+            for (int i = 0; i < ilen; i++) d[i] = (s[i]-ishift[i])/inorm[i];
+            s += ilen;
+            d += ilen;
+        }
+    } else {
+        memcpy(dst->inputs,src->inputs,sizeof(float)*ilen*src->len);
+    }
+    if (onorm) {
+        float *s = src->outputs, *d = dst->outputs;
+        for (uint32_t j = 0; j < src->len; j++) {
+            for (int i = 0; i < olen; i++) d[i] = s[i]/onorm[i];
+            s += olen;
+            d += olen;
+        }
+    } else {
+        memcpy(dst->outputs,src->outputs,sizeof(float)*olen*src->len);
+    }
+}
+
+/* Set the normalization vectors of 'nr' from the training dataset
+ * statistics 'st'. Inputs are divided by their maximum absolute value, to
+ * get a -1,1 range, or if the network uses z-score normalization, are
+ * transformed into (input-mean)/stddev. Outputs are divided by their
+ * maximum absolute value.
+ *
+ * Note that we compute the normalization vectors for all the inputs
+ * and outputs, however if the network is a classifier, flagged with
+ * (NR_FLAG_CLASSIFIER), no output normalization will be done since
+ * the data is already in 0/1 format. */
+void NRUpdateNormalization(NRTypeObject *nr, NRStats *st) {
+    int ilen = INPUT_UNITS(nr->nn);
+    int olen = OUTPUT_UNITS(nr->nn);
+
+    if (st->count == 0) return;
+
+    /* Likely we are not seeing what will really be the true input/output
+     * maximum value, so we multiply the maximum values found by a constant.
+     * However if the max is "1" or less we assume it's a classification
+     * input and don't alter it. */
+    for (int i = 0; i < ilen; i++) {
+        float imax = st->imax[i] > 1 ? st->imax[i]*1.2 : 1;
+        nr->ishift[i] = 0;
+        nr->inorm[i] = imax;
+        if (nr->flags & NR_FLAG_ZSCORE) {
+            float stddev = sqrt(st->im2[i]/st->count);
+            nr->ishift[i] = st->imean[i];
+            nr->inorm[i] = stddev > 0 ? stddev : 1;
+        }
+    }
+    for (int i = 0; i < olen; i++)
+        nr->onorm[i] = st->omax[i] > 1 ? st->omax[i]*1.2 : 1;
+}
+
 /* Clone a neural network object, including the training and test dataset.
  * We use cloning in order to train in a different thread, and later
  * copy the weights back into the original NN.
  *
+ * If the network is auto normalized, the normalization vectors of the
+ * copy are computed from the dataset statistics, and the datasets are
+ * normalized while copying them, so that the training thread can start
+ * the first epoch ASAP: the copies will be discarded after the training
+ * anyway.
+ *
  * Note when 'newid' is 0, the copied object NN unique ID is the same as the
  * original as normally this is what we want, in order to later match the
  * trained network with the object stored at the specified key
  * in the pending traning structure.
  *
  * However if the copy is performed with other goals, 'newid' should
- * be set to non-zero in order to create a net with a different ID. */
-NRTypeObject *NRClone(NRTypeObject *o, int newid) {
+ * be set to non-zero in order to create a net with a different ID.
+ *
+ * If 'prof' is not NULL, the time spent copying and normalizing the
+ * datasets is added to it. */
+NRTypeObject *NRClone(NRTypeObject *o, int newid, NRTrainingProfile *prof) {
+    uint64_t start = NRNanoseconds();
     NRTypeObject *copy;
     copy = RedisModule_Calloc(1,sizeof(*o));
     *copy = *o;
     if (newid) copy->id = NRNextId++;
     copy->nn = AnnClone(o->nn);
-    copy->dataset = o->dataset;
-    copy->test = o->test;
+    copy->cache = NULL;
+    copy->compiled = NULL;
+    copy->training_profile = NULL;
+    memset(&copy->stats,0,sizeof(copy->stats));
 
     int ilen = INPUT_UNITS(o->nn);
     int olen = OUTPUT_UNITS(o->nn);
-    copy->dataset.inputs = RedisModule_Alloc(sizeof(float)*ilen*o->dataset.len);
-    copy->dataset.outputs = RedisModule_Alloc(sizeof(float)*olen*o->dataset.len);
-    copy->test.inputs = RedisModule_Alloc(sizeof(float)*ilen*o->test.len);
-    copy->test.outputs = RedisModule_Alloc(sizeof(float)*olen*o->test.len);
-    memcpy(copy->dataset.inputs,o->dataset.inputs,sizeof(float)*ilen*o->dataset.len);
-    memcpy(copy->dataset.outputs,o->dataset.outputs,sizeof(float)*olen*o->dataset.len);
-    memcpy(copy->test.inputs,o->test.inputs,sizeof(float)*ilen*o->test.len);
-    memcpy(copy->test.outputs,o->test.outputs,sizeof(float)*olen*o->test.len);
-
+    copy->ishift = RedisModule_Alloc(sizeof(float)*ilen);
     copy->inorm = RedisModule_Alloc(sizeof(float)*ilen);
     copy->onorm = RedisModule_Alloc(sizeof(float)*olen);
+    memcpy(copy->ishift,o->ishift,sizeof(float)*ilen);
     memcpy(copy->inorm,o->inorm,sizeof(float)*ilen);
     memcpy(copy->onorm,o->onorm,sizeof(float)*olen);
+
+    float *ishift = NULL, *inorm = NULL, *onorm = NULL;
+    if ((o->flags & NR_FLAG_NORMALIZE) && o->dataset.len) {
+        NRUpdateNormalization(copy,&o->stats);
+        ishift = copy->ishift;
+        inorm = copy->inorm;
+        if (!(o->flags & NR_FLAG_CLASSIFIER)) onorm = copy->onorm;
+    }
+    uint64_t copy_start = NRNanoseconds();
+    NRDatasetCopy(&copy->dataset,&o->dataset,ilen,olen,ishift,inorm,onorm);
+    NRDatasetCopy(&copy->test,&o->test,ilen,olen,ishift,inorm,onorm);
+
+    /* The datasets are normalized while copying them: if the network is
+     * normalized we account the copy as normalization time. */
+    if (prof) {
+        uint64_t end = NRNanoseconds();
+        if (inorm) {
+            prof->normalization_ns += end-copy_start;
+            prof->clone_ns += copy_start-start;
+        } else {
+            prof->clone_ns += end-start;
+        }
+    }
     return copy;
 }
 
@@ -309,8 +1628,12 @@ void NRTransferWeights(RedisModuleCtx *ctx, NRTypeObject *dst, NRTypeObject *src
     /* It would be faster to memcpy just the weight array for each layer,
      * however this way we access the NN in a more abstract way, and should
      * be fast enough in most cases. We can always optimized it later. */
-    AnnFree(dst->nn);
+    uint64_t rng[4];
+    memcpy(rng,dst->nn->rng,sizeof(rng));
+    AnnRelease(dst->nn);
     dst->nn = AnnClone(src->nn);
+    memcpy(dst->nn->rng,rng,sizeof(rng)); /* Not affected by the training. */
+    dst->weights_version++;
     dst->training_total_steps = src->training_total_steps;
     dst->training_total_ms = src->training_total_ms;
     dst->dataset_error = src->dataset_error;
@@ -320,29 +1643,636 @@ void NRTransferWeights(RedisModuleCtx *ctx, NRTypeObject *dst, NRTypeObject *src
 
     int ilen = INPUT_UNITS(src->nn);
     int olen = OUTPUT_UNITS(src->nn);
+    memcpy(dst->ishift,src->ishift,sizeof(float)*ilen);
     memcpy(dst->inorm,src->inorm,sizeof(float)*ilen);
     memcpy(dst->onorm,src->onorm,sizeof(float)*olen);
 }
 
-/* Threaded training entry point.
- *
- * To get some clue about overfitting algorithm behavior:
- * #define NR_TRAINING_DEBUG 1
- */
-void *NRTrainingThreadMain(void *arg) {
-    NRPendingTraining *pt = arg;
-    NRTypeObject *nr = pt->nr;
-    int training_iterations = 1;
-    float train_error = 0;
-    float test_error = 0;
-    float class_error = 0;
-    float past_train_error = 1.0/0.0;
-    float past_test_error = 1.0/0.0;
-    int auto_stop = nr->flags & NR_FLAG_AUTO_STOP;
-    int backtrack = nr->flags & NR_FLAG_BACKTRACK;
+/* ================================ Scheduler =============================== */
 
-    uint64_t cycles = 0;
-    long long start = NRMilliseconds();
+/* Training threads compete with the Redis main thread for the CPU. To
+ * avoid degrading the latency of the other commands, training threads are
+ * pinned to the CPUs that are not reserved to the main thread, run with a
+ * nice level depending on the job priority, and only a limited number of
+ * them (the CPU quota) can run at the same time: the others are queued.
+ *
+ * A training thread needs to hold one of the quota CPUs in order to run.
+ * Jobs are served by priority, and jobs with the same priority in FIFO
+ * order. Running jobs give back their CPU at cycle boundaries when a job
+ * with a greater priority is queued, or when their time slice expired and
+ * a job with the same priority is queued.
+ *
+ * All the scheduler state is protected by NRPendingTrainingMutex. */
+#define NR_SCHED_DEFAULT_PRIORITY 5
+#define NR_SCHED_MAX_PRIORITY 9
+#define NR_SCHED_SLICE_MS 1000
+#define NR_SCHED_NICE(prio) (NR_SCHED_MAX_PRIORITY+1-(prio))
+
+static int NRSchedRunning = 0;      /* Threads holding a quota CPU. */
+static uint64_t NRSchedNextSeq = 0; /* Next queue sequence number. */
+#ifdef __linux__
+static cpu_set_t NRTrainingCpus;    /* CPUs training threads can use. */
+#endif
+static int NRTrainingCpusCount = 1; /* Number of CPUs in the above set. */
+static char NRTrainingCpusList[256] = "any"; /* Same as above, as string. */
+static int NRPlacementVersion = 0;  /* Incremented when the set changes. */
+
+/* Compute the set of CPUs training threads can use: all the CPUs the
+ * process can use, but the one reserved to the main thread. The module
+ * does not pin the main thread itself: the reserved CPU only makes sense
+ * if Redis is pinned to it, see the training-reserved-cpu option. Must be
+ * called from the main thread. */
+void NRSchedUpdatePlacement(void) {
+#ifdef __linux__
+    cpu_set_t allowed;
+
+    if (sched_getaffinity(0,sizeof(allowed),&allowed) == -1) return;
+    NRTrainingCpus = allowed;
+    if (NRConfig.training_reserved_cpu >= 0 &&
+        NRConfig.training_reserved_cpu < CPU_SETSIZE)
+    {
+        CPU_CLR(NRConfig.training_reserved_cpu,&NRTrainingCpus);
+        /* Never leave training threads without CPUs. */
+        if (CPU_COUNT(&NRTrainingCpus) == 0) NRTrainingCpus = allowed;
+    }
+    NRTrainingCpusCount = CPU_COUNT(&NRTrainingCpus);
+
+    /* Build the human readable list of CPUs, like "1-3,5". */
+    char *p = NRTrainingCpusList;
+    size_t avail = sizeof(NRTrainingCpusList);
+    NRTrainingCpusList[0] = '\0';
+    for (int j = 0; j < CPU_SETSIZE && avail > 1; j++) {
+        if (!CPU_ISSET(j,&NRTrainingCpus)) continue;
+        int k = j;
+        while (k+1 < CPU_SETSIZE && CPU_ISSET(k+1,&NRTrainingCpus)) k++;
+        int n = (k == j) ?
+            snprintf(p,avail,"%s%d",p == NRTrainingCpusList ? "" : ",",j) :
+            snprintf(p,avail,"%s%d-%d",p == NRTrainingCpusList ? "" : ",",j,k);
+        if (n < 0 || (size_t)n >= avail) break;
+        p += n;
+        avail -= n;
+        j = k;
+    }
+#endif
+    NRPlacementVersion++;
+}
+
+/* Pin the calling thread to the training CPUs, and set its nice level
+ * according to the job priority. Errors are ignored: placement is just an
+ * optimization. Returns the placement version applied. */
+int NRSchedPlaceThread(int priority) {
+    int version;
+
+    pthread_mutex_lock(&NRPendingTrainingMutex);
+    version = NRPlacementVersion;
+#ifdef __linux__
+    cpu_set_t cpus = NRTrainingCpus;
+#endif
+    pthread_mutex_unlock(&NRPendingTrainingMutex);
+#ifdef __linux__
+    if (version) pthread_setaffinity_np(pthread_self(),sizeof(cpus),&cpus);
+    setpriority(PRIO_PROCESS,syscall(SYS_gettid),NR_SCHED_NICE(priority));
+#else
+    UNUSED(priority);
+#endif
+    return version;
+}
+
+/* Return the number of training threads that can run at the same time,
+ * or zero if there is no limit. */
+int NRSchedQuota(void) {
+    if (NRConfig.training_cpu_quota_perc) {
+        int quota =
+            (NRTrainingCpusCount*NRConfig.training_cpu_quota_perc+99)/100;
+        return quota ? quota : 1;
+    }
+    return NRConfig.training_cpu_quota;
+}
+
+/* Return true if the job is waiting for a CPU of the quota. */
+int NRSchedIsQueued(NRPendingTraining *pt) {
+    return pt->in_progress && !pt->sched_running && !pt->paused &&
+           pt->stop == NR_STOP_NONE;
+}
+
+/* Return true if some queued job should run before 'pt'. If 'slice' is
+ * true, jobs with the same priority as 'pt' are considered as well. */
+int NRSchedOutranked(NRPendingTraining *pt, int slice) {
+    for (int j = 0; j < NRPendingTrainingCount; j++) {
+        NRPendingTraining *q = NRTrainings[j];
+        if (q == pt || !NRSchedIsQueued(q)) continue;
+        if (q->priority > pt->priority) return 1;
+        if (q->priority == pt->priority &&
+            (slice || q->sched_seq < pt->sched_seq)) return 1;
+    }
+    return 0;
+}
+
+/* Give a quota CPU to the job. */
+void NRSchedGrant(NRPendingTraining *pt) {
+    NRSchedRunning++;
+    pt->sched_running = 1;
+    pt->slice_start = NRMilliseconds();
+}
+
+/* Give back the quota CPU held by the job, that goes at the end of the
+ * queue of its priority. */
+void NRSchedRelease(NRPendingTraining *pt) {
+    NRSchedRunning--;
+    pt->sched_running = 0;
+    pt->sched_seq = NRSchedNextSeq++;
+    pthread_cond_broadcast(&NRPendingTrainingCond);
+}
+
+/* Return true if the queued job can get a quota CPU now. */
+int NRSchedCanRun(NRPendingTraining *pt) {
+    int quota = NRSchedQuota();
+    return quota == 0 || (NRSchedRunning < quota && !NRSchedOutranked(pt,0));
+}
+
+/* Return true if the running job should give back its CPU. */
+int NRSchedShouldYield(NRPendingTraining *pt) {
+    int quota = NRSchedQuota();
+    if (quota == 0) return 0;
+    if (NRSchedRunning > quota) return 1; /* Quota was lowered. */
+    int slice_expired =
+        NRMilliseconds()-pt->slice_start >= NR_SCHED_SLICE_MS;
+    return NRSchedOutranked(pt,slice_expired);
+}
+
+/* Try to get an additional quota CPU for a helper thread of a running job
+ * (like the validator). Never waits: returns 1 if the CPU was granted, and
+ * in this case NRSchedReleaseExtra() must be called later. Queued jobs
+ * always have precedence over helper threads. */
+int NRSchedTryAcquireExtra(void) {
+    int granted = 0, quota;
+
+    pthread_mutex_lock(&NRPendingTrainingMutex);
+    quota = NRSchedQuota();
+    if (quota == 0 || NRSchedRunning < quota) {
+        granted = 1;
+        for (int j = 0; j < NRPendingTrainingCount; j++)
+            if (NRSchedIsQueued(NRTrainings[j])) granted = 0;
+    }
+    if (granted) NRSchedRunning++;
+    pthread_mutex_unlock(&NRPendingTrainingMutex);
+    return granted;
+}
+
+void NRSchedReleaseExtra(void) {
+    pthread_mutex_lock(&NRPendingTrainingMutex);
+    NRSchedRunning--;
+    pthread_cond_broadcast(&NRPendingTrainingCond);
+    pthread_mutex_unlock(&NRPendingTrainingMutex);
+}
+
+/* ============================= Validation worker ========================== */
+
+/* When AUTOSTOP is used, the test dataset must be evaluated after every
+ * training cycle. Instead of stalling the training thread for a full
+ * forward pass of the test dataset, the weights are copied into a
+ * snapshot network which is validated by a different thread, while the
+ * training thread already runs the next cycle. The training thread will
+ * consume the result of cycle N after cycle N+1 completed, so overfitting
+ * is detected with a lag of one cycle, which is harmless: the snapshot
+ * net is exactly the validated one, so backtracking can still save it. */
+
+#define NR_VALIDATOR_IDLE 0     /* No job posted. */
+#define NR_VALIDATOR_BUSY 1     /* Job posted, validation in progress. */
+#define NR_VALIDATOR_DONE 2     /* Result ready to be consumed. */
+#define NR_VALIDATOR_EXIT 3     /* The thread should terminate. */
+
+typedef struct NRValidation {
+    /* Fields set by the training thread when posting a job. */
+    float train_error;      /* Training dataset error of the snapshot. */
+    float best_error;       /* Best sampled test error so far. A full
+                               evaluation is performed only if the sample
+                               does better than that. */
+    /* Fields set by the validator. */
+    float test_error;       /* Average error in the (sampled) test set. */
+    float class_error;      /* % of wrong classifications in the sample. */
+    int full;               /* True if the full test dataset was evaluated
+                               and the following two fields are valid. */
+    float full_test_error;
+    float full_class_error;
+    uint64_t ns;            /* Time spent validating. */
+} NRValidation;
+
+typedef struct NRValidator {
+    pthread_t tid;
+    int threaded;           /* False if we validate in the caller thread. */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int state;              /* NR_VALIDATOR_... */
+    struct Ann *nn;         /* Snapshot of the weights to validate. */
+    NRDataset *test;        /* Full test dataset. */
+    NRDataset sample;       /* Sampled test dataset (len is zero if the
+                               full dataset should be used every time). */
+    int ilen, olen;
+    NRValidation job;
+} NRValidator;
+
+/* Populate 'sample' with about 'count' entries of the 'test' dataset,
+ * picked at random using the PRNG of 'net'. For classifiers the sample is
+ * stratified: every class gets a number of entries proportional to its
+ * frequency in the test dataset, so that the sampled classification error
+ * is a good estimate of the real one even when some class is rare. */
+void NRDatasetSample(NRDataset *sample, NRDataset *test, int ilen, int olen, uint32_t count, int classifier, struct Ann *net) {
+    uint32_t *idx = RedisModule_Alloc(sizeof(uint32_t)*test->len);
+    uint32_t *classstart = RedisModule_Calloc(olen+1,sizeof(uint32_t));
+    uint32_t j;
+    int numclasses = classifier ? olen : 1;
+
+    /* Group the entries by class, with a counting sort. Regressors have
+     * a single "class" containing all the entries. */
+    for (j = 0; j < test->len; j++) {
+        int c = 0;
+        if (classifier) {
+            float *o = test->outputs+(size_t)j*olen;
+            for (int k = 1; k < olen; k++) if (o[k] > o[c]) c = k;
+        }
+        classstart[c+1]++;
+    }
+    for (int c = 0; c < numclasses; c++) classstart[c+1] += classstart[c];
+    uint32_t *fill = RedisModule_Alloc(sizeof(uint32_t)*numclasses);
+    memcpy(fill,classstart,sizeof(uint32_t)*numclasses);
+    for (j = 0; j < test->len; j++) {
+        int c = 0;
+        if (classifier) {
+            float *o = test->outputs+(size_t)j*olen;
+            for (int k = 1; k < olen; k++) if (o[k] > o[c]) c = k;
+        }
+        idx[fill[c]++] = j;
+    }
+    RedisModule_Free(fill);
+
+    /* Pick the entries of every class with a partial Fisher-Yates shuffle
+     * of the class range. Every non empty class gets at least one entry. */
+    sample->len = 0;
+    sample->maxlen = count+numclasses;
+    NRDatasetAlloc(sample,sample->maxlen,ilen,olen);
+    for (int c = 0; c < numclasses; c++) {
+        uint32_t start = classstart[c], n = classstart[c+1]-start;
+        uint32_t k = (uint32_t)((double)n*count/test->len+0.5);
+        if (k == 0 && n) k = 1;
+        if (k > n) k = n;
+        for (j = 0; j < k; j++) {
+            uint32_t r = j+(AnnRandom(net) % (n-j));
+            uint32_t t = idx[start+j];
+            idx[start+j] = idx[start+r];
+            idx[start+r] = t;
+            memcpy(sample->inputs+(size_t)sample->len*ilen,
+                   test->inputs+(size_t)idx[start+j]*ilen,sizeof(float)*ilen);
+            memcpy(sample->outputs+(size_t)sample->len*olen,
+                   test->outputs+(size_t)idx[start+j]*olen,sizeof(float)*olen);
+            sample->len++;
+        }
+    }
+    RedisModule_Free(idx);
+    RedisModule_Free(classstart);
+}
+
+/* Perform the validation job currently set in the validator. */
+void NRValidatorRun(NRValidator *v) {
+    NRValidation *job = &v->job;
+    NRDataset *ds = v->sample.len ? &v->sample : v->test;
+    uint64_t start = NRNanoseconds();
+
+    AnnTestError(v->nn, ds->inputs, ds->outputs, ds->len,
+                 &job->test_error, &job->class_error);
+    job->full = 0;
+    if (ds == v->test) {
+        job->full = 1;
+        job->full_test_error = job->test_error;
+        job->full_class_error = job->class_error;
+    } else if (job->test_error < job->best_error) {
+        job->full = 1;
+        AnnTestError(v->nn, v->test->inputs, v->test->outputs, v->test->len,
+                     &job->full_test_error, &job->full_class_error);
+    }
+    job->ns = NRNanoseconds()-start;
+}
+
+/* Validator thread entry point. */
+void *NRValidatorThreadMain(void *arg) {
+    NRValidator *v = arg;
+
+    pthread_mutex_lock(&v->mutex);
+    while(1) {
+        while (v->state != NR_VALIDATOR_BUSY && v->state != NR_VALIDATOR_EXIT)
+            pthread_cond_wait(&v->cond,&v->mutex);
+        if (v->state == NR_VALIDATOR_EXIT) break;
+        pthread_mutex_unlock(&v->mutex);
+        NRValidatorRun(v);
+        NRSchedReleaseExtra();
+        pthread_mutex_lock(&v->mutex);
+        v->state = NR_VALIDATOR_DONE;
+        pthread_cond_signal(&v->cond);
+    }
+    pthread_mutex_unlock(&v->mutex);
+    return NULL;
+}
+
+/* Setup the validator for the training of 'nr'. If the validation thread
+ * can't be created, the validator still works, but the jobs are executed
+ * synchronously by NRValidatorPost(). */
+void NRValidatorInit(NRValidator *v, NRTypeObject *nr) {
+    memset(v,0,sizeof(*v));
+    v->nn = AnnClone(nr->nn);
+    v->test = &nr->test;
+    v->ilen = INPUT_UNITS(nr->nn);
+    v->olen = OUTPUT_UNITS(nr->nn);
+    v->state = NR_VALIDATOR_IDLE;
+    if (nr->training_test_sample && nr->training_test_sample < nr->test.len)
+        NRDatasetSample(&v->sample,&nr->test,v->ilen,v->olen,
+                        nr->training_test_sample,
+                        nr->flags & NR_FLAG_CLASSIFIER, nr->nn);
+    pthread_mutex_init(&v->mutex,NULL);
+    pthread_cond_init(&v->cond,NULL);
+    v->threaded =
+        pthread_create(&v->tid,NULL,NRValidatorThreadMain,v) == 0;
+}
+
+/* Start the validation of the current weights of 'nn'. The weights are
+ * copied into the validator snapshot, so the caller is free to continue
+ * training 'nn' ASAP. The result must be consumed with NRValidatorWait()
+ * before posting a new job. The validation runs in the validator thread
+ * only if the CPU quota has room for it, otherwise it is performed
+ * synchronously. */
+void NRValidatorPost(NRValidator *v, struct Ann *nn, float train_error, float best_error) {
+    AnnCopyWeights(v->nn,nn);
+    v->job.train_error = train_error;
+    v->job.best_error = best_error;
+    if (v->threaded && NRSchedTryAcquireExtra()) {
+        pthread_mutex_lock(&v->mutex);
+        v->state = NR_VALIDATOR_BUSY;
+        pthread_cond_signal(&v->cond);
+        pthread_mutex_unlock(&v->mutex);
+    } else {
+        NRValidatorRun(v);
+        v->state = NR_VALIDATOR_DONE;
+    }
+}
+
+/* Wait for the result of the last posted job, and store it in 'res'.
+ * Returns 0 if no job was posted since the last call, otherwise 1. */
+int NRValidatorWait(NRValidator *v, NRValidation *res) {
+    int retval = 0;
+
+    pthread_mutex_lock(&v->mutex);
+    while (v->state == NR_VALIDATOR_BUSY)
+        pthread_cond_wait(&v->cond,&v->mutex);
+    if (v->state == NR_VALIDATOR_DONE) {
+        *res = v->job;
+        v->state = NR_VALIDATOR_IDLE;
+        retval = 1;
+    }
+    pthread_mutex_unlock(&v->mutex);
+    return retval;
+}
+
+/* Terminate the validator thread and release the validator resources. */
+void NRValidatorFree(NRValidator *v) {
+    if (v->threaded) {
+        pthread_mutex_lock(&v->mutex);
+        while (v->state == NR_VALIDATOR_BUSY)
+            pthread_cond_wait(&v->cond,&v->mutex);
+        v->state = NR_VALIDATOR_EXIT;
+        pthread_cond_signal(&v->cond);
+        pthread_mutex_unlock(&v->mutex);
+        pthread_join(v->tid,NULL);
+    }
+    pthread_mutex_destroy(&v->mutex);
+    pthread_cond_destroy(&v->cond);
+    AnnFree(v->nn);
+    if (v->sample.maxlen) NRDatasetFree(&v->sample);
+}
+
+/* Called by the training thread between epochs: blocks while the training
+ * is paused, or while it is queued waiting for a CPU of the quota (see the
+ * scheduler section), and gives back the CPU if some other job should run
+ * instead. Returns the stop state of the training (NR_STOP_NONE if the
+ * training should continue). The number of milliseconds spent waiting is
+ * added to '*waited_ms', so that waiting time does not count for the
+ * MAXTIME limit. */
+int NRTrainingCheckpoint(NRPendingTraining *pt, long long *waited_ms) {
+    int stop, waited = 0, replace;
+    long long wait_start = 0;
+
+    pthread_mutex_lock(&NRPendingTrainingMutex);
+    if (pt->sched_running && NRSchedShouldYield(pt)) NRSchedRelease(pt);
+    while (pt->stop == NR_STOP_NONE && (pt->paused || !pt->sched_running)) {
+        if (!pt->paused && NRSchedCanRun(pt)) {
+            NRSchedGrant(pt);
+            break;
+        }
+        /* Paused trainings don't hold a CPU of the quota. */
+        if (pt->paused && pt->sched_running) NRSchedRelease(pt);
+        if (!waited) {
+            waited = 1;
+            wait_start = NRMilliseconds();
+        }
+        pthread_cond_wait(&NRPendingTrainingCond,&NRPendingTrainingMutex);
+    }
+    if (waited) *waited_ms += NRMilliseconds()-wait_start;
+    stop = pt->stop;
+    replace = pt->placement != NRPlacementVersion;
+    pthread_mutex_unlock(&NRPendingTrainingMutex);
+
+    /* The set of training CPUs was changed with NR.CONFIG SET. */
+    if (replace) pt->placement = NRSchedPlaceThread(pt->priority);
+    return stop;
+}
+
+/* Called by the training thread when it is done. */
+void NRTrainingTerminate(NRPendingTraining *pt) {
+    pthread_mutex_lock(&NRPendingTrainingMutex);
+    if (pt->sched_running) NRSchedRelease(pt);
+    pt->in_progress = 0;
+    pthread_mutex_unlock(&NRPendingTrainingMutex);
+}
+
+/* Return the number of bytes used by the training of 'nr': the copy of the
+ * network and of the datasets, and the validator and backtracking buffers
+ * if any. All of them are allocated for the whole training, so this is
+ * also the peak memory usage. */
+size_t NRTrainingMemory(NRTypeObject *nr, NRValidator *validator, size_t saved_len) {
+    size_t row = sizeof(float)*(INPUT_UNITS(nr->nn)+OUTPUT_UNITS(nr->nn));
+    size_t bytes = sizeof(*nr) + AnnMemoryUsage(nr->nn) + row +
+                   sizeof(float)*INPUT_UNITS(nr->nn);
+    bytes += NRDatasetMemoryUsage(&nr->dataset) +
+             NRDatasetMemoryUsage(&nr->test);
+    if (validator) {
+        bytes += AnnMemoryUsage(validator->nn);
+        bytes += NRDatasetMemoryUsage(&validator->sample);
+    }
+    return bytes + sizeof(float)*saved_len;
+}
+
+/* Estimate what NRTrainingMemory() will return for a training of a network
+ * with the layout of 'nn' on training and testing datasets of
+ * 'dataset_len' and 'test_len' rows, with the specified options. The
+ * estimate is used for the training memory budget, before the training
+ * starts, and by NR.EXPLAIN. */
+size_t NRTrainingMemoryEstimate(struct Ann *nn, uint64_t dataset_len, uint64_t test_len, int autostop, int backtrack, uint64_t test_sample) {
+    size_t ilen = INPUT_UNITS(nn), olen = OUTPUT_UNITS(nn);
+    size_t row = sizeof(float)*(ilen+olen);
+    size_t net = AnnLayoutMemoryUsage(nn,0);
+    size_t bytes = sizeof(NRTypeObject) + net + row + sizeof(float)*ilen +
+                   NRDatasetLayoutMemoryUsage(dataset_len,ilen,olen) +
+                   NRDatasetLayoutMemoryUsage(test_len,ilen,olen);
+
+    if (autostop)
+        bytes += net + NRDatasetLayoutMemoryUsage(test_sample,ilen,olen);
+    if (autostop && backtrack)
+        bytes += sizeof(float)*AnnWeightsBufferLen(nn);
+    return bytes;
+}
+
+/* Add the errors of a cycle to the ring buffer of the profile. */
+void NRProfileAddCycle(NRTrainingProfile *prof, uint32_t cycle, float train_error, float test_error) {
+    int idx = prof->history_len % NR_ERROR_HISTORY;
+    prof->history[idx].cycle = cycle;
+    prof->history[idx].train_error = train_error;
+    prof->history[idx].test_error = test_error;
+    prof->history_len++;
+}
+
+/* State of the hardware counters of a training thread. The counters are
+ * opened as a single group, so that they are read with a single read()
+ * and always count the same instructions. */
+typedef struct NRPerfSession {
+    int fd[NR_PERF_COUNTERS];   /* Counter file descriptors, or -1. */
+    int slot[NR_PERF_COUNTERS]; /* Position of the counter in the group. */
+    int opened;                 /* Counters in the group. */
+    int phase;                  /* Phase being measured, or ANN_PHASE_NONE. */
+    uint64_t last[NR_PERF_COUNTERS+2]; /* Last read counters and times. */
+    NRPerfProfile *out;
+} NRPerfSession;
+
+/* Read the group of counters into 'v': the counters in the NR_PERF_...
+ * order (zero if not available), then the enabled and running times.
+ * Return 0 on success, -1 on error. */
+int NRPerfRead(NRPerfSession *s, uint64_t *v) {
+    uint64_t buf[3+NR_PERF_COUNTERS];
+    size_t len = sizeof(uint64_t)*(3+s->opened);
+
+    if (read(s->fd[0],buf,len) != (ssize_t)len) return -1;
+    for (int j = 0; j < NR_PERF_COUNTERS; j++)
+        v[j] = s->fd[j] != -1 ? buf[3+s->slot[j]] : 0;
+    v[NR_PERF_COUNTERS] = buf[1];
+    v[NR_PERF_COUNTERS+1] = buf[2];
+    return 0;
+}
+
+/* AnnProfile hook: account the counters since the last call to the phase
+ * that just ended. */
+void NRPerfHook(struct AnnProfile *prof, int phase) {
+    NRPerfSession *s = prof->privdata;
+    uint64_t v[NR_PERF_COUNTERS+2];
+
+    if (NRPerfRead(s,v) == -1) return;
+    if (s->phase != ANN_PHASE_NONE) {
+        for (int j = 0; j < NR_PERF_COUNTERS; j++)
+            s->out->phase[s->phase].count[j] += v[j]-s->last[j];
+        s->out->enabled_ns += v[NR_PERF_COUNTERS]-s->last[NR_PERF_COUNTERS];
+        s->out->running_ns +=
+            v[NR_PERF_COUNTERS+1]-s->last[NR_PERF_COUNTERS+1];
+    }
+    if (phase != ANN_PHASE_NONE) s->out->phase[phase].measured++;
+    memcpy(s->last,v,sizeof(v));
+    s->phase = phase;
+}
+
+/* Open the hardware counters for the calling thread, and install the hook
+ * in the network profile 'prof'. Only user space is counted, so that this
+ * works with the default perf_event_paranoid setting. If the counters are
+ * not available, because of permissions, virtualization, or because this
+ * is not Linux, 'out' reports the error and the training runs without
+ * them. Counters other than the cycles may be missing individually. */
+void NRPerfOpen(NRPerfSession *s, NRPerfProfile *out, struct AnnProfile *prof, uint64_t weights) {
+    memset(s,0,sizeof(*s));
+    memset(out,0,sizeof(*out));
+    for (int j = 0; j < NR_PERF_COUNTERS; j++) s->fd[j] = -1;
+    s->phase = ANN_PHASE_NONE;
+    s->out = out;
+    out->weights = weights;
+
+#ifdef __linux__
+    static const struct {
+        uint32_t type;
+        uint64_t config;
+    } events[NR_PERF_COUNTERS] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                             (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                             (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)}
+    };
+
+    for (int j = 0; j < NR_PERF_COUNTERS; j++) {
+        struct perf_event_attr attr;
+        memset(&attr,0,sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[j].type;
+        attr.config = events[j].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP |
+                           PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        int fd = syscall(__NR_perf_event_open,&attr,0,-1,
+                         j == 0 ? -1 : s->fd[0],0);
+        if (fd == -1) {
+            if (j == 0) {
+                out->status = NR_PERF_UNAVAILABLE;
+                out->err = errno;
+                return;
+            }
+            continue;
+        }
+        s->fd[j] = fd;
+        s->slot[j] = s->opened++;
+        out->available |= 1<<j;
+    }
+    out->status = NR_PERF_ON;
+    prof->hook = NRPerfHook;
+    prof->privdata = s;
+#else
+    UNUSED(prof);
+    out->status = NR_PERF_UNAVAILABLE;
+    out->err = ENOSYS;
+#endif
+}
+
+/* Remove the hook from 'prof' and close the counters. */
+void NRPerfClose(NRPerfSession *s, struct AnnProfile *prof) {
+    prof->hook = NULL;
+    prof->privdata = NULL;
+    for (int j = 0; j < NR_PERF_COUNTERS; j++)
+        if (s->fd[j] != -1) close(s->fd[j]);
+}
+
+/* Threaded training entry point.
+ *
+ * To get some clue about overfitting algorithm behavior:
+ * #define NR_TRAINING_DEBUG 1
+ */
+void *NRTrainingThreadMain(void *arg) {
+    NRPendingTraining *pt = arg;
+    NRTypeObject *nr = pt->nr;
+    int training_iterations = 1;
+    float train_error = 0;
+    float test_error = 0;
+    float class_error = 0;
+    float past_train_error = 1.0/0.0;
+    float past_test_error = 1.0/0.0;
+    int auto_stop = nr->flags & NR_FLAG_AUTO_STOP;
+    int backtrack = nr->flags & NR_FLAG_BACKTRACK;
+
+    uint64_t cycles = 0;
+    long long start = NRMilliseconds();
     long long cycle_time;
     int overfitting_count = 0;
     int overfitting_limit = 5;
@@ -350,100 +2280,89 @@ void *NRTrainingThreadMain(void *arg) {
 
     nr->flags &= ~NR_FLAG_TO_TRANSFER;
 
-    /* If the network is auto normalized, we need to trasnform the inputs
-     * in a way that's acceptable for the NN. We just find the maximum
-     * absolute value, and divide for it, to get a -1,1 range. There
-     * are more advanced transformations that are usually performed that
-     * could be implemented in the future.
-     *
-     * Note that we compute the normalization vectors for all the inputs
-     * and outputs, however if the network is a classifier, flagged with
-     * (NR_FLAG_CLASSIFIER), no output normalization will be done since
-     * the data is already in 0/1 format. */
-    if ((nr->flags & NR_FLAG_NORMALIZE) && nr->dataset.len) {
-        int ilen = INPUT_UNITS(nr->nn);
-        int olen = OUTPUT_UNITS(nr->nn);
-        float *imax = nr->inorm;
-        float *omax = nr->onorm;
-        float *inputs = nr->dataset.inputs;
-        float *outputs = nr->dataset.outputs;
-        for (int i = 0; i < ilen; i++) imax[i] = 1;
-        for (int i = 0; i < olen; i++) omax[i] = 1;
-
-        /* Compute the max values vectors. */
-        for (uint32_t j = 0; j < nr->dataset.len; j++) {
-            for (int i = 0; i < ilen; i++)
-                if (fabs(inputs[i]) > imax[i]) imax[i] = fabs(inputs[i]);
-            for (int i = 0; i < olen; i++)
-                if (fabs(outputs[i]) > omax[i]) omax[i] = fabs(outputs[i]);
-            inputs += ilen;
-            outputs += olen;
-        }
-
-        /* Likely we are not seeing what will really be the true input/output
-         * maximum value, so we multiply the maximum values found by a constant.
-         * However if the max is exactly "1" we assume it's a classification
-         * input and don't alter it. */
-        for (int i = 0; i < ilen; i++) if (imax[i] != 1) imax[i] *= 1.2;
-        for (int i = 0; i < olen; i++) if (omax[i] != 1) omax[i] *= 1.2;
-
-        /* We can normalize the dataset directly: after the training it will
-         * be discarded anyway. */
-        inputs = nr->dataset.inputs;
-        outputs = nr->dataset.outputs;
-        for (uint32_t j = 0; j < nr->dataset.len; j++) {
-            for (int i = 0; i < ilen; i++) inputs[i] /= nr->inorm[i];
-            if (!(nr->flags & NR_FLAG_CLASSIFIER))
-                for (int i = 0; i < olen; i++) outputs[i] /= nr->onorm[i];
-            inputs += ilen;
-            outputs += olen;
-        }
-
-        inputs = nr->test.inputs;
-        outputs = nr->test.outputs;
-        for (uint32_t j = 0; j < nr->test.len; j++) {
-            for (int i = 0; i < ilen; i++) inputs[i] /= nr->inorm[i];
-            if (!(nr->flags & NR_FLAG_CLASSIFIER))
-                for (int i = 0; i < olen; i++) outputs[i] /= nr->onorm[i];
-            inputs += ilen;
-            outputs += olen;
-        }
-    }
-
-    struct Ann *saved = NULL;  /* Saved to recover on overfitting. */
+    /* The profile is updated locally, and published in the pending
+     * training structure at the end of every cycle. */
+    NRTrainingProfile prof = pt->profile;
+    NRPerfSession perf;
+    nr->nn->profile = &prof.net;
+    if (nr->flags & NR_FLAG_PROFILE)
+        NRPerfOpen(&perf,&prof.perf,&prof.net,AnnCountWeights(nr->nn));
+
+    /* Move to the training CPUs, and wait for our turn to run. The time
+     * spent queued is not training time. */
+    long long queued_ms = 0;
+    pt->placement = NRSchedPlaceThread(pt->priority);
+    NRTrainingCheckpoint(pt,&queued_ms);
+    start = NRMilliseconds();
+
+    /* Note that if the network is auto normalized, the datasets were
+     * already normalized by NRClone(). */
+
+    float *saved = NULL;        /* Weights saved to recover on overfitting. */
+    int saved_valid = 0;        /* True if 'saved' holds a network. */
     float saved_error;          /* The test error of the saved NN. */
     float saved_train_error;    /* The training dataset error of the saved NN */
     float saved_class_error;    /* The % of classification errors of saved NN */
+    NRValidator validator;      /* Validates the test dataset with AUTOSTOP. */
+    NRValidation res;           /* Validation result of the past cycle. */
+
+    if (auto_stop) NRValidatorInit(&validator,nr);
+
+    /* The saved network buffer is allocated once: when a new best network
+     * is found we just copy its weights there, without allocating. */
+    if (auto_stop && backtrack)
+        saved = RedisModule_Alloc(sizeof(float)*AnnWeightsBufferLen(nr->nn));
+    prof.peak_memory = NRTrainingMemory(nr,auto_stop ? &validator : NULL,
+                                        saved ? AnnWeightsBufferLen(nr->nn) : 0);
 
+    int stop = NR_STOP_NONE;
     while(1) {
         long long cycle_start = NRMilliseconds();
-
-        train_error = AnnTrain(nr->nn,
-                               nr->dataset.inputs,
-                               nr->dataset.outputs,
-                               0,
-                               training_iterations,
-                               nr->dataset.len,
-                               NN_ALGO_BPROP);
-        cycle_time = NRMilliseconds() - cycle_start;
-        nr->training_total_steps += nr->dataset.len*training_iterations;
+        long long waited_ms = 0;
+        int epochs;
+
+        /* Check for stop and pause requests before every epoch, so that
+         * even long cycles can be interrupted quickly. */
+        for (epochs = 0; epochs < training_iterations; epochs++) {
+            stop = NRTrainingCheckpoint(pt,&waited_ms);
+            if (stop != NR_STOP_NONE) break;
+            train_error = AnnTrain(nr->nn,
+                                   nr->dataset.inputs,
+                                   nr->dataset.outputs,
+                                   0,
+                                   1,
+                                   nr->dataset.len,
+                                   NN_ALGO_BPROP);
+        }
+        start += waited_ms;
+        cycle_time = NRMilliseconds() - cycle_start - waited_ms;
+        nr->training_total_steps += nr->dataset.len*epochs;
+        prof.samples += (uint64_t)nr->dataset.len*epochs;
+        if (stop != NR_STOP_NONE) break;
 
         /* Evaluate the error in the case of auto training, stop it
          * once we see that the error in the traning set is decreasing
-         * while the one in the test set is not. */
-        if (auto_stop) {
-            AnnTestError(nr->nn,
-                         nr->test.inputs,
-                         nr->test.outputs,
-                         nr->test.len, &test_error, &class_error);
-
-            if (train_error < past_train_error &&
+         * while the one in the test set is not.
+         *
+         * The validator is evaluating the weights of the previous cycle
+         * while we were training, so here we consume the result of the
+         * previous cycle, and post the current weights for validation. */
+        uint64_t wait_start = NRNanoseconds();
+        int validated = auto_stop && NRValidatorWait(&validator,&res);
+        if (auto_stop) prof.validation_wait_ns += NRNanoseconds()-wait_start;
+        if (validated) {
+            float val_train_error = res.train_error;
+            prof.validation_ns += res.ns;
+            test_error = res.test_error;
+            class_error = res.class_error;
+
+            if (val_train_error < past_train_error &&
                 test_error > past_test_error)
             {
                 overfitting_count++;
                 #ifdef NR_TRAINING_DEBUG
                 printf("+YCLE %lld: [%d] %f VS %f\n", (long long)cycles,
-                    overfitting_count, train_error, test_error);
+                    overfitting_count, val_train_error, test_error);
                 #endif
                 if (overfitting_count == overfitting_limit) {
                     nr->flags |= NR_FLAG_OF_DETECTED;
@@ -452,23 +2371,27 @@ void *NRTrainingThreadMain(void *arg) {
             } else if (overfitting_count > 0) {
                 #ifdef NR_TRAINING_DEBUG
                 printf("-YCLE %lld: [%d] %f VS %f\n", (long long)cycles,
-                    overfitting_count, train_error, test_error);
+                    overfitting_count, val_train_error, test_error);
                 #endif
                 overfitting_count--;
             }
 
             /* Save all the networks with a score better than the currently
-             * saved network. This can be a bit costly, but is safe: one
-             * cycle of training more and overfitting can ruin it all. */
-            if (backtrack && (saved == NULL || test_error < saved_error)) {
+             * saved network. This is just a copy of the weights, and is
+             * safe: one cycle of training more and overfitting can ruin
+             * it all. The saved network is the validator snapshot, since
+             * it is the one the error was computed for. */
+            if (backtrack && res.full &&
+                (!saved_valid || res.full_test_error < saved_error))
+            {
                 #ifdef NR_TRAINING_DEBUG
-                printf("SAVED! %f < %f\n", test_error, saved_error);
+                printf("SAVED! %f < %f\n", res.full_test_error, saved_error);
                 #endif
-                saved_error = test_error;
-                saved_train_error = train_error;
-                saved_class_error = class_error;
-                if (saved) AnnFree(saved);
-                saved = AnnClone(nr->nn);
+                saved_error = res.full_test_error;
+                saved_train_error = val_train_error;
+                saved_class_error = res.full_class_error;
+                AnnSaveWeights(validator.nn,saved);
+                saved_valid = 1;
             }
 
             /* Best network found? Reset the overfitting hints counter. */
@@ -477,17 +2400,25 @@ void *NRTrainingThreadMain(void *arg) {
                 best_test_error = test_error;
                 #ifdef NR_TRAINING_DEBUG
                 printf("BEST! %lld: <%d> %f VS %f\n", (long long)cycles,
-                    overfitting_limit,train_error, test_error);
+                    overfitting_limit,val_train_error, test_error);
                 #endif
             }
 
            /* Also stop if the loss is zero in both datasets. */
-            if (train_error < 0.000000000000001 &&
+            if (val_train_error < 0.000000000000001 &&
                 test_error  < 0.000000000000001) break;
+
+            past_train_error = val_train_error;
+            past_test_error = test_error;
         }
+        if (auto_stop)
+            NRValidatorPost(&validator,nr->nn,train_error,best_test_error);
 
         cycles++;
         long long total_time = NRMilliseconds()-start;
+        prof.cycles = cycles;
+        prof.wall_ms = total_time;
+        NRProfileAddCycle(&prof,cycles,train_error,test_error);
 
         /* Cycles and milliseconds stop conditions. */
         if (nr->training_max_cycles && cycles == nr->training_max_cycles)
@@ -500,56 +2431,89 @@ void *NRTrainingThreadMain(void *arg) {
          * at least take 100 milliseconds. */
         if (total_time > 10000 && cycle_time < 100) training_iterations++;
 
-        past_train_error = train_error;
-        past_test_error = test_error;
-
         /* Update stats for NR.THREADS to show progresses. */
         pthread_mutex_lock(&NRPendingTrainingMutex);
         pt->dataset_error = train_error;
         pt->test_error = test_error;
         if (nr->flags & NR_FLAG_CLASSIFIER) pt->class_error = class_error;
         pt->curcycle = cycles;
+        pt->profile = prof;
         pthread_mutex_unlock(&NRPendingTrainingMutex);
     }
+    nr->nn->profile = NULL;
+    if (nr->flags & NR_FLAG_PROFILE) NRPerfClose(&perf,&prof.net);
+
+    /* If the training was cancelled nobody is interested in the result:
+     * release the resources and terminate ASAP. */
+    if (stop == NR_STOP_CANCELLED) {
+        if (auto_stop) NRValidatorFree(&validator);
+        RedisModule_Free(saved);
+        NRTrainingTerminate(pt);
+        return NULL;
+    }
 
-    /* If auto stop is disabled, we still need to compute the test error
-     * in order to return this information to the main thread. */
-    if (!auto_stop) {
-        AnnTestError(nr->nn,
-                     nr->test.inputs,
-                     nr->test.outputs,
-                     nr->test.len, &test_error, &class_error);
+    /* The last posted validation may still be in progress: its snapshot
+     * may be the best network so far. */
+    if (auto_stop) {
+        uint64_t wait_start = NRNanoseconds();
+        int validated = NRValidatorWait(&validator,&res);
+        prof.validation_wait_ns += NRNanoseconds()-wait_start;
+        if (validated) prof.validation_ns += res.ns;
+        if (validated && backtrack && res.full &&
+            (!saved_valid || res.full_test_error < saved_error))
+        {
+            saved_error = res.full_test_error;
+            saved_train_error = res.train_error;
+            saved_class_error = res.full_class_error;
+            AnnSaveWeights(validator.nn,saved);
+            saved_valid = 1;
+        }
+        NRValidatorFree(&validator);
     }
 
+    /* Compute the test error of the final network in order to return
+     * this information to the main thread. With AUTOSTOP we can't use
+     * the last validation result, that refers to a previous cycle and
+     * may have been computed on a sample of the test dataset. */
+    uint64_t test_start = NRNanoseconds();
+    AnnTestError(nr->nn,
+                 nr->test.inputs,
+                 nr->test.outputs,
+                 nr->test.len, &test_error, &class_error);
+    prof.validation_ns += NRNanoseconds()-test_start;
+
     /* If both autostop and backtracking are enabled, we may have
-     * a better network saved! */
+     * a better network saved! Only the weights are restored: the RPROP
+     * per-weight deltas of the last cycle are retained, they are just
+     * used as a starting point for the next training. */
     if (auto_stop && backtrack) {
-        if (saved && saved_error < test_error) {
+        if (saved_valid && saved_error < test_error) {
             #ifdef NR_TRAINING_DEBUG
             printf("BACKTRACK: Saved network used!\n");
             #endif
-            AnnFree(nr->nn);
-            nr->nn = saved;
+            AnnLoadWeights(nr->nn,saved);
             test_error = saved_error;
             train_error = saved_train_error;
             class_error = saved_class_error;
-        } else if (saved) {
-            AnnFree(saved);
         }
+        RedisModule_Free(saved);
     }
 
     if (nr->flags & NR_FLAG_CLASSIFIER) nr->test_class_error = class_error;
     nr->dataset_error = train_error;
     nr->test_error = test_error;
     nr->training_total_ms += NRMilliseconds()-start;
+    prof.wall_ms = NRMilliseconds()-start;
+
+    pthread_mutex_lock(&NRPendingTrainingMutex);
+    pt->profile = prof;
+    pthread_mutex_unlock(&NRPendingTrainingMutex);
 
     /* Signal that the training process has finished, it's up to the main
      * thread to cleanup this training slot, copying the weights to the
      * original neural network and reclaiming memory for the copy we
      * used to work. */
-    pthread_mutex_lock(&NRPendingTrainingMutex);
-    pt->in_progress = 0;
-    pthread_mutex_unlock(&NRPendingTrainingMutex);
+    NRTrainingTerminate(pt);
     return NULL;
 }
 
@@ -562,8 +2526,12 @@ void *NRTrainingThreadMain(void *arg) {
  *
  *  NR_FLAG_AUTO_STOP -- Automatically stop training on overtraining.
  *  NR_FLAG_BACKTRACK -- Save current NN state when overfitting is likely.
+ *
+ * 'memory' is the estimated memory used by the training, accounted for the
+ * training memory budget till the training is collected, see
+ * NRTrainingMemoryReserved().
  */
-int NRStartTraining(RedisModuleCtx *ctx, RedisModuleString *key, int dbid, NRTypeObject *nr) {
+int NRStartTraining(RedisModuleCtx *ctx, RedisModuleString *key, int dbid, NRTypeObject *nr, size_t memory) {
     pthread_mutex_lock(&NRPendingTrainingMutex);
     if (NRPendingTrainingCount == NR_PENDING_TRAINING_MAX_LEN) {
         pthread_mutex_unlock(&NRPendingTrainingMutex);
@@ -571,41 +2539,122 @@ int NRStartTraining(RedisModuleCtx *ctx, RedisModuleString *key, int dbid, NRTyp
     }
 
     /* Setup our trainig data. */
-    NRPendingTraining *pt = &NRTrainings[NRPendingTrainingCount];
+    NRPendingTraining *pt = RedisModule_Calloc(1,sizeof(*pt));
     pt->key = RedisModule_CreateStringFromString(ctx,key);
     RedisModule_RetainString(ctx,pt->key);
     pt->db_id = dbid;
     pt->in_progress = 1;
-    pt->nr = NRClone(nr,0);
+    pt->stop = NR_STOP_NONE;
+    pt->paused = 0;
+    pt->priority = nr->training_priority;
+    pt->sched_running = 0;
+    pt->sched_seq = NRSchedNextSeq++;
+    memset(&pt->profile,0,sizeof(pt->profile));
+    pt->nr = NRClone(nr,0,&pt->profile);
+    if (nr->flags & NR_FLAG_TRAIN_SEED) AnnSeed(pt->nr->nn,nr->training_seed);
     pt->dataset_error = 0;
     pt->test_error = 0;
     pt->class_error = 0;
     pt->curcycle = 0;
+    pt->memory = memory;
     if (pthread_create(&pt->tid,NULL,NRTrainingThreadMain,pt) != 0) {
         RedisModule_Log(ctx,"warning","Unable to create a new pthread in NRStartTraining()");
         RedisModule_FreeString(ctx,pt->key);
-        pt->key = NULL;
         NRTypeReleaseObject(pt->nr);
+        RedisModule_Free(pt);
         pthread_mutex_unlock(&NRPendingTrainingMutex);
         return REDISMODULE_ERR;
     }
-    NRPendingTrainingCount++;
+    NRTrainings[NRPendingTrainingCount++] = pt;
     nr->flags |= NR_FLAG_TRAINING;
     nr->flags &= ~NR_FLAG_TO_TRANSFER;
     pthread_mutex_unlock(&NRPendingTrainingMutex);
     return REDISMODULE_OK;
 }
 
+/* Return the estimated memory used by the trainings not yet collected. */
+size_t NRTrainingMemoryReserved(void) {
+    size_t bytes = 0;
+
+    pthread_mutex_lock(&NRPendingTrainingMutex);
+    for (int j = 0; j < NRPendingTrainingCount; j++)
+        bytes += NRTrainings[j]->memory;
+    pthread_mutex_unlock(&NRPendingTrainingMutex);
+    return bytes;
+}
+
+/* Return the pending training of the neural network with the specified
+ * unique ID, or NULL if the network is not training. Must be called with
+ * the pending trainings mutex locked. */
+NRPendingTraining *NRLookupTraining(uint64_t id) {
+    for (int j = 0; j < NRPendingTrainingCount; j++) {
+        NRPendingTraining *pt = NRTrainings[j];
+        if (pt->in_progress && pt->nr->id == id) return pt;
+    }
+    return NULL;
+}
+
+/* Ask the training threads working on the neural network with the
+ * specified ID to terminate ASAP, discarding the result. This is used
+ * when the network is deleted, overwritten or reset, in order to reclaim
+ * the training slot and the CPU ASAP. Returns the number of trainings
+ * cancelled. */
+int NRCancelTrainings(uint64_t id) {
+    int cancelled = 0;
+
+    pthread_mutex_lock(&NRPendingTrainingMutex);
+    for (int j = 0; j < NRPendingTrainingCount; j++) {
+        NRPendingTraining *pt = NRTrainings[j];
+        if (pt->in_progress && pt->nr->id == id) {
+            pt->stop = NR_STOP_CANCELLED;
+            cancelled++;
+        }
+    }
+    if (cancelled) pthread_cond_broadcast(&NRPendingTrainingCond);
+    pthread_mutex_unlock(&NRPendingTrainingMutex);
+    return cancelled;
+}
+
 /* Check if there are threads that terminated the NN training, and
- * collect the info they computed (that is the new NN). */
+ * collect the info they computed (that is the new NN).
+ *
+ * The new weights are propagated to replicas and AOF with NR.SETWEIGHTS,
+ * so this function must be called only by commands flagged as "write":
+ * read only commands leave the terminated trainings to the next write
+ * command, like NR.THREADS.
+ *
+ * The terminated trainings are removed from the pending trainings array
+ * while holding the lock, but are processed after releasing it: opening
+ * the keys may free values (for instance because of expires), and our
+ * free method needs to acquire the lock as well. */
 int NRCollectThreads(RedisModuleCtx *ctx) {
+    NRPendingTraining *done[NR_PENDING_TRAINING_MAX_LEN];
     int collected = 0;
+    int phase = NRStatsPhase(NR_PHASE_COLLECT);
+
     pthread_mutex_lock(&NRPendingTrainingMutex);
     for (int j = 0; j < NRPendingTrainingCount; j++) {
-        NRPendingTraining *pt = &NRTrainings[j];
+        NRPendingTraining *pt = NRTrainings[j];
         if (pt->in_progress == 0) {
-            /* Training terminated. Let's see if the key
-             * is still there and NN ID matches. */
+            done[collected++] = pt;
+            NRPendingTrainingCount--;
+            memmove(&NRTrainings[j],&NRTrainings[j+1],
+                (NRPendingTrainingCount-j)*sizeof(NRTrainings[0]));
+            j--;
+        }
+    }
+    pthread_mutex_unlock(&NRPendingTrainingMutex);
+
+    for (int j = 0; j < collected; j++) {
+        NRPendingTraining *pt = done[j];
+
+        /* The thread already terminated its work, but make sure it
+         * exited and release its resources. */
+        pthread_join(pt->tid,NULL);
+
+        /* Training terminated. Let's see if the key
+         * is still there and NN ID matches. */
+        if (pt->stop != NR_STOP_CANCELLED) {
             int orig_id = RedisModule_GetSelectedDb(ctx);
             if (orig_id != pt->db_id) RedisModule_SelectDb(ctx,pt->db_id);
             RedisModuleKey *key = RedisModule_OpenKey(ctx,pt->key,
@@ -613,79 +2662,573 @@ int NRCollectThreads(RedisModuleCtx *ctx) {
             if (RedisModule_ModuleTypeGetType(key) == NRType) {
                 NRTypeObject *nr = RedisModule_ModuleTypeGetValue(key);
                 if (nr->id == pt->nr->id) {
+                    uint64_t start = NRNanoseconds();
                     NRTransferWeights(ctx,nr,pt->nr);
+                    if (nr->training_profile == NULL)
+                        nr->training_profile =
+                            RedisModule_Alloc(sizeof(NRTrainingProfile));
+                    *nr->training_profile = pt->profile;
+                    nr->training_profile->transfer_ns =
+                        NRNanoseconds()-start;
                     nr->flags &= ~NR_FLAG_TRAINING;
+                    NRReplicateNet(ctx,pt->key,nr);
                 }
-                RedisModule_FreeString(ctx,pt->key);
-                pt->key = NULL;
-                NRTypeReleaseObject(pt->nr);
-                NRPendingTrainingCount--;
-                memcpy(&NRTrainings[j],&NRTrainings[j+1],
-                    (NRPendingTrainingCount-j)*sizeof(NRTrainings[0]));
             }
+            RedisModule_CloseKey(key);
             if (orig_id != pt->db_id) RedisModule_SelectDb(ctx,orig_id);
-            collected++;
         }
+        RedisModule_FreeString(ctx,pt->key);
+        NRTypeReleaseObject(pt->nr);
+        RedisModule_Free(pt);
     }
-    pthread_mutex_unlock(&NRPendingTrainingMutex);
+    NRStatsPhase(phase);
     return collected;
 }
 
+/* =============================== Inference ================================ */
+
+/* Inference runs in the main thread for small requests, but big batches
+ * would block the event loop (and all the other clients) for a long time,
+ * so when the amount of work is above the configured threshold the client
+ * is blocked and the job is executed by a pool of inference threads, that
+ * reply when done.
+ *
+ * Inference never uses the network that is trained, but a compiled copy
+ * with just the weights, and the normalization folded into them (see
+ * NRGetCompiledNet()). Compiled networks are never modified: when the
+ * weights change a new one is created. Jobs pin the compiled network with
+ * AnnRetain(), so they work on the network they were submitted for even if
+ * in the meantime the key is deleted, reset, or trained again. */
+#define NR_INFERENCE_MAX_THREADS 64
+
+typedef struct NRInferenceJob {
+    RedisModuleBlockedClient *bc; /* Blocked client, NULL if inline. */
+    struct Ann *nn;         /* Pinned compiled network. */
+    int flags;              /* Flags of the network object. */
+    int output_class;       /* Reply with the class instead of outputs. */
+    uint32_t rows;          /* Number of inputs vectors. */
+    float *inputs;          /* Inputs, ilen floats per row. */
+    float *outputs;         /* Outputs, olen floats per row. */
+    /* If not NULL, called to reply instead of NRInferenceReply(), and to
+     * free 'privdata' with the job. */
+    void (*reply)(RedisModuleCtx *ctx, struct NRInferenceJob *job);
+    void (*free_privdata)(void *privdata);
+    void *privdata;
+    struct NRInferenceJob *next;
+} NRInferenceJob;
+
+static pthread_mutex_t NRInferenceMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t NRInferenceCond = PTHREAD_COND_INITIALIZER;
+static NRInferenceJob *NRInferenceHead = NULL, *NRInferenceTail = NULL;
+static int NRInferenceAlive[NR_INFERENCE_MAX_THREADS];
+static uint64_t NRInferenceOffloaded = 0; /* Jobs executed by the pool. */
+
+/* Return a scratch buffer of at least 'len' floats, private to the calling
+ * thread, to be used with AnnForward(). This way inference never writes
+ * into the network object, that can be shared by multiple threads. The
+ * buffer is reused across calls, and only grows. */
+static __thread float *NRScratch = NULL;
+static __thread size_t NRScratchLen = 0;
+
+float *NRGetScratch(size_t len) {
+    if (len > NRScratchLen) {
+        RedisModule_Free(NRScratch);
+        NRScratch = RedisModule_Alloc(sizeof(float)*len);
+        NRScratchLen = len;
+    }
+    return NRScratch;
+}
+
+/* Release the scratch buffer of the calling thread. */
+void NRFreeScratch(void) {
+    RedisModule_Free(NRScratch);
+    NRScratch = NULL;
+    NRScratchLen = 0;
+}
+
+/* Return the inference ready form of the network of 'nr', creating it if
+ * needed: a copy of just the weights, with the inputs normalization folded
+ * into the input layer weights, and the outputs normalization fused into
+ * the output layer. This way normalized networks are as cheap to run as
+ * the other ones, and inference takes raw inputs and returns raw outputs.
+ * The compiled network is recreated when the weights change. */
+struct Ann *NRGetCompiledNet(NRTypeObject *nr) {
+    if (nr->compiled && nr->compiled_version == nr->weights_version)
+        return nr->compiled;
+    if (nr->compiled) AnnRelease(nr->compiled);
+
+    int normalize = nr->flags & NR_FLAG_NORMALIZE;
+    float *ishift = (normalize && (nr->flags & NR_FLAG_ZSCORE)) ?
+                    nr->ishift : NULL;
+    float *iscale = normalize ? nr->inorm : NULL;
+    float *oscale = (normalize && !(nr->flags & NR_FLAG_CLASSIFIER)) ?
+                    nr->onorm : NULL;
+    nr->compiled = AnnCompile(nr->nn,ishift,iscale,oscale);
+    nr->compiled_version = nr->weights_version;
+    return nr->compiled;
+}
+
+/* Create a job for 'rows' inputs vectors on the network of 'nr'. The
+ * caller should fill job->inputs. */
+NRInferenceJob *NRInferenceCreateJob(NRTypeObject *nr, uint32_t rows, int output_class) {
+    int ilen = INPUT_UNITS(nr->nn);
+    int olen = OUTPUT_UNITS(nr->nn);
+    NRInferenceJob *job = RedisModule_Calloc(1,sizeof(*job));
+
+    job->nn = AnnRetain(NRGetCompiledNet(nr));
+    job->flags = nr->flags;
+    job->output_class = output_class;
+    job->rows = rows;
+    job->inputs = RedisModule_Alloc(sizeof(float)*ilen*rows);
+    job->outputs = RedisModule_Alloc(sizeof(float)*olen*rows);
+    return job;
+}
+
+void NRInferenceFreeJob(NRInferenceJob *job) {
+    if (job->free_privdata) job->free_privdata(job->privdata);
+    AnnRelease(job->nn);
+    RedisModule_Free(job->inputs);
+    RedisModule_Free(job->outputs);
+    RedisModule_Free(job);
+}
+
+/* Compute the outputs of all the rows of the job. Thread safe. */
+void NRInferenceRun(NRInferenceJob *job) {
+    int ilen = INPUT_UNITS(job->nn);
+    int olen = OUTPUT_UNITS(job->nn);
+    float *scratch = NRGetScratch(AnnScratchLen(job->nn));
+
+    for (uint32_t j = 0; j < job->rows; j++) {
+        float *outputs = AnnForward(job->nn,job->inputs+(size_t)j*ilen,scratch);
+        memcpy(job->outputs+(size_t)j*olen,outputs,sizeof(float)*olen);
+    }
+}
+
+/* Return the class of the row 'r' of the job, that is, the index of the
+ * output with the greatest value. */
+int NRInferenceClass(NRInferenceJob *job, uint32_t r) {
+    int olen = OUTPUT_UNITS(job->nn);
+    float *outputs = job->outputs+(size_t)r*olen;
+    float max = outputs[0];
+    int max_class = 0;
+
+    for(int j = 1; j < olen; j++) {
+        float output = outputs[j];
+        if (output > max) {
+            max = output;
+            max_class = j;
+        }
+    }
+    return max_class;
+}
+
+/* Reply with the outputs of the row 'r' of the job: the raw net outputs,
+ * or the class ID if the network is a classifier and the job was created
+ * for NR.CLASS. */
+void NRInferenceReplyRow(RedisModuleCtx *ctx, NRInferenceJob *job, uint32_t r) {
+    int olen = OUTPUT_UNITS(job->nn);
+    float *outputs = job->outputs+(size_t)r*olen;
+
+    if (job->output_class) {
+        RedisModule_ReplyWithLongLong(ctx, NRInferenceClass(job,r));
+    } else {
+        RedisModule_ReplyWithArray(ctx,olen);
+        for(int j = 0; j < olen; j++)
+            RedisModule_ReplyWithDouble(ctx, outputs[j]);
+    }
+}
+
+/* Reply to the client with the results of the job. Single row jobs reply
+ * with the outputs (or the class), batches with an array of rows, unless
+ * the job has its own reply function. */
+void NRInferenceReply(RedisModuleCtx *ctx, NRInferenceJob *job) {
+    if (job->reply) {
+        job->reply(ctx,job);
+        return;
+    }
+    if (job->rows != 1) RedisModule_ReplyWithArray(ctx,job->rows);
+    for (uint32_t r = 0; r < job->rows; r++) NRInferenceReplyRow(ctx,job,r);
+}
+
+/* Blocked client callbacks. */
+int NRInferenceReplyCallback(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    UNUSED(argv);
+    UNUSED(argc);
+    NRInferenceReply(ctx,RedisModule_GetBlockedClientPrivateData(ctx));
+    return REDISMODULE_OK;
+}
+
+void NRInferenceFreePrivdata(RedisModuleCtx *ctx, void *privdata) {
+    UNUSED(ctx);
+    NRInferenceFreeJob(privdata);
+}
+
+/* Inference thread entry point. Threads are identified by their slot in
+ * the NRInferenceAlive array, and terminate when idle if the configured
+ * number of threads was reduced below their slot. */
+void *NRInferenceThreadMain(void *arg) {
+    int slot = (int)(long)arg;
+
+    NRSchedPlaceThread(NR_SCHED_MAX_PRIORITY);
+    pthread_mutex_lock(&NRInferenceMutex);
+    while(1) {
+        while (NRInferenceHead == NULL) {
+            if (slot >= NRConfig.inference_threads) {
+                NRInferenceAlive[slot] = 0;
+                pthread_mutex_unlock(&NRInferenceMutex);
+                NRFreeScratch();
+                return NULL;
+            }
+            pthread_cond_wait(&NRInferenceCond,&NRInferenceMutex);
+        }
+        NRInferenceJob *job = NRInferenceHead;
+        NRInferenceHead = job->next;
+        if (NRInferenceHead == NULL) NRInferenceTail = NULL;
+        NRInferenceOffloaded++;
+        pthread_mutex_unlock(&NRInferenceMutex);
+
+        NRInferenceRun(job);
+        RedisModule_UnblockClient(job->bc,job);
+        pthread_mutex_lock(&NRInferenceMutex);
+    }
+}
+
+/* Make sure the configured number of inference threads is running, and
+ * wake up the idle ones that should terminate. Returns the number of
+ * threads running. */
+int NRInferenceUpdateThreads(void) {
+    int running = 0;
+
+    pthread_mutex_lock(&NRInferenceMutex);
+    for (int j = 0; j < NRConfig.inference_threads; j++) {
+        if (!NRInferenceAlive[j]) {
+            pthread_t tid;
+            if (pthread_create(&tid,NULL,NRInferenceThreadMain,
+                               (void*)(long)j) != 0) continue;
+            pthread_detach(tid);
+            NRInferenceAlive[j] = 1;
+        }
+        running++;
+    }
+    pthread_cond_broadcast(&NRInferenceCond);
+    pthread_mutex_unlock(&NRInferenceMutex);
+    return running;
+}
+
+/* Like NRInferenceRun(), but using the inference cache of 'nr'. Must be
+ * called from the main thread. */
+void NRInferenceRunCached(NRInferenceJob *job, NRTypeObject *nr) {
+    int ilen = INPUT_UNITS(job->nn);
+    int olen = OUTPUT_UNITS(job->nn);
+    float *scratch = NRGetScratch(AnnScratchLen(job->nn));
+
+    for (uint32_t j = 0; j < job->rows; j++) {
+        float *inputs = job->inputs+(size_t)j*ilen;
+        uint64_t hash;
+        float *outputs = NRCacheLookup(nr->cache,nr->weights_version,
+                                       inputs,&hash);
+        if (outputs == NULL) {
+            outputs = AnnForward(job->nn,inputs,scratch);
+            NRCacheAdd(nr->cache,hash,inputs,outputs);
+        }
+        memcpy(job->outputs+(size_t)j*olen,outputs,sizeof(float)*olen);
+    }
+}
+
+/* Execute the job created for 'nr' and reply to the client. The job is
+ * offloaded to the inference threads if it is big enough and the client
+ * can be blocked, otherwise it is executed synchronously, using the
+ * inference cache if the network has one. Takes ownership of the job. */
+void NRInferenceExecute(RedisModuleCtx *ctx, NRInferenceJob *job, NRTypeObject *nr) {
+    double flops = (double)ANN_FLOPS_FORWARD*AnnCountWeights(job->nn)*
+                   job->rows;
+    int offload = NRConfig.inference_threads &&
+                  flops >= NRConfig.inference_offload_flops &&
+                  RedisModule_BlockClient != NULL;
+
+    nr->inference_calls++;
+    nr->inference_rows += job->rows;
+
+    /* Clients can't be blocked inside MULTI and scripts. */
+    if (offload && RedisModule_GetContextFlags &&
+        RedisModule_GetContextFlags(ctx) &
+        (REDISMODULE_CTX_FLAGS_LUA|REDISMODULE_CTX_FLAGS_MULTI)) offload = 0;
+    if (offload && NRInferenceUpdateThreads() == 0) offload = 0;
+
+    if (!offload) {
+        NRStatsPhase(NR_PHASE_SIMULATE);
+        if (nr->cache) NRInferenceRunCached(job,nr);
+        else NRInferenceRun(job);
+        NRStatsPhase(NR_PHASE_REPLY);
+        NRInferenceReply(ctx,job);
+        NRInferenceFreeJob(job);
+        return;
+    }
+
+    NRStatsPhase(NR_PHASE_OTHER);
+    job->bc = RedisModule_BlockClient(ctx,NRInferenceReplyCallback,NULL,
+                                      NRInferenceFreePrivdata,0);
+    pthread_mutex_lock(&NRInferenceMutex);
+    if (NRInferenceTail) NRInferenceTail->next = job;
+    else NRInferenceHead = job;
+    NRInferenceTail = job;
+    pthread_cond_signal(&NRInferenceCond);
+    pthread_mutex_unlock(&NRInferenceMutex);
+}
+
+/* Parse a memory amount like Redis does in its configuration: a number of
+ * bytes, optionally followed by k, kb, m, mb, g or gb, where the units
+ * ending with 'b' are powers of 1024 and the others powers of 1000. */
+int NRParseMemory(const char *value, long long *bytes) {
+    static const struct {
+        const char *unit;
+        long long mul;
+    } units[] = {
+        {"", 1}, {"k", 1000}, {"kb", 1024}, {"m", 1000*1000},
+        {"mb", 1024*1024}, {"g", 1000LL*1000*1000}, {"gb", 1024LL*1024*1024}
+    };
+    char *eptr;
+    long long v = strtoll(value,&eptr,10);
+
+    if (eptr == value || v < 0) return REDISMODULE_ERR;
+    for (size_t j = 0; j < sizeof(units)/sizeof(units[0]); j++) {
+        if (!strcasecmp(eptr,units[j].unit)) {
+            if (v > LLONG_MAX/units[j].mul) return REDISMODULE_ERR;
+            *bytes = v*units[j].mul;
+            return REDISMODULE_OK;
+        }
+    }
+    return REDISMODULE_ERR;
+}
+
+/* Set the module configuration option 'name' to 'value'. Returns
+ * REDISMODULE_OK on success, otherwise REDISMODULE_ERR is returned and
+ * '*err' is set to an error message. Must be called from the main
+ * thread. */
+int NRConfigSet(const char *name, const char *value, const char **err) {
+    char *eptr;
+    long v;
+
+    if (!strcasecmp(name,"training-cpu-quota")) {
+        v = strtol(value,&eptr,10);
+        int perc = (*eptr == '%');
+        if (eptr == value || *(eptr+perc) != '\0' || v < 0 ||
+            (perc ? v > 100 : v > NR_PENDING_TRAINING_MAX_LEN))
+        {
+            *err = "ERR invalid CPU quota: use a number of CPUs or a percentage";
+            return REDISMODULE_ERR;
+        }
+        pthread_mutex_lock(&NRPendingTrainingMutex);
+        NRConfig.training_cpu_quota = perc ? 0 : v;
+        NRConfig.training_cpu_quota_perc = perc ? v : 0;
+        pthread_cond_broadcast(&NRPendingTrainingCond);
+        pthread_mutex_unlock(&NRPendingTrainingMutex);
+    } else if (!strcasecmp(name,"training-reserved-cpu")) {
+        if (!strcasecmp(value,"none")) {
+            v = NR_CPU_NONE;
+        } else {
+            v = strtol(value,&eptr,10);
+            if (eptr == value || *eptr != '\0' || v < 0 || v >= 1024) {
+                *err = "ERR invalid reserved CPU: use a CPU number or NONE";
+                return REDISMODULE_ERR;
+            }
+        }
+        pthread_mutex_lock(&NRPendingTrainingMutex);
+        NRConfig.training_reserved_cpu = v;
+        NRSchedUpdatePlacement();
+        pthread_cond_broadcast(&NRPendingTrainingCond);
+        pthread_mutex_unlock(&NRPendingTrainingMutex);
+    } else if (!strcasecmp(name,"inference-threads")) {
+        v = strtol(value,&eptr,10);
+        if (eptr == value || *eptr != '\0' || v < 0 ||
+            v > NR_INFERENCE_MAX_THREADS)
+        {
+            *err = "ERR invalid number of inference threads";
+            return REDISMODULE_ERR;
+        }
+        pthread_mutex_lock(&NRInferenceMutex);
+        NRConfig.inference_threads = v;
+        pthread_mutex_unlock(&NRInferenceMutex);
+        NRInferenceUpdateThreads();
+    } else if (!strcasecmp(name,"inference-offload-flops")) {
+        long long ll = strtoll(value,&eptr,10);
+        if (eptr == value || *eptr != '\0' || ll < 0) {
+            *err = "ERR invalid number of floating point operations";
+            return REDISMODULE_ERR;
+        }
+        NRConfig.inference_offload_flops = ll;
+    } else if (!strcasecmp(name,"training-memory-budget")) {
+        long long ll;
+        if (NRParseMemory(value,&ll) == REDISMODULE_ERR) {
+            *err = "ERR invalid memory budget: use a number of bytes, "
+                   "optionally followed by kb, mb or gb";
+            return REDISMODULE_ERR;
+        }
+        NRConfig.training_memory_budget = ll;
+    } else {
+        *err = "ERR unknown configuration option";
+        return REDISMODULE_ERR;
+    }
+    return REDISMODULE_OK;
+}
+
+/* Names of the configuration options, for NR.CONFIG GET *. */
+static const char *NRConfigNames[] = {
+    "training-cpu-quota",
+    "training-reserved-cpu",
+    "inference-threads",
+    "inference-offload-flops",
+    "training-memory-budget",
+    NULL
+};
+
+/* Write the value of the configuration option 'name' into 'buf'. Returns
+ * REDISMODULE_ERR if there is no such option. */
+int NRConfigGet(const char *name, char *buf, size_t len) {
+    if (!strcasecmp(name,"training-cpu-quota")) {
+        if (NRConfig.training_cpu_quota_perc)
+            snprintf(buf,len,"%d%%",NRConfig.training_cpu_quota_perc);
+        else
+            snprintf(buf,len,"%d",NRConfig.training_cpu_quota);
+    } else if (!strcasecmp(name,"training-reserved-cpu")) {
+        if (NRConfig.training_reserved_cpu == NR_CPU_NONE)
+            snprintf(buf,len,"none");
+        else
+            snprintf(buf,len,"%d",NRConfig.training_reserved_cpu);
+    } else if (!strcasecmp(name,"inference-threads")) {
+        snprintf(buf,len,"%d",NRConfig.inference_threads);
+    } else if (!strcasecmp(name,"inference-offload-flops")) {
+        snprintf(buf,len,"%lld",NRConfig.inference_offload_flops);
+    } else if (!strcasecmp(name,"training-memory-budget")) {
+        snprintf(buf,len,"%lld",NRConfig.training_memory_budget);
+    } else {
+        return REDISMODULE_ERR;
+    }
+    return REDISMODULE_OK;
+}
+
 /* ================================ Commands =============================== */
 
-/* NR.CREATE <key> <type> <inputs> [<hidden> ...] -> <outputs> [DATASET <items>]
- * [TEST <items>] [NORMALIZE] */
-int NRCreate_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    long long dset_size = 0, test_size = 0;
-    int layers[NR_MAX_LAYERS], num_layers = 0;
-    int flags = NR_FLAG_NONE;
-    RedisModule_AutoMemory(ctx);
-    NRCollectThreads(ctx);
+/* Parse the weights initialization methods of the NR.CREATE INIT option:
+ * either a single method for all the layers, or a comma separated list
+ * with a method for each layer of weights, starting from the input layer.
+ * On success the method of every layer is stored in 'init', that is
+ * indexed like the layers of the network, and REDISMODULE_OK is
+ * returned. */
+int NRParseInit(const char *spec, int *init, int num_layers) {
+    int count = 0, methods[NR_MAX_LAYERS];
+
+    while (count < NR_MAX_LAYERS) {
+        size_t len = strcspn(spec,",");
+        if (len == 7 && !strncasecmp(spec,"uniform",len))
+            methods[count++] = ANN_INIT_UNIFORM;
+        else if (len == 6 && !strncasecmp(spec,"xavier",len))
+            methods[count++] = ANN_INIT_XAVIER;
+        else if (len == 2 && !strncasecmp(spec,"he",len))
+            methods[count++] = ANN_INIT_HE;
+        else
+            return REDISMODULE_ERR;
+        if (spec[len] == '\0') break;
+        spec += len+1;
+    }
+    if (count != 1 && count != num_layers-1) return REDISMODULE_ERR;
 
-    if (argc < 6) return RedisModule_WrongArity(ctx);
+    /* Layer 0 is the output layer, and the weights of layer i connect it
+     * to layer i-1. */
+    for (int i = 1; i < num_layers; i++)
+        init[i] = (count == 1) ? methods[0] : methods[num_layers-1-i];
+    return REDISMODULE_OK;
+}
 
-    const char *nntype = RedisModule_StringPtrLen(argv[2], NULL);
+/* Parse the "<type> <inputs> [<hidden> ...] -> <outputs>" network
+ * definition of NR.CREATE and NR.IMPORT RAW, starting at argv[*j]. On
+ * success the type flag is added to '*flags', the units are stored in
+ * 'layers' in the order used by the NN library (output layer first), and
+ * '*j' is updated to the index of the first argument after the definition.
+ * On error REDISMODULE_ERR is returned and '*err' is set. */
+int NRParseLayout(RedisModuleString **argv, int argc, int *j, int *flags,
+                  int *layers, int *num_layers, const char **err)
+{
+    if (*j >= argc) {
+        *err = "ERR missing neural network type";
+        return REDISMODULE_ERR;
+    }
+    const char *nntype = RedisModule_StringPtrLen(argv[*j], NULL);
     if (!strcasecmp(nntype,"classifier")) {
-        flags |= NR_FLAG_CLASSIFIER;
+        *flags |= NR_FLAG_CLASSIFIER;
     } else if (!strcasecmp(nntype,"regressor")) {
-        flags |= NR_FLAG_REGRESSOR;
+        *flags |= NR_FLAG_REGRESSOR;
     } else {
-        return RedisModule_ReplyWithError(ctx,
-            "ERR invalid neural network type. Must be "
-            "CLASSIFIER or REGRESSOR");
+        *err = "ERR invalid neural network type. Must be "
+               "CLASSIFIER or REGRESSOR";
+        return REDISMODULE_ERR;
     }
 
     /* Parse net layers definition. */
-    int j = 3, stop = 0;
-    while (j < argc) {
-        const char *u = RedisModule_StringPtrLen(argv[j], NULL);
+    int stop = 0;
+    *num_layers = 0;
+    (*j)++;
+    while (*j < argc) {
+        const char *u = RedisModule_StringPtrLen(argv[*j], NULL);
         long long units;
 
         /* When we see -> the next layer is the final layer (output) layer. */
         if (!strcmp(u,"->")) {
             stop = 1;
-            j++;
+            (*j)++;
             continue;
         }
-        if (RedisModule_StringToLongLong(argv[j],&units) != REDISMODULE_OK ||
-            units <= 0)
+        if (RedisModule_StringToLongLong(argv[*j],&units) != REDISMODULE_OK ||
+            units <= 0 || units > INT32_MAX/2)
         {
-            return RedisModule_ReplyWithError(ctx, "ERR invalid units count");
+            *err = "ERR invalid units count";
+            return REDISMODULE_ERR;
         }
-        layers[num_layers++] = units;
-        j++;
+        if (*num_layers == NR_MAX_LAYERS) {
+            *err = "ERR too many layers";
+            return REDISMODULE_ERR;
+        }
+        layers[(*num_layers)++] = units;
+        (*j)++;
         if (stop) break;
     }
+    if (!stop || *num_layers < 2) {
+        *err = "ERR invalid layers definition, use: "
+               "<inputs> [<hidden> ...] -> <outputs>";
+        return REDISMODULE_ERR;
+    }
 
     /* Our NN library takes the definition of layers in the opposite
      * order, swap the layers array. */
-    for (int i = 0; i < num_layers/2; i++) {
+    for (int i = 0; i < *num_layers/2; i++) {
         int t = layers[i];
-        layers[i] = layers[num_layers-1-i];
-        layers[num_layers-1-i] = t;
+        layers[i] = layers[*num_layers-1-i];
+        layers[*num_layers-1-i] = t;
     }
+    return REDISMODULE_OK;
+}
 
-    /* Parse the remaining options. */
+/* Options following the layout in NR.CREATE, also accepted by NR.EXPLAIN. */
+typedef struct NRCreateOptions {
+    long long dataset_len;      /* DATASET maxlen. */
+    long long test_len;         /* TEST maxlen. */
+    long long cache_size;       /* CACHE entries. */
+    long long seed;             /* SEED, if 'seeded' is true. */
+    int seeded;
+    int custom_init;            /* True if 'init' was set with INIT. */
+    int init[NR_MAX_LAYERS];    /* ANN_INIT_... of every layer. */
+} NRCreateOptions;
+
+/* Parse the NR.CREATE options, from argv[j] to the last argument, for a
+ * network with 'num_layers' layers. NORMALIZE and ZSCORE are added to
+ * '*flags'. On error REDISMODULE_ERR is returned and '*err' is set, or
+ * is set to NULL for syntax errors, so that the caller can report the
+ * command name. */
+int NRParseCreateOptions(RedisModuleString **argv, int argc, int j,
+                         int num_layers, int *flags, NRCreateOptions *opt,
+                         const char **err)
+{
+    memset(opt,0,sizeof(*opt));
     for (; j < argc; j++) {
         const char *o = RedisModule_StringPtrLen(argv[j], NULL);
         long long v;
@@ -696,21 +3239,76 @@ int NRCreate_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int arg
             if ((RedisModule_StringToLongLong(argv[j+1],&v) != REDISMODULE_OK) ||
                  v < 0)
             {
-                return RedisModule_ReplyWithError(ctx,
-                    "ERR invalid dataset size");
+                *err = "ERR invalid dataset size";
+                return REDISMODULE_ERR;
             }
             if (!strcasecmp(o,"dataset"))
-                dset_size = v;
+                opt->dataset_len = v;
             else
-                test_size = v;
+                opt->test_len = v;
             j++;
         } else if (!strcasecmp(o,"normalize")) {
-            flags |= NR_FLAG_NORMALIZE;
+            *flags |= NR_FLAG_NORMALIZE;
+        } else if (!strcasecmp(o,"zscore")) {
+            *flags |= NR_FLAG_NORMALIZE|NR_FLAG_ZSCORE;
+        } else if (!strcasecmp(o,"cache") && !lastarg) {
+            if ((RedisModule_StringToLongLong(argv[j+1],&v) != REDISMODULE_OK) ||
+                 v < 0 || v > NR_CACHE_MAX_SIZE)
+            {
+                *err = "ERR invalid cache size";
+                return REDISMODULE_ERR;
+            }
+            opt->cache_size = v;
+            j++;
+        } else if (!strcasecmp(o,"seed") && !lastarg) {
+            if (RedisModule_StringToLongLong(argv[j+1],&opt->seed) !=
+                REDISMODULE_OK)
+            {
+                *err = "ERR invalid seed";
+                return REDISMODULE_ERR;
+            }
+            opt->seeded = 1;
+            j++;
+        } else if (!strcasecmp(o,"init") && !lastarg) {
+            const char *spec = RedisModule_StringPtrLen(argv[j+1],NULL);
+            if (NRParseInit(spec,opt->init,num_layers) != REDISMODULE_OK) {
+                *err = "ERR invalid INIT: use UNIFORM, XAVIER or HE, or a "
+                       "comma separated list with one method per layer of "
+                       "weights";
+                return REDISMODULE_ERR;
+            }
+            opt->custom_init = 1;
+            j++;
         } else {
-            return RedisModule_ReplyWithError(ctx,
-                "ERR Syntax error in NR.CREATE");
+            *err = NULL;
+            return REDISMODULE_ERR;
         }
     }
+    return REDISMODULE_OK;
+}
+
+/* NR.CREATE <key> <type> <inputs> [<hidden> ...] -> <outputs>
+ *           [DATASET <items>] [TEST <items>] [NORMALIZE] [ZSCORE]
+ *           [CACHE <size>] [SEED <seed>] [INIT <method>[,<method> ...]] */
+int NRCreate_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    int layers[NR_MAX_LAYERS], num_layers = 0;
+    int flags = NR_FLAG_NONE;
+    NRCreateOptions opt;
+    const char *err;
+    RedisModule_AutoMemory(ctx);
+    NRCollectThreads(ctx);
+
+    if (argc < 6) return RedisModule_WrongArity(ctx);
+
+    int j = 2;
+    if (NRParseLayout(argv,argc,&j,&flags,layers,&num_layers,&err)
+        != REDISMODULE_OK) return RedisModule_ReplyWithError(ctx,err);
+    if (NRParseCreateOptions(argv,argc,j,num_layers,&flags,&opt,&err)
+        != REDISMODULE_OK)
+    {
+        return RedisModule_ReplyWithError(ctx,
+            err ? err : "ERR Syntax error in NR.CREATE");
+    }
 
     /* Open the key, and check that's available. */
     RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],
@@ -722,18 +3320,172 @@ int NRCreate_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int arg
 
     /* We can finally create our neural network. */
     NRTypeObject *nr = createNRTypeObject(flags,layers,num_layers,
-                              dset_size,test_size);
+                              opt.dataset_len,opt.test_len);
+    if (opt.cache_size) nr->cache = NRCacheCreate(opt.cache_size,
+        INPUT_UNITS(nr->nn),OUTPUT_UNITS(nr->nn));
+    if (opt.seeded || opt.custom_init) {
+        if (opt.seeded) AnnSeed(nr->nn,opt.seed);
+        if (opt.custom_init) {
+            for (int i = 1; i < num_layers; i++)
+                nr->nn->layer[i].init = opt.init[i];
+        }
+        AnnSetRandomWeights(nr->nn);
+    }
     RedisModule_ModuleTypeSetValue(key,NRType,nr);
 
     RedisModule_ReplyWithLongLong(ctx,AnnCountWeights(nr->nn));
-    RedisModule_ReplicateVerbatim(ctx);
+
+    /* Replicate the network as created, so that replicas get the same
+     * random weights. */
+    NRReplicateNet(ctx,argv[1],nr);
     return REDISMODULE_OK;
 }
 
-/* Implements NR.RUN and NR.CLASS. */
+/* Reply to NR.EXPLAIN with the costs of a network with the layout of
+ * 'nn' (that may have no arrays allocated, see AnnCreateLayout()), the
+ * specified flags, datasets and cache sizes. Everything is computed from
+ * the layout, and refers to the datasets at full capacity, so this is
+ * what a network created with the same arguments will cost. */
+void NRReplyWithExplain(RedisModuleCtx *ctx, struct Ann *nn, int flags,
+                        uint64_t dataset_len, uint64_t test_len,
+                        uint32_t cache_size)
+{
+    int layers = LAYERS(nn), width = AnnVectorWidth();
+    size_t ilen = INPUT_UNITS(nn), olen = OUTPUT_UNITS(nn);
+    size_t weights = AnnCountWeights(nn);
+    size_t net_bytes = AnnLayoutMemoryUsage(nn,0);
+
+    /* The NR object, the normalization vectors, and the statistics of the
+     * training dataset, see NRTypeMemoryUsage(). */
+    size_t model_bytes = sizeof(NRTypeObject) + net_bytes +
+                         NRTypeVectorsMemoryUsage(ilen,olen);
+    size_t dataset_bytes = NRDatasetLayoutMemoryUsage(dataset_len,ilen,olen) +
+                           NRDatasetLayoutMemoryUsage(test_len,ilen,olen);
+    size_t training_bytes =
+        NRTrainingMemoryEstimate(nn,dataset_len,test_len,0,0,0);
+    size_t autostop_bytes =
+        NRTrainingMemoryEstimate(nn,dataset_len,test_len,1,1,0);
+
+    RedisModule_ReplyWithArray(ctx,28);
+    RedisModule_ReplyWithSimpleString(ctx,"type");
+    RedisModule_ReplyWithSimpleString(ctx,
+        (flags & NR_FLAG_CLASSIFIER) ? "classifier" : "regressor");
+    RedisModule_ReplyWithSimpleString(ctx,"kernel");
+    RedisModule_ReplyWithSimpleString(ctx,AnnKernelName());
+
+    /* Layers of weights, from the inputs to the outputs. The vector
+     * kernels process the rows of weights, one per unit of the next layer,
+     * in blocks of AnnVectorWidth() floats, and what is left one by one. */
+    RedisModule_ReplyWithSimpleString(ctx,"layers");
+    RedisModule_ReplyWithArray(ctx,layers-1);
+    for (int i = layers-1; i > 0; i--) {
+        int units = UNITS(nn,i);
+        int next = UNITS(nn,i-1) - (i > 1); /* Skip the bias unit. */
+        size_t w = (size_t)units*next;
+        RedisModule_ReplyWithArray(ctx,10);
+        RedisModule_ReplyWithSimpleString(ctx,"inputs");
+        RedisModule_ReplyWithLongLong(ctx,units-1);
+        RedisModule_ReplyWithSimpleString(ctx,"outputs");
+        RedisModule_ReplyWithLongLong(ctx,next);
+        RedisModule_ReplyWithSimpleString(ctx,"weights");
+        RedisModule_ReplyWithLongLong(ctx,w);
+        RedisModule_ReplyWithSimpleString(ctx,"flops-per-inference");
+        RedisModule_ReplyWithLongLong(ctx,ANN_FLOPS_FORWARD*w);
+        RedisModule_ReplyWithSimpleString(ctx,"vectorized-perc");
+        RedisModule_ReplyWithDouble(ctx,width == 1 ? 0 :
+            (double)(units/width*width)*100/units);
+    }
+
+    RedisModule_ReplyWithSimpleString(ctx,"weights");
+    RedisModule_ReplyWithLongLong(ctx,weights);
+    RedisModule_ReplyWithSimpleString(ctx,"flops-per-inference");
+    RedisModule_ReplyWithLongLong(ctx,ANN_FLOPS_FORWARD*weights);
+    RedisModule_ReplyWithSimpleString(ctx,"flops-per-training-sample");
+    RedisModule_ReplyWithLongLong(ctx,(ANN_FLOPS_FORWARD+ANN_FLOPS_BACKWARD+
+                                       ANN_FLOPS_ACCUMULATE)*weights);
+    RedisModule_ReplyWithSimpleString(ctx,"model-bytes");
+    RedisModule_ReplyWithLongLong(ctx,model_bytes);
+    RedisModule_ReplyWithSimpleString(ctx,"inference-bytes");
+    RedisModule_ReplyWithLongLong(ctx,AnnLayoutMemoryUsage(nn,1));
+    RedisModule_ReplyWithSimpleString(ctx,"dataset-bytes");
+    RedisModule_ReplyWithLongLong(ctx,dataset_bytes);
+    RedisModule_ReplyWithSimpleString(ctx,"cache-bytes");
+    RedisModule_ReplyWithLongLong(ctx,cache_size ?
+        NRCacheMemoryUsage(cache_size,ilen,olen) : 0);
+    RedisModule_ReplyWithSimpleString(ctx,"training-bytes");
+    RedisModule_ReplyWithLongLong(ctx,training_bytes);
+    RedisModule_ReplyWithSimpleString(ctx,"training-autostop-bytes");
+    RedisModule_ReplyWithLongLong(ctx,autostop_bytes);
+
+    /* The smallest NR.RUN ROWS batch offloaded to the inference threads,
+     * if offloading is possible at all. */
+    RedisModule_ReplyWithSimpleString(ctx,"offload-min-rows");
+    if (NRConfig.inference_threads && RedisModule_BlockClient != NULL) {
+        double rows = ceil(NRConfig.inference_offload_flops/
+                           ((double)ANN_FLOPS_FORWARD*weights));
+        RedisModule_ReplyWithLongLong(ctx,rows > 1 ? (long long)rows : 1);
+    } else {
+        RedisModule_ReplyWithNull(ctx);
+    }
+}
+
+/* NR.EXPLAIN key
+ * NR.EXPLAIN <type> <inputs> [<hidden> ...] -> <outputs> [NR.CREATE options]
+ *
+ * Report what a network costs, in memory and FLOPs, either an existing
+ * network or one that NR.CREATE would create with the same arguments,
+ * without creating it.
+ *
+ * Only the first form has a key, so the command is registered without
+ * key positions, and the key is reported with the getkeys API. */
+int NRExplain_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (RedisModule_IsKeysPositionRequest &&
+        RedisModule_IsKeysPositionRequest(ctx))
+    {
+        if (argc == 2) RedisModule_KeyAtPos(ctx,1);
+        return REDISMODULE_OK;
+    }
+    RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+    if (argc == 2) {
+        RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],
+            REDISMODULE_READ);
+        if (RedisModule_ModuleTypeGetType(key) != NRType)
+            return RedisModule_ReplyWithError(ctx,
+                REDISMODULE_ERRORMSG_WRONGTYPE);
+        NRTypeObject *nr = RedisModule_ModuleTypeGetValue(key);
+        NRReplyWithExplain(ctx,nr->nn,nr->flags,nr->dataset.maxlen,
+                           nr->test.maxlen,nr->cache ? nr->cache->size : 0);
+        return REDISMODULE_OK;
+    }
+    if (argc < 5) return RedisModule_WrongArity(ctx);
+
+    int layers[NR_MAX_LAYERS], num_layers = 0;
+    int flags = NR_FLAG_NONE, j = 1;
+    NRCreateOptions opt;
+    const char *err;
+    if (NRParseLayout(argv,argc,&j,&flags,layers,&num_layers,&err)
+        != REDISMODULE_OK) return RedisModule_ReplyWithError(ctx,err);
+    if (NRParseCreateOptions(argv,argc,j,num_layers,&flags,&opt,&err)
+        != REDISMODULE_OK)
+    {
+        return RedisModule_ReplyWithError(ctx,
+            err ? err : "ERR Syntax error in NR.EXPLAIN");
+    }
+    struct Ann *nn = AnnCreateLayout(num_layers,layers);
+    NRReplyWithExplain(ctx,nn,flags,opt.dataset_len,opt.test_len,
+                       opt.cache_size);
+    AnnFree(nn);
+    return REDISMODULE_OK;
+}
+
+/* Implements NR.RUN and NR.CLASS.
+ *
+ * NR.RUN key i0 i1 ... iN
+ * NR.RUN key ROWS <count> i0 i1 ... iN i0 i1 ... iN ... */
 int NRGenericRun_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc, int output_class) {
     RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
-    NRCollectThreads(ctx);
+    NRStatsPhase(NR_PHASE_PARSE);
 
     if (argc < 3) return RedisModule_WrongArity(ctx);
     RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1], REDISMODULE_READ);
@@ -746,68 +3498,345 @@ int NRGenericRun_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int
             "ERR you can't call NR.CLASS with a regressor network. "
             "Use this command with a classifier network");
 
-
+    /* Batch form? */
     int ilen = INPUT_UNITS(nr->nn);
-    if (argc != ilen+2)
+    int first = 2;
+    long long rows = 1;
+    const char *o = RedisModule_StringPtrLen(argv[2],NULL);
+    if (!strcasecmp(o,"rows") && argc > 3) {
+        if (RedisModule_StringToLongLong(argv[3],&rows) != REDISMODULE_OK ||
+            rows < 1 || rows > UINT32_MAX)
+            return RedisModule_ReplyWithError(ctx,
+                "ERR invalid number of rows");
+        first = 4;
+    }
+    if ((long long)argc-first != rows*ilen)
         return RedisModule_ReplyWithError(ctx,
             "ERR number of arguments does not "
             "match the number of inputs in the neural network");
 
-    for(int j = 0; j < ilen; j++) {
+    NRInferenceJob *job = NRInferenceCreateJob(nr,rows,output_class);
+    for(long long j = 0; j < rows*ilen; j++) {
         double input;
-        if (RedisModule_StringToDouble(argv[j+2],&input) != REDISMODULE_OK)
+        if (RedisModule_StringToDouble(argv[first+j],&input) != REDISMODULE_OK) {
+            NRInferenceFreeJob(job);
             return RedisModule_ReplyWithError(ctx,
                 "ERR invalid neural network input: must be a valid float "
                 "precision floating point number");
-        if (nr->flags & NR_FLAG_NORMALIZE) input /= nr->inorm[j];
-        INPUT_NODE(nr->nn,j) = input;
+        }
+        job->inputs[j] = input;
     }
+    NRInferenceExecute(ctx,job,nr);
+    return REDISMODULE_OK;
+}
 
-    AnnSimulate(nr->nn);
+/* NR.RUN key [input1 input2 input3 ... inputN] */
+int NRRun_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return NRGenericRun_RedisCommand(ctx,argv,argc,0);
+}
 
-    /* Output the raw net output or the class ID if the network
-     * is a classifier and the command invoked was NR.CLASS. */
-    int olen = OUTPUT_UNITS(nr->nn);
-    if (output_class) {
-        float max = OUTPUT_NODE(nr->nn,0);
-        int max_class = 0;
-        for(int j = 1; j < olen; j++) {
-            float output = OUTPUT_NODE(nr->nn,j);
-            if (output > max) {
-                max = output;
-                max_class = j;
-            }
+/* NR.CLASS key [input1 input2 input3 ... inputN] */
+int NRClass_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return NRGenericRun_RedisCommand(ctx,argv,argc,1);
+}
+
+/* Return the number of rows of inputs stored at 'key', for a network with
+ * 'ilen' inputs. Hashes hold a single row, with a field for every input
+ * (the field names are given by the caller), while strings hold packed
+ * little endian float32 values, 'ilen' for every row. Returns -1 if the
+ * key can't be used as input. */
+long long NRKeyRows(RedisModuleKey *key, int ilen, int numfields) {
+    int type = RedisModule_KeyType(key);
+    if (type == REDISMODULE_KEYTYPE_HASH) {
+        return (numfields == ilen) ? 1 : -1;
+    } else if (type == REDISMODULE_KEYTYPE_STRING && numfields == 0) {
+        size_t len;
+        RedisModule_StringDMA(key,&len,REDISMODULE_READ);
+        if (len == 0 || len % (sizeof(float)*ilen)) return -1;
+        return len/(sizeof(float)*ilen);
+    }
+    return -1;
+}
+
+/* Read the rows of inputs stored at 'key' (see NRKeyRows()) into 'dst'.
+ * Returns REDISMODULE_ERR if some hash field
+ * is missing or is not a valid number. */
+int NRKeyReadRows(RedisModuleCtx *ctx, RedisModuleKey *key, NRTypeObject *nr, RedisModuleString **fields, float *dst) {
+    int ilen = INPUT_UNITS(nr->nn);
+
+    if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_HASH) {
+        for (int j = 0; j < ilen; j++) {
+            RedisModuleString *value;
+            double input;
+            if (RedisModule_HashGet(key,REDISMODULE_HASH_NONE,fields[j],
+                                    &value,NULL) == REDISMODULE_ERR ||
+                value == NULL) return REDISMODULE_ERR;
+            int retval = RedisModule_StringToDouble(value,&input);
+            RedisModule_FreeString(ctx,value);
+            if (retval != REDISMODULE_OK) return REDISMODULE_ERR;
+            dst[j] = input;
         }
-        RedisModule_ReplyWithLongLong(ctx, max_class);
     } else {
-        RedisModule_ReplyWithArray(ctx,olen);
-        for(int j = 0; j < olen; j++) {
-            float output = OUTPUT_NODE(nr->nn,j);
-            if (!(nr->flags & NR_FLAG_CLASSIFIER) &&
-                 (nr->flags & NR_FLAG_NORMALIZE))
+        size_t len;
+        unsigned char *p =
+            (unsigned char*)RedisModule_StringDMA(key,&len,REDISMODULE_READ);
+        size_t count = len/sizeof(float);
+        for (size_t j = 0; j < count; j++, p += 4) {
+            uint32_t u = (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+                         ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+            float input;
+            memcpy(&input,&u,sizeof(input));
+            dst[j] = input;
+        }
+    }
+    return REDISMODULE_OK;
+}
+
+/* NR.RUNKEY model key [field1 field2 ... fieldN]
+ *
+ * Like NR.RUN, but the inputs are read from the specified key: either the
+ * specified fields of an hash, or the packed float32 values of a string,
+ * in which case a batch of rows can be stored in the same string. */
+int NRRunKey_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+    NRStatsPhase(NR_PHASE_PARSE);
+
+    if (argc < 3) return RedisModule_WrongArity(ctx);
+    RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1], REDISMODULE_READ);
+    if (RedisModule_ModuleTypeGetType(key) != NRType)
+        return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+
+    NRTypeObject *nr = RedisModule_ModuleTypeGetValue(key);
+    int ilen = INPUT_UNITS(nr->nn);
+    RedisModuleKey *src = RedisModule_OpenKey(ctx,argv[2], REDISMODULE_READ);
+    long long rows = NRKeyRows(src,ilen,argc-3);
+    if (rows == -1)
+        return RedisModule_ReplyWithError(ctx,
+            "ERR the key must be an hash, with a field specified for "
+            "every input, or a string of packed float32 inputs");
+
+    NRInferenceJob *job = NRInferenceCreateJob(nr,rows,0);
+    if (NRKeyReadRows(ctx,src,nr,argv+3,job->inputs) == REDISMODULE_ERR) {
+        NRInferenceFreeJob(job);
+        return RedisModule_ReplyWithError(ctx,
+            "ERR missing hash field or invalid neural network input");
+    }
+    NRInferenceExecute(ctx,job,nr);
+    return REDISMODULE_OK;
+}
+
+/* Cursor and key names of a NR.RUNSCAN job, in order to reply when the
+ * job is executed. The strings are retained, and released with the job. */
+typedef struct NRScanJob {
+    RedisModuleString *cursor;
+    RedisModuleString **names;
+    uint32_t count;
+} NRScanJob;
+
+void NRScanJobReply(RedisModuleCtx *ctx, NRInferenceJob *job) {
+    NRScanJob *scan = job->privdata;
+
+    RedisModule_ReplyWithArray(ctx,2);
+    RedisModule_ReplyWithString(ctx,scan->cursor);
+    RedisModule_ReplyWithArray(ctx,job->rows*2);
+    for (uint32_t j = 0; j < job->rows; j++) {
+        RedisModule_ReplyWithString(ctx,scan->names[j]);
+        NRInferenceReplyRow(ctx,job,j);
+    }
+}
+
+void NRScanJobFree(void *privdata) {
+    NRScanJob *scan = privdata;
+
+    RedisModule_FreeString(NULL,scan->cursor);
+    for (uint32_t j = 0; j < scan->count; j++)
+        RedisModule_FreeString(NULL,scan->names[j]);
+    RedisModule_Free(scan->names);
+    RedisModule_Free(scan);
+}
+
+/* Report the keys of NR.RUNSCAN: the model, and the STORE destination. */
+void NRRunScanKeys(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 2) return;
+    RedisModule_KeyAtPos(ctx,1);
+    for (int j = 4; j < argc-1; j++) {
+        const char *o = RedisModule_StringPtrLen(argv[j],NULL);
+        if (!strcasecmp(o,"fields")) break;
+        if (!strcasecmp(o,"store")) RedisModule_KeyAtPos(ctx,j+1);
+        j++; /* Skip the option argument. */
+    }
+}
+
+/* NR.RUNSCAN model cursor pattern [COUNT count] [STORE dest]
+ *            [FIELDS field1 field2 ... fieldN]
+ *
+ * Incrementally run the network against all the keys matching 'pattern',
+ * with the same semantics as SCAN: the reply is a two elements array with
+ * the next cursor, and the outputs of the keys scanned in this call, as
+ * a flat array of key names and outputs. Keys that can't be used as
+ * inputs (see NR.RUNKEY) are skipped.
+ *
+ * With STORE the results are written in the 'dest' hash instead, having
+ * a field for every key name, and the number of keys processed is
+ * returned instead of the outputs. The value is the class ID for
+ * classifiers, otherwise the outputs separated by spaces.
+ *
+ * Big batches are offloaded to the inference threads like NR.RUN ROWS,
+ * but not with STORE: the results must be written to 'dest' by the
+ * command itself, so the batch is always executed in the main thread.
+ *
+ * The keys are the model and 'dest', reported with the getkeys API since
+ * the position of 'dest' is not fixed, so that in a cluster both must be
+ * in the same slot. The scanned keys are not declared: SCAN only returns
+ * the keys of the node executing the command. */
+int NRRunScan_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (RedisModule_IsKeysPositionRequest &&
+        RedisModule_IsKeysPositionRequest(ctx))
+    {
+        NRRunScanKeys(ctx,argv,argc);
+        return REDISMODULE_OK;
+    }
+    RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+    NRCollectThreads(ctx);
+    NRStatsPhase(NR_PHASE_PARSE);
+
+    if (argc < 4) return RedisModule_WrongArity(ctx);
+    RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1], REDISMODULE_READ);
+    if (RedisModule_ModuleTypeGetType(key) != NRType)
+        return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+
+    NRTypeObject *nr = RedisModule_ModuleTypeGetValue(key);
+    int ilen = INPUT_UNITS(nr->nn);
+    int olen = OUTPUT_UNITS(nr->nn);
+    long long count = 100;
+    RedisModuleString *dest = NULL;
+    RedisModuleString **fields = NULL;
+    int numfields = 0;
+
+    for (int j = 4; j < argc; j++) {
+        const char *o = RedisModule_StringPtrLen(argv[j], NULL);
+        int lastarg = (j == argc-1);
+
+        if (!strcasecmp(o,"count") && !lastarg) {
+            if (RedisModule_StringToLongLong(argv[++j],&count) !=
+                REDISMODULE_OK || count < 1)
             {
-                output *= nr->onorm[j];
+                return RedisModule_ReplyWithError(ctx,"ERR invalid count");
+            }
+        } else if (!strcasecmp(o,"store") && !lastarg) {
+            dest = argv[++j];
+        } else if (!strcasecmp(o,"fields")) {
+            fields = argv+j+1;
+            numfields = argc-j-1;
+            break;
+        } else {
+            return RedisModule_ReplyWithError(ctx,
+                "ERR Syntax error in NR.RUNSCAN");
+        }
+    }
+
+    RedisModuleKey *dkey = NULL;
+    if (dest) {
+        dkey = RedisModule_OpenKey(ctx,dest,REDISMODULE_READ|REDISMODULE_WRITE);
+        int type = RedisModule_KeyType(dkey);
+        if (type != REDISMODULE_KEYTYPE_EMPTY &&
+            type != REDISMODULE_KEYTYPE_HASH)
+        {
+            return RedisModule_ReplyWithError(ctx,
+                REDISMODULE_ERRORMSG_WRONGTYPE);
+        }
+    }
+
+    RedisModuleCallReply *reply = RedisModule_Call(ctx,"SCAN","scscl",
+        argv[2],"MATCH",argv[3],"COUNT",count);
+    if (RedisModule_CallReplyType(reply) != REDISMODULE_REPLY_ARRAY)
+        return RedisModule_ReplyWithCallReply(ctx,reply);
+    RedisModuleString *cursor = RedisModule_CreateStringFromCallReply(
+        RedisModule_CallReplyArrayElement(reply,0));
+    RedisModuleCallReply *keys = RedisModule_CallReplyArrayElement(reply,1);
+    size_t numkeys = RedisModule_CallReplyLength(keys);
+
+    /* Collect the keys that can be used as inputs: hashes with the
+     * specified fields, or strings holding exactly one row. */
+    RedisModuleString **names =
+        RedisModule_PoolAlloc(ctx,sizeof(RedisModuleString*)*(numkeys+1));
+    RedisModuleKey **srcs =
+        RedisModule_PoolAlloc(ctx,sizeof(RedisModuleKey*)*(numkeys+1));
+    uint32_t rows = 0;
+    for (size_t j = 0; j < numkeys; j++) {
+        RedisModuleString *name = RedisModule_CreateStringFromCallReply(
+            RedisModule_CallReplyArrayElement(keys,j));
+        RedisModuleKey *src = RedisModule_OpenKey(ctx,name,REDISMODULE_READ);
+        if (NRKeyRows(src,ilen,numfields) != 1) continue;
+        names[rows] = name;
+        srcs[rows] = src;
+        rows++;
+    }
+
+    NRInferenceJob *job = NRInferenceCreateJob(nr,rows,
+        nr->flags & NR_FLAG_CLASSIFIER);
+    uint32_t valid = 0;
+    for (uint32_t j = 0; j < rows; j++) {
+        if (NRKeyReadRows(ctx,srcs[j],nr,fields,job->inputs+(size_t)valid*ilen)
+            == REDISMODULE_ERR) continue;
+        names[valid++] = names[j];
+    }
+    job->rows = valid;
+
+    if (!dest) {
+        NRScanJob *scan = RedisModule_Alloc(sizeof(*scan));
+        scan->cursor = cursor;
+        scan->names = RedisModule_Alloc(sizeof(RedisModuleString*)*(valid+1));
+        scan->count = valid;
+        RedisModule_RetainString(ctx,cursor);
+        for (uint32_t j = 0; j < valid; j++) {
+            scan->names[j] = names[j];
+            RedisModule_RetainString(ctx,names[j]);
+        }
+        job->reply = NRScanJobReply;
+        job->free_privdata = NRScanJobFree;
+        job->privdata = scan;
+        NRInferenceExecute(ctx,job,nr);
+        return REDISMODULE_OK;
+    }
+
+    nr->inference_calls++;
+    nr->inference_rows += valid;
+    NRStatsPhase(NR_PHASE_SIMULATE);
+    if (nr->cache) NRInferenceRunCached(job,nr);
+    else NRInferenceRun(job);
+
+    NRStatsPhase(NR_PHASE_REPLY);
+    RedisModule_ReplyWithArray(ctx,2);
+    RedisModule_ReplyWithString(ctx,cursor);
+    for (uint32_t j = 0; j < valid; j++) {
+        RedisModuleString *value;
+        if (job->output_class) {
+            value = RedisModule_CreateStringFromLongLong(ctx,
+                NRInferenceClass(job,j));
+        } else {
+            value = RedisModule_CreateString(ctx,"",0);
+            for (int k = 0; k < olen; k++) {
+                char buf[64];
+                float output = job->outputs[(size_t)j*olen+k];
+                int len = snprintf(buf,sizeof(buf),"%s%.17g",
+                                   k ? " " : "",output);
+                RedisModule_StringAppendBuffer(ctx,value,buf,len);
             }
-            RedisModule_ReplyWithDouble(ctx, output);
         }
+        RedisModule_HashSet(dkey,REDISMODULE_HASH_NONE,names[j],value,NULL);
+        RedisModule_Replicate(ctx,"HSET","sss",dest,names[j],value);
     }
+    RedisModule_ReplyWithLongLong(ctx,valid);
+    NRInferenceFreeJob(job);
     return REDISMODULE_OK;
 }
 
-/* NR.RUN key [input1 input2 input3 ... inputN] */
-int NRRun_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    return NRGenericRun_RedisCommand(ctx,argv,argc,0);
-}
-
-/* NR.CLASS key [input1 input2 input3 ... inputN] */
-int NRClass_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    return NRGenericRun_RedisCommand(ctx,argv,argc,1);
-}
-
 /* NR.OBSERVE key input1 [input2 input3 ... inputN] -> output [TRAIN|TEST] */
 int NRObserve_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
     NRCollectThreads(ctx);
+    NRStatsPhase(NR_PHASE_PARSE);
 
     if (argc < 3) return RedisModule_WrongArity(ctx);
     RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],
@@ -876,17 +3905,34 @@ int NRObserve_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int ar
         }
     }
 
-    NRTypeInsertData(nr,inputs,outputs,target);
+    NRStatsPhase(NR_PHASE_OTHER);
+    uint32_t pos;
+    NRDataset *ds = NRTypeInsertData(nr,inputs,outputs,target,&pos);
     RedisModule_Free(inputs);
     RedisModule_Free(outputs);
 
+    /* The row replaced when the dataset is full is picked at random, so
+     * propagate the write itself instead of the command: replicas and AOF
+     * get the same datasets whatever their PRNG state is. */
+    if (ds) {
+        NRCodecBuf b = {NULL,0,0};
+        NRDatasetEncodeBlock(&b,ds,ilen,olen,pos,1);
+        RedisModule_Replicate(ctx,"NR.LOADDATA","sclbcl",argv[1],
+            ds == &nr->dataset ? "TRAIN" : "TEST",1LL,(char*)b.p,b.len,
+            "AT",(long long)pos);
+        RedisModule_Free(b.p);
+    }
+
+    NRStatsPhase(NR_PHASE_REPLY);
     RedisModule_ReplyWithArray(ctx,2);
     RedisModule_ReplyWithLongLong(ctx, nr->dataset.len);
     RedisModule_ReplyWithLongLong(ctx, nr->test.len);
     return REDISMODULE_OK;
 }
 
-/* NR.TRAIN key [MAXCYCLES <count>] [MAXTIME <count>] [AUTOSTOP] */
+/* NR.TRAIN key [MAXCYCLES <count>] [MAXTIME <count>] [AUTOSTOP] [BACKTRACK]
+ *             [TESTSAMPLE <count>] [PRIORITY <0-9>]
+ * NR.TRAIN key STOP|PAUSE|RESUME */
 int NRTrain_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
     NRCollectThreads(ctx);
@@ -898,13 +3944,41 @@ int NRTrain_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc
         return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
 
     NRTypeObject *nr = RedisModule_ModuleTypeGetValue(key);
+
+    /* NR.TRAIN key STOP|PAUSE|RESUME controls an already running
+     * training instead of starting a new one. */
+    if (argc == 3) {
+        const char *o = RedisModule_StringPtrLen(argv[2], NULL);
+        int stop = !strcasecmp(o,"stop");
+        int pause = !strcasecmp(o,"pause");
+        int resume = !strcasecmp(o,"resume");
+        if (stop || pause || resume) {
+            pthread_mutex_lock(&NRPendingTrainingMutex);
+            NRPendingTraining *pt = NRLookupTraining(nr->id);
+            if (pt) {
+                if (stop && pt->stop == NR_STOP_NONE)
+                    pt->stop = NR_STOP_REQUESTED;
+                pt->paused = pause;
+                pthread_cond_broadcast(&NRPendingTrainingCond);
+            }
+            pthread_mutex_unlock(&NRPendingTrainingMutex);
+            if (pt == NULL)
+                return RedisModule_ReplyWithError(ctx,
+                    "ERR no training in progress for this neural network");
+            return RedisModule_ReplyWithSimpleString(ctx,"OK");
+        }
+    }
+
     if (nr->flags & NR_FLAG_TRAINING)
         return RedisModule_ReplyWithError(ctx,
             "ERR neural network training already in progress");
 
     nr->training_max_cycles = 0;
     nr->training_max_ms = 10000;
-    nr->flags &= ~(NR_FLAG_AUTO_STOP|NR_FLAG_BACKTRACK);
+    nr->training_test_sample = 0;
+    nr->training_priority = NR_SCHED_DEFAULT_PRIORITY;
+    nr->flags &= ~(NR_FLAG_AUTO_STOP|NR_FLAG_BACKTRACK|NR_FLAG_TRAIN_SEED|
+                   NR_FLAG_PROFILE);
 
     for (int j = 2; j < argc; j++) {
         const char *o = RedisModule_StringPtrLen(argv[j], NULL);
@@ -927,6 +4001,30 @@ int NRTrain_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc
                     "ERR invalid number of milliseconds of time");
             }
             nr->training_max_ms = v;
+        } else if (!strcasecmp(o,"testsample") && !lastarg) {
+            if (RedisModule_StringToLongLong(argv[++j],&v) != REDISMODULE_OK ||
+                v < 0 || v > UINT32_MAX)
+            {
+                return RedisModule_ReplyWithError(ctx,
+                    "ERR invalid number of test samples");
+            }
+            nr->training_test_sample = v;
+        } else if (!strcasecmp(o,"priority") && !lastarg) {
+            if (RedisModule_StringToLongLong(argv[++j],&v) != REDISMODULE_OK ||
+                v < 0 || v > NR_SCHED_MAX_PRIORITY)
+            {
+                return RedisModule_ReplyWithError(ctx,
+                    "ERR invalid priority: must be between 0 and 9");
+            }
+            nr->training_priority = v;
+        } else if (!strcasecmp(o,"seed") && !lastarg) {
+            if (RedisModule_StringToLongLong(argv[++j],&v) != REDISMODULE_OK) {
+                return RedisModule_ReplyWithError(ctx,"ERR invalid seed");
+            }
+            nr->training_seed = v;
+            nr->flags |= NR_FLAG_TRAIN_SEED;
+        } else if (!strcasecmp(o,"profile")) {
+            nr->flags |= NR_FLAG_PROFILE;
         } else {
             return RedisModule_ReplyWithError(ctx,
                 "ERR Syntax error in NR.TRAIN");
@@ -941,8 +4039,28 @@ int NRTrain_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc
             "overfitting detection requires a non zero length testing dataset");
     }
 
-    if (NRStartTraining(ctx,argv[1],RedisModule_GetSelectedDb(ctx),nr) ==
-        REDISMODULE_ERR)
+    /* The training copies the network and the datasets: refuse to start
+     * it if the memory budget of the trainings would be exceeded. */
+    int auto_stop = nr->flags & NR_FLAG_AUTO_STOP;
+    size_t memory = NRTrainingMemoryEstimate(nr->nn,
+        nr->dataset.len, nr->test.len, auto_stop,
+        nr->flags & NR_FLAG_BACKTRACK,
+        nr->training_test_sample < nr->test.len ?
+        nr->training_test_sample : 0);
+    if (NRConfig.training_memory_budget) {
+        size_t reserved = NRTrainingMemoryReserved();
+        if (reserved+memory > (size_t)NRConfig.training_memory_budget) {
+            char buf[256];
+            NRTrainingBudgetRejections++;
+            snprintf(buf,sizeof(buf),"ERR training memory budget exceeded: "
+                "the training needs %zu bytes, %zu of %lld are in use",
+                memory, reserved, NRConfig.training_memory_budget);
+            return RedisModule_ReplyWithError(ctx,buf);
+        }
+    }
+
+    if (NRStartTraining(ctx,argv[1],RedisModule_GetSelectedDb(ctx),nr,
+                        memory) == REDISMODULE_ERR)
     {
         return RedisModule_ReplyWithError(ctx,
             "ERR Can't train the neural network: "
@@ -965,9 +4083,12 @@ int NRReset_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc
 
     NRTypeObject *nr = RedisModule_ModuleTypeGetValue(key);
 
-    /* Change the ID so that if there is a training in progress it will
-     * not update the weights of this network. */
+    /* Stop the training in progress if any, and change the ID so that
+     * even if the training thread already terminated, its result will not
+     * update the weights of this network. */
+    NRCancelTrainings(nr->id);
     nr->id = NRNextId++;
+    nr->flags &= ~NR_FLAG_TRAINING;
 
     /* Reset training stats. */
     nr->training_total_steps = 0;
@@ -981,16 +4102,426 @@ int NRReset_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc
     /* Set random weights in the neural network, which is
      * "untrain" the network. */
     AnnSetRandomWeights(nr->nn);
+    nr->weights_version++;
+
+    NRReplicateNet(ctx,argv[1],nr);
+    return RedisModule_ReplyWithSimpleString(ctx,"OK");
+}
+
+/* NR.SETWEIGHTS key serialized-network
+ *
+ * Set the weights, normalization vectors and training stats of the network
+ * to the ones serialized in the payload, creating the network if the key
+ * is empty. This is how trained networks are propagated to replicas and
+ * AOF, see NRReplicateNet(). */
+int NRSetWeights_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+    NRCollectThreads(ctx);
+
+    if (argc != 3) return RedisModule_WrongArity(ctx);
+    RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],
+        REDISMODULE_READ|REDISMODULE_WRITE);
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY &&
+        RedisModule_ModuleTypeGetType(key) != NRType)
+    {
+        return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    size_t len;
+    const char *err;
+    unsigned char *blob = (unsigned char*)RedisModule_StringPtrLen(argv[2],&len);
+    NRCodecReader r = {blob, blob+len, 0};
+    NRTypeObject *src = NRDeserializeNet(&r,&err);
+    if (src == NULL) return RedisModule_ReplyWithError(ctx,err);
+    if (r.p != r.end) {
+        NRTypeReleaseObject(src);
+        return RedisModule_ReplyWithError(ctx,
+            "ERR invalid neural network serialization format");
+    }
+
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        RedisModule_ModuleTypeSetValue(key,NRType,src);
+    } else {
+        NRTypeObject *nr = RedisModule_ModuleTypeGetValue(key);
+        int same = LAYERS(nr->nn) == LAYERS(src->nn);
+        for (int j = 0; same && j < LAYERS(nr->nn); j++)
+            same = UNITS(nr->nn,j) == UNITS(src->nn,j);
+        if (!same) {
+            NRTypeReleaseObject(src);
+            return RedisModule_ReplyWithError(ctx,
+                "ERR the neural network layout does not match");
+        }
+
+        /* Like NR.RESET, make sure a training in progress will not
+         * overwrite the new weights. */
+        NRCancelTrainings(nr->id);
+        nr->id = NRNextId++;
+        nr->flags &= ~(NR_FLAG_TRAINING|NR_FLAG_TO_PRESIST);
+        nr->flags |= src->flags & NR_FLAG_TO_PRESIST;
+
+        struct Ann *tmp = nr->nn;
+        nr->nn = src->nn;
+        src->nn = tmp;
+        nr->weights_version++;
+        nr->training_total_steps = src->training_total_steps;
+        nr->training_total_ms = src->training_total_ms;
+        nr->training_max_cycles = src->training_max_cycles;
+        nr->training_max_ms = src->training_max_ms;
+        nr->dataset_error = src->dataset_error;
+        nr->test_error = src->test_error;
+        nr->test_class_error = src->test_class_error;
+        int ilen = INPUT_UNITS(nr->nn);
+        int olen = OUTPUT_UNITS(nr->nn);
+        memcpy(nr->ishift,src->ishift,sizeof(float)*ilen);
+        memcpy(nr->inorm,src->inorm,sizeof(float)*ilen);
+        memcpy(nr->onorm,src->onorm,sizeof(float)*olen);
+        NRTypeReleaseObject(src);
+    }
 
+    RedisModule_ReplicateVerbatim(ctx);
     return RedisModule_ReplyWithSimpleString(ctx,"OK");
 }
 
+/* NR.LOADDATA key TRAIN|TEST rows encoded-rows [AT <index>]
+ *
+ * Append 'rows' rows, encoded as a dataset block (see the "Dataset
+ * encoding" section), to the training or testing dataset. Used by the AOF
+ * rewrite in order to load big datasets with a few commands. With AT the
+ * rows are written starting at 'index', overwriting the existing ones:
+ * this is how NR.OBSERVE is propagated. */
+int NRLoadData_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+    NRCollectThreads(ctx);
+
+    if (argc != 5 && argc != 7) return RedisModule_WrongArity(ctx);
+    RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],
+        REDISMODULE_READ|REDISMODULE_WRITE);
+    if (RedisModule_ModuleTypeGetType(key) != NRType)
+        return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+
+    NRTypeObject *nr = RedisModule_ModuleTypeGetValue(key);
+    NRDataset *ds;
+    const char *target = RedisModule_StringPtrLen(argv[2],NULL);
+    if (!strcasecmp(target,"train")) {
+        ds = &nr->dataset;
+    } else if (!strcasecmp(target,"test")) {
+        ds = &nr->test;
+    } else {
+        return RedisModule_ReplyWithError(ctx,
+            "ERR the dataset must be TRAIN or TEST");
+    }
+
+    long long first = ds->len;
+    if (argc == 7) {
+        if (strcasecmp(RedisModule_StringPtrLen(argv[5],NULL),"at"))
+            return RedisModule_ReplyWithError(ctx,
+                "ERR Syntax error in NR.LOADDATA");
+        if (RedisModule_StringToLongLong(argv[6],&first) != REDISMODULE_OK ||
+            first < 0 || first > ds->len)
+        {
+            return RedisModule_ReplyWithError(ctx,
+                "ERR invalid dataset index");
+        }
+    }
+
+    long long rows;
+    if (RedisModule_StringToLongLong(argv[3],&rows) != REDISMODULE_OK ||
+        rows <= 0 || rows > ds->maxlen - first)
+    {
+        return RedisModule_ReplyWithError(ctx,
+            "ERR invalid number of rows, or not enough room in the dataset");
+    }
+
+    uint32_t ilen = INPUT_UNITS(nr->nn);
+    uint32_t olen = OUTPUT_UNITS(nr->nn);
+    uint32_t last = first+rows;
+    NRDatasetReserve(ds,last,ilen,olen);
+
+    /* Decode into a scratch dataset first, so that a malformed block
+     * leaves the rows we are going to overwrite untouched. */
+    size_t len;
+    unsigned char *block = (unsigned char*)RedisModule_StringPtrLen(argv[4],&len);
+    NRCodecReader r = {block, block+len, 0};
+    NRDataset tmp = {0};
+    tmp.inputs = RedisModule_Alloc(sizeof(float)*ilen*rows);
+    tmp.outputs = RedisModule_Alloc(sizeof(float)*olen*rows);
+    int err = NRDatasetDecodeBlock(&r,&tmp,ilen,olen,0,rows);
+    for (uint32_t j = first; err == REDISMODULE_OK && j < last; j++) {
+        float *in = ds->inputs+(size_t)j*ilen, *out = ds->outputs+(size_t)j*olen;
+        if (ds == &nr->dataset && j < ds->len)
+            NRStatsRemove(&nr->stats,in,ilen);
+        memcpy(in,tmp.inputs+(size_t)(j-first)*ilen,sizeof(float)*ilen);
+        memcpy(out,tmp.outputs+(size_t)(j-first)*olen,sizeof(float)*olen);
+        if (ds == &nr->dataset) NRStatsAdd(&nr->stats,in,out,ilen,olen);
+    }
+    RedisModule_Free(tmp.inputs);
+    RedisModule_Free(tmp.outputs);
+    if (err != REDISMODULE_OK)
+        return RedisModule_ReplyWithError(ctx,"ERR malformed dataset rows");
+    if (last > ds->len) ds->len = last;
+
+    RedisModule_ReplicateVerbatim(ctx);
+    return RedisModule_ReplyWithLongLong(ctx,ds->len);
+}
+
+/* NR.EXPORT key [WEIGHTS-ONLY]
+ *
+ * Return a self contained, checksummed blob with the layout, weights,
+ * normalization vectors and training state of the network, that can be
+ * loaded into another key or server with NR.IMPORT. Datasets are not
+ * included. With WEIGHTS-ONLY the RPROP state is omitted as well, which
+ * makes the blob about three times smaller. */
+int NRExport_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    uint32_t contents = 0;
+    RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+    if (argc != 2 && argc != 3) return RedisModule_WrongArity(ctx);
+    if (argc == 3) {
+        const char *o = RedisModule_StringPtrLen(argv[2],NULL);
+        if (strcasecmp(o,"weights-only"))
+            return RedisModule_ReplyWithError(ctx,
+                "ERR Syntax error in NR.EXPORT");
+        contents |= NR_NET_BLOB_WEIGHTS_ONLY;
+    }
+    RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1], REDISMODULE_READ);
+    if (RedisModule_ModuleTypeGetType(key) != NRType)
+        return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+
+    NRTypeObject *nr = RedisModule_ModuleTypeGetValue(key);
+    NRCodecBuf b = {NULL,0,0};
+    NRExportNet(&b,nr,contents);
+    RedisModule_ReplyWithStringBuffer(ctx,(char*)b.p,b.len);
+    RedisModule_Free(b.p);
+    return REDISMODULE_OK;
+}
+
+/* Create a network with the given layout, and set its weights from 'raw',
+ * a buffer of little endian float32 values: for every layer of weights,
+ * from the input to the output layer, an outputs x (inputs+1) row major
+ * matrix, with the bias weight as last column. This is the layout most
+ * frameworks can trivially dump. On error NULL is returned and '*err' is
+ * set. */
+NRTypeObject *NRImportRaw(int flags, int *layers, int num_layers,
+                          unsigned char *raw, size_t len, const char **err)
+{
+    size_t count = 0;
+    for (int l = 1; l < num_layers; l++) {
+        if (!NRAddWeights(&count,(size_t)layers[l]+1,layers[l-1])) {
+            *err = "ERR the network layout has too many weights";
+            return NULL;
+        }
+    }
+    if (len != count*sizeof(float)) {
+        *err = "ERR the weights size does not match the network layout";
+        return NULL;
+    }
+
+    NRTypeObject *nr = createNRTypeObject(flags,layers,num_layers,0,0);
+    struct Ann *nn = nr->nn;
+    NRCodecReader r = {raw, raw+len, 0};
+    for (int l = LAYERS(nn)-1; l > 0; l--) {
+        int outputs = UNITS(nn,l-1) - (l-1 != 0); /* Skip the bias unit. */
+        for (int j = 0; j < outputs; j++) {
+            for (int i = 0; i < UNITS(nn,l); i++)
+                WEIGHT(nn,l,i,j) = NRCodecGetFloat(&r);
+        }
+    }
+    return nr;
+}
+
+/* NR.IMPORT key <export-blob> [REPLACE]
+ * NR.IMPORT key RAW <type> <inputs> [<hidden> ...] -> <outputs> <weights>
+ *           [REPLACE]
+ *
+ * Create a network from a blob returned by NR.EXPORT, or from raw float32
+ * weights, see NRImportRaw(). Unless REPLACE is given the key must be
+ * empty. */
+int NRImport_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    int replace = 0;
+    const char *err;
+    NRTypeObject *nr;
+    RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+    NRCollectThreads(ctx);
+
+    if (argc < 3) return RedisModule_WrongArity(ctx);
+    if (!strcasecmp(RedisModule_StringPtrLen(argv[argc-1],NULL),"replace")) {
+        replace = 1;
+        argc--;
+    }
+
+    size_t len;
+    const char *arg = RedisModule_StringPtrLen(argv[2],NULL);
+    if (!strcasecmp(arg,"raw")) {
+        int layers[NR_MAX_LAYERS], num_layers, flags = NR_FLAG_NONE;
+        int j = 3;
+        if (NRParseLayout(argv,argc,&j,&flags,layers,&num_layers,&err)
+            != REDISMODULE_OK) return RedisModule_ReplyWithError(ctx,err);
+        if (j != argc-1)
+            return RedisModule_ReplyWithError(ctx,
+                "ERR Syntax error in NR.IMPORT");
+        unsigned char *raw =
+            (unsigned char*)RedisModule_StringPtrLen(argv[j],&len);
+        nr = NRImportRaw(flags,layers,num_layers,raw,len,&err);
+    } else {
+        if (argc != 3) return RedisModule_WrongArity(ctx);
+        unsigned char *blob =
+            (unsigned char*)RedisModule_StringPtrLen(argv[2],&len);
+        nr = NRImportNet(blob,len,&err);
+    }
+    if (nr == NULL) return RedisModule_ReplyWithError(ctx,err);
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],
+        REDISMODULE_READ|REDISMODULE_WRITE);
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY) {
+        if (!replace) {
+            NRTypeReleaseObject(nr);
+            return RedisModule_ReplyWithError(ctx,"ERR the key name is busy");
+        }
+        /* Make sure a training of the old network will not be collected
+         * into the new one. */
+        if (RedisModule_ModuleTypeGetType(key) == NRType) {
+            NRTypeObject *old = RedisModule_ModuleTypeGetValue(key);
+            NRCancelTrainings(old->id);
+        }
+        RedisModule_DeleteKey(key);
+    }
+    RedisModule_ModuleTypeSetValue(key,NRType,nr);
+
+    RedisModule_ReplicateVerbatim(ctx);
+    return RedisModule_ReplyWithLongLong(ctx,AnnCountWeights(nr->nn));
+}
+
+/* Reply with the hardware counters of the training phases: null if they
+ * were not requested, a string with the reason if they are not available,
+ * otherwise the counters of every phase as field/value pairs. The FLOPs
+ * are estimated from the network size, see ANN_FLOPS_FORWARD and so
+ * forth, and the update has no FLOPs estimate. Counters the CPU does not
+ * support are reported as null. */
+void NRReplyWithPerfProfile(RedisModuleCtx *ctx, NRPerfProfile *perf) {
+    static const char *names[ANN_PHASES] = {
+        "forward", "backward", "accumulate", "update"
+    };
+    static const int flops[ANN_PHASES] = {
+        ANN_FLOPS_FORWARD, ANN_FLOPS_BACKWARD, ANN_FLOPS_ACCUMULATE, 0
+    };
+    char buf[128];
+
+    if (perf->status == NR_PERF_OFF) {
+        RedisModule_ReplyWithNull(ctx);
+        return;
+    } else if (perf->status == NR_PERF_UNAVAILABLE) {
+        snprintf(buf,sizeof(buf),"unavailable: %s",strerror(perf->err));
+        RedisModule_ReplyWithSimpleString(ctx,buf);
+        return;
+    }
+
+    RedisModule_ReplyWithArray(ctx,(1+ANN_PHASES)*2);
+    RedisModule_ReplyWithSimpleString(ctx,"running-perc");
+    RedisModule_ReplyWithDouble(ctx,perf->enabled_ns ?
+        (double)perf->running_ns*100/perf->enabled_ns : 0);
+    for (int j = 0; j < ANN_PHASES; j++) {
+        uint64_t *c = perf->phase[j].count;
+        uint32_t av = perf->available;
+        uint64_t cycles = c[NR_PERF_CYCLES], ins = c[NR_PERF_INSTRUCTIONS];
+        int has_ins = av & (1<<NR_PERF_INSTRUCTIONS);
+        int has_llc = av & (1<<NR_PERF_LLC_MISSES);
+        int has_l1d = av & (1<<NR_PERF_L1D_MISSES);
+        struct {
+            const char *name;
+            int valid;          /* Reply with null if false. */
+            int integer;        /* Reply with an integer, not a double. */
+            double value;
+        } fields[] = {
+            {"cycles", 1, 1, cycles},
+            {"instructions", has_ins, 1, ins},
+            {"llc-misses", has_llc, 1, c[NR_PERF_LLC_MISSES]},
+            {"l1d-misses", has_l1d, 1, c[NR_PERF_L1D_MISSES]},
+            {"ipc", has_ins && cycles, 0, (double)ins/cycles},
+            {"llc-mpki", has_llc && ins, 0,
+                (double)c[NR_PERF_LLC_MISSES]*1000/ins},
+            {"l1d-mpki", has_l1d && ins, 0,
+                (double)c[NR_PERF_L1D_MISSES]*1000/ins},
+            {"flops-per-cycle", flops[j] && cycles, 0,
+                (double)flops[j]*perf->weights*perf->phase[j].measured/cycles}
+        };
+        int numfields = sizeof(fields)/sizeof(fields[0]);
+
+        RedisModule_ReplyWithSimpleString(ctx,names[j]);
+        RedisModule_ReplyWithArray(ctx,(1+numfields)*2);
+        RedisModule_ReplyWithSimpleString(ctx,"measured");
+        RedisModule_ReplyWithLongLong(ctx,perf->phase[j].measured);
+        for (int i = 0; i < numfields; i++) {
+            RedisModule_ReplyWithSimpleString(ctx,fields[i].name);
+            if (!fields[i].valid)
+                RedisModule_ReplyWithNull(ctx);
+            else if (fields[i].integer)
+                RedisModule_ReplyWithLongLong(ctx,fields[i].value);
+            else
+                RedisModule_ReplyWithDouble(ctx,fields[i].value);
+        }
+    }
+}
+
+/* Reply with the training profile 'prof', as an array of field/value
+ * pairs. Times are reported in milliseconds. */
+void NRReplyWithTrainingProfile(RedisModuleCtx *ctx, NRTrainingProfile *prof) {
+    struct {
+        const char *name;
+        uint64_t ns;
+    } phases[] = {
+        {"forward-ms", prof->net.forward_ns},
+        {"backward-ms", prof->net.backward_ns},
+        {"accumulate-ms", prof->net.accumulate_ns},
+        {"update-ms", prof->net.update_ns},
+        {"validation-ms", prof->validation_ns},
+        {"validation-wait-ms", prof->validation_wait_ns},
+        {"normalization-ms", prof->normalization_ns},
+        {"clone-ms", prof->clone_ns},
+        {"transfer-ms", prof->transfer_ns}
+    };
+    int numphases = sizeof(phases)/sizeof(phases[0]);
+
+    RedisModule_ReplyWithArray(ctx,(7+numphases)*2);
+    RedisModule_ReplyWithSimpleString(ctx,"samples");
+    RedisModule_ReplyWithLongLong(ctx,prof->samples);
+    RedisModule_ReplyWithSimpleString(ctx,"cycles");
+    RedisModule_ReplyWithLongLong(ctx,prof->cycles);
+    RedisModule_ReplyWithSimpleString(ctx,"wall-ms");
+    RedisModule_ReplyWithLongLong(ctx,prof->wall_ms);
+    RedisModule_ReplyWithSimpleString(ctx,"samples-per-sec");
+    RedisModule_ReplyWithDouble(ctx,prof->wall_ms ?
+        (double)prof->samples*1000/prof->wall_ms : 0);
+    for (int j = 0; j < numphases; j++) {
+        RedisModule_ReplyWithSimpleString(ctx,phases[j].name);
+        RedisModule_ReplyWithDouble(ctx,(double)phases[j].ns/1000000);
+    }
+    RedisModule_ReplyWithSimpleString(ctx,"peak-memory");
+    RedisModule_ReplyWithLongLong(ctx,prof->peak_memory);
+    RedisModule_ReplyWithSimpleString(ctx,"counters");
+    NRReplyWithPerfProfile(ctx,&prof->perf);
+
+    /* The errors of the last cycles, oldest first, as
+     * [cycle, train error, test error] triplets. */
+    uint32_t len = prof->history_len < NR_ERROR_HISTORY ?
+                   prof->history_len : NR_ERROR_HISTORY;
+    RedisModule_ReplyWithSimpleString(ctx,"error-history");
+    RedisModule_ReplyWithArray(ctx,len);
+    for (uint32_t j = prof->history_len-len; j < prof->history_len; j++) {
+        int idx = j % NR_ERROR_HISTORY;
+        RedisModule_ReplyWithArray(ctx,3);
+        RedisModule_ReplyWithLongLong(ctx,prof->history[idx].cycle);
+        RedisModule_ReplyWithDouble(ctx,prof->history[idx].train_error);
+        RedisModule_ReplyWithDouble(ctx,prof->history[idx].test_error);
+    }
+}
+
 /* NR.INFO key */
 int NRInfo_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     char buf[128];
 
     RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
-    NRCollectThreads(ctx);
 
     if (argc != 2) return RedisModule_WrongArity(ctx);
     RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1], REDISMODULE_READ);
@@ -999,8 +4530,9 @@ int NRInfo_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 
     NRTypeObject *nr = RedisModule_ModuleTypeGetValue(key);
 
-    int fields = 15;
+    int fields = 21;
     if (nr->flags & NR_FLAG_CLASSIFIER) fields++;
+    if (nr->cache) fields += 3;
     RedisModule_ReplyWithArray(ctx,fields*2);
 
     RedisModule_ReplyWithSimpleString(ctx,"id");
@@ -1067,10 +4599,44 @@ int NRInfo_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
     RedisModule_ReplyWithSimpleString(ctx,"overfitting-detected");
     RedisModule_ReplyWithSimpleString(ctx, (nr->flags & NR_FLAG_OF_DETECTED) ? "yes" : "no");
 
+    RedisModule_ReplyWithSimpleString(ctx,"inference-calls");
+    RedisModule_ReplyWithLongLong(ctx,nr->inference_calls);
+
+    RedisModule_ReplyWithSimpleString(ctx,"inference-rows");
+    RedisModule_ReplyWithLongLong(ctx,nr->inference_rows);
+
+    RedisModule_ReplyWithSimpleString(ctx,"memory-usage");
+    RedisModule_ReplyWithLongLong(ctx,NRTypeMemoryUsage(nr));
+
+    RedisModule_ReplyWithSimpleString(ctx,"memory-readmostly");
+    RedisModule_ReplyWithLongLong(ctx,NRTypeReadMostlyMemoryUsage(nr));
+
+    RedisModule_ReplyWithSimpleString(ctx,"memory-cow-exposed");
+    RedisModule_ReplyWithLongLong(ctx,NRTypeCowExposedMemoryUsage(nr));
+
+    RedisModule_ReplyWithSimpleString(ctx,"last-training");
+    if (nr->training_profile)
+        NRReplyWithTrainingProfile(ctx,nr->training_profile);
+    else
+        RedisModule_ReplyWithNull(ctx);
+
+    if (nr->cache) {
+        RedisModule_ReplyWithSimpleString(ctx,"cache-size");
+        RedisModule_ReplyWithLongLong(ctx,nr->cache->size);
+        RedisModule_ReplyWithSimpleString(ctx,"cache-hits");
+        RedisModule_ReplyWithLongLong(ctx,nr->cache->hits);
+        RedisModule_ReplyWithSimpleString(ctx,"cache-misses");
+        RedisModule_ReplyWithLongLong(ctx,nr->cache->misses);
+    }
+
     return REDISMODULE_OK;
 }
 
-/* NR.THREADS */
+/* NR.THREADS
+ *
+ * Collect the terminated trainings, then reply with an array with an entry
+ * for every training thread, every entry being an array of field/value
+ * pairs. */
 int NRThreads_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
     NRCollectThreads(ctx);
@@ -1081,28 +4647,170 @@ int NRThreads_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int ar
     pthread_mutex_lock(&NRPendingTrainingMutex);
     RedisModule_ReplyWithArray(ctx,NRPendingTrainingCount);
     for (int j = 0; j < NRPendingTrainingCount; j++) {
-        char buf[1024];
-        NRPendingTraining *pt = &NRTrainings[j];
-        const char *keyname = RedisModule_StringPtrLen(pt->key,NULL);
-        snprintf(buf,sizeof(buf),"nn_id=%llu cycle=%d key=%s db=%d maxtime=%llu maxcycles=%llu trainerr=%f testerr=%f classerr=%f",
-            (unsigned long long)pt->nr->id,
-            pt->curcycle,
-            keyname, pt->db_id,
-            (unsigned long long)pt->nr->training_max_ms,
-            (unsigned long long)pt->nr->training_max_cycles,
-            pt->dataset_error,
-            pt->test_error,
-            pt->class_error);
-        RedisModule_ReplyWithSimpleString(ctx,buf);
+        NRPendingTraining *pt = NRTrainings[j];
+        const char *state = "running";
+        if (!pt->in_progress) state = "done";
+        else if (pt->stop != NR_STOP_NONE) state = "stopping";
+        else if (pt->paused) state = "paused";
+        else if (!pt->sched_running) state = "queued";
+
+        RedisModule_ReplyWithArray(ctx,14*2);
+        RedisModule_ReplyWithSimpleString(ctx,"nn-id");
+        RedisModule_ReplyWithLongLong(ctx,pt->nr->id);
+        RedisModule_ReplyWithSimpleString(ctx,"cycle");
+        RedisModule_ReplyWithLongLong(ctx,pt->curcycle);
+        RedisModule_ReplyWithSimpleString(ctx,"key");
+        RedisModule_ReplyWithString(ctx,pt->key);
+        RedisModule_ReplyWithSimpleString(ctx,"db");
+        RedisModule_ReplyWithLongLong(ctx,pt->db_id);
+        RedisModule_ReplyWithSimpleString(ctx,"state");
+        RedisModule_ReplyWithSimpleString(ctx,state);
+        RedisModule_ReplyWithSimpleString(ctx,"priority");
+        RedisModule_ReplyWithLongLong(ctx,pt->priority);
+        RedisModule_ReplyWithSimpleString(ctx,"nice");
+        RedisModule_ReplyWithLongLong(ctx,NR_SCHED_NICE(pt->priority));
+        RedisModule_ReplyWithSimpleString(ctx,"cpus");
+        RedisModule_ReplyWithSimpleString(ctx,NRTrainingCpusList);
+        RedisModule_ReplyWithSimpleString(ctx,"maxtime");
+        RedisModule_ReplyWithLongLong(ctx,pt->nr->training_max_ms);
+        RedisModule_ReplyWithSimpleString(ctx,"maxcycles");
+        RedisModule_ReplyWithLongLong(ctx,pt->nr->training_max_cycles);
+        RedisModule_ReplyWithSimpleString(ctx,"dataset-error");
+        RedisModule_ReplyWithDouble(ctx,pt->dataset_error);
+        RedisModule_ReplyWithSimpleString(ctx,"test-error");
+        RedisModule_ReplyWithDouble(ctx,pt->test_error);
+        RedisModule_ReplyWithSimpleString(ctx,"classification-errors-perc");
+        RedisModule_ReplyWithDouble(ctx,pt->class_error);
+        RedisModule_ReplyWithSimpleString(ctx,"profile");
+        NRReplyWithTrainingProfile(ctx,&pt->profile);
     }
     pthread_mutex_unlock(&NRPendingTrainingMutex);
     return REDISMODULE_OK;
 }
 
+/* Append to 'b' an INFO style line with the statistics of the histogram,
+ * in microseconds. */
+void NRStatsAppendHistogram(NRCodecBuf *b, const char *name, const char *suffix, NRHistogram *h) {
+    char buf[512];
+    int len = snprintf(buf,sizeof(buf),
+        "%s%s:calls=%llu,usec=%llu,usec_per_call=%.3f,"
+        "p50=%.3f,p90=%.3f,p99=%.3f,p99.9=%.3f,max=%.3f\r\n",
+        name, suffix,
+        (unsigned long long)h->count,
+        (unsigned long long)(h->sum/1000),
+        (double)h->sum/h->count/1000,
+        (double)NRHistogramPercentile(h,50)/1000,
+        (double)NRHistogramPercentile(h,90)/1000,
+        (double)NRHistogramPercentile(h,99)/1000,
+        (double)NRHistogramPercentile(h,99.9)/1000,
+        (double)h->max/1000);
+    NRCodecPut(b,buf,len);
+}
+
+/* NR.STATS [RESET]
+ *
+ * Reply with the statistics of the commands called since the module was
+ * loaded, or since the last NR.STATS RESET, in the same format as the
+ * INFO command sections. */
+int NRStats_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+    if (argc > 2) return RedisModule_WrongArity(ctx);
+    if (argc == 2) {
+        if (strcasecmp(RedisModule_StringPtrLen(argv[1],NULL),"reset"))
+            return RedisModule_ReplyWithError(ctx,
+                "ERR Syntax error in NR.STATS");
+        NRStatsReset();
+        return RedisModule_ReplyWithSimpleString(ctx,"OK");
+    }
+
+    NRCodecBuf b = {NULL,0,0};
+    const char *header = "# nr_commandstats\r\n";
+    NRCodecPut(&b,header,strlen(header));
+    for (int j = 0; j < NRCommandsCount; j++) {
+        NRCommandStats *cs = &NRCommandStatsTable[j];
+        if (cs->total.count == 0) continue;
+        NRStatsAppendHistogram(&b,cs->name,"",&cs->total);
+    }
+    header = "\r\n# nr_phasestats\r\n";
+    NRCodecPut(&b,header,strlen(header));
+    for (int j = 0; j < NRCommandsCount; j++) {
+        NRCommandStats *cs = &NRCommandStatsTable[j];
+        for (int p = 0; p < NR_PHASES; p++) {
+            char suffix[32];
+            if (cs->phase[p].count == 0) continue;
+            snprintf(suffix,sizeof(suffix),"_%s",NRPhaseNames[p]);
+            NRStatsAppendHistogram(&b,cs->name,suffix,&cs->phase[p]);
+        }
+    }
+
+    char buf[256];
+    pthread_mutex_lock(&NRInferenceMutex);
+    int len = snprintf(buf,sizeof(buf),
+        "\r\n# nr_inference\r\ninference_offloaded_jobs:%llu\r\n",
+        (unsigned long long)NRInferenceOffloaded);
+    pthread_mutex_unlock(&NRInferenceMutex);
+    NRCodecPut(&b,buf,len);
+
+    size_t regions, region_bytes, huge_bytes;
+    AnnRegionStats(&regions,&region_bytes,&huge_bytes);
+    len = snprintf(buf,sizeof(buf),
+        "\r\n# nr_memory\r\n"
+        "training_memory_reserved:%zu\r\n"
+        "training_memory_budget:%lld\r\n"
+        "training_budget_rejections:%llu\r\n"
+        "readmostly_regions:%zu\r\n"
+        "readmostly_bytes:%zu\r\n"
+        "readmostly_hugepage_bytes:%zu\r\n",
+        NRTrainingMemoryReserved(), NRConfig.training_memory_budget,
+        (unsigned long long)NRTrainingBudgetRejections,
+        regions, region_bytes, huge_bytes);
+    NRCodecPut(&b,buf,len);
+
+    RedisModule_ReplyWithStringBuffer(ctx,(char*)b.p,b.len);
+    RedisModule_Free(b.p);
+    return REDISMODULE_OK;
+}
+
+/* NR.CONFIG GET <option|*>
+ * NR.CONFIG SET <option> <value> */
+int NRConfig_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+    if (argc < 3) return RedisModule_WrongArity(ctx);
+    const char *sub = RedisModule_StringPtrLen(argv[1], NULL);
+    const char *name = RedisModule_StringPtrLen(argv[2], NULL);
+
+    if (!strcasecmp(sub,"set")) {
+        const char *err;
+        if (argc != 4) return RedisModule_WrongArity(ctx);
+        if (NRConfigSet(name,RedisModule_StringPtrLen(argv[3],NULL),&err) ==
+            REDISMODULE_ERR) return RedisModule_ReplyWithError(ctx,err);
+        return RedisModule_ReplyWithSimpleString(ctx,"OK");
+    } else if (!strcasecmp(sub,"get")) {
+        char buf[64];
+        int count = 0;
+        if (argc != 3) return RedisModule_WrongArity(ctx);
+        RedisModule_ReplyWithArray(ctx,REDISMODULE_POSTPONED_ARRAY_LEN);
+        for (int j = 0; NRConfigNames[j]; j++) {
+            if (strcmp(name,"*") && strcasecmp(name,NRConfigNames[j]))
+                continue;
+            NRConfigGet(NRConfigNames[j],buf,sizeof(buf));
+            RedisModule_ReplyWithSimpleString(ctx,NRConfigNames[j]);
+            RedisModule_ReplyWithSimpleString(ctx,buf);
+            count += 2;
+        }
+        RedisModule_ReplySetArrayLength(ctx,count);
+        return REDISMODULE_OK;
+    } else {
+        return RedisModule_ReplyWithError(ctx,
+            "ERR Syntax error in NR.CONFIG");
+    }
+}
+
 /* NR.GETDATA key dataset rownum */
 int NRGetdata_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
-    NRCollectThreads(ctx);
 
     if (argc != 4) return RedisModule_WrongArity(ctx);
     RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1], REDISMODULE_READ);
@@ -1157,14 +4865,71 @@ int NRGetdata_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int ar
 
 /* =============================== Type methods ============================= */
 
+/* Starting with encoding version 6, arrays of floats are saved as a single
+ * string, instead of calling RedisModule_SaveFloat() for every element:
+ * with big networks and datasets this makes saving and loading much
+ * faster. */
+
+/* Save an array of 'len' floats as a single string. */
+void NRRdbSaveFloats(RedisModuleIO *rdb, float *v, size_t len) {
+    if (!NR_BIG_ENDIAN) {
+        RedisModule_SaveStringBuffer(rdb,(char*)v,sizeof(float)*len);
+        return;
+    }
+    float *le = RedisModule_Alloc(sizeof(float)*len);
+    memcpy(le,v,sizeof(float)*len);
+    NRFloatsToLittleEndian(le,len);
+    RedisModule_SaveStringBuffer(rdb,(char*)le,sizeof(float)*len);
+    RedisModule_Free(le);
+}
+
+/* Load an array of floats saved with NRRdbSaveFloats(). The returned
+ * array is allocated with RedisModule_Alloc(). If the saved array does
+ * not have exactly 'len' elements, NULL is returned. */
+float *NRRdbLoadFloatsBuffer(RedisModuleIO *rdb, size_t len) {
+    size_t buflen;
+    char *buf = RedisModule_LoadStringBuffer(rdb,&buflen);
+    if (buflen != sizeof(float)*len) {
+        RedisModule_LogIOError(rdb,"warning",
+            "Neural Redis RDB: array of %zu bytes found while %zu "
+            "bytes were expected.", buflen, sizeof(float)*len);
+        RedisModule_Free(buf);
+        return NULL;
+    }
+    NRFloatsToLittleEndian((float*)buf,len);
+    return (float*)buf;
+}
+
+/* Load an array of 'len' floats into 'dst', handling both the old
+ * encoding, one float at a time, and the new one. Returns REDISMODULE_ERR
+ * on format errors. */
+int NRRdbLoadFloats(RedisModuleIO *rdb, int encver, float *dst, size_t len) {
+    if (encver < 6) {
+        for (size_t j = 0; j < len; j++) dst[j] = RedisModule_LoadFloat(rdb);
+        return REDISMODULE_OK;
+    }
+    float *buf = NRRdbLoadFloatsBuffer(rdb,len);
+    if (buf == NULL) return REDISMODULE_ERR;
+    memcpy(dst,buf,sizeof(float)*len);
+    RedisModule_Free(buf);
+    return REDISMODULE_OK;
+}
+
 /* Helper for NRTypeRdbSave(): serialize a NRDataset dataset to RDB. */
 void NRTypeRdbSaveDataset(RedisModuleIO *rdb, NRDataset *ds, uint32_t ilen, uint32_t olen) {
     RedisModule_SaveUnsigned(rdb,ds->len);
     RedisModule_SaveUnsigned(rdb,ds->maxlen);
-    for (uint32_t j = 0; j < ilen*ds->len; j++)
-        RedisModule_SaveFloat(rdb,ds->inputs[j]);
-    for (uint32_t j = 0; j < olen*ds->len; j++)
-        RedisModule_SaveFloat(rdb,ds->outputs[j]);
+    if (ds->len == 0) return;
+
+    NRCodecBuf b = {NULL,0,0};
+    for (uint32_t first = 0; first < ds->len; first += NR_CODEC_BLOCK_ROWS) {
+        uint32_t rows = ds->len-first;
+        if (rows > NR_CODEC_BLOCK_ROWS) rows = NR_CODEC_BLOCK_ROWS;
+        b.len = 0;
+        NRDatasetEncodeBlock(&b,ds,ilen,olen,first,rows);
+        RedisModule_SaveStringBuffer(rdb,(char*)b.p,b.len);
+    }
+    RedisModule_Free(b.p);
 }
 
 /* Serialize a neural network object with its associated dataset
@@ -1190,52 +4955,80 @@ void NRTypeRdbSave(RedisModuleIO *rdb, void *value) {
     RedisModule_SaveFloat(rdb,nr->dataset_error);
     RedisModule_SaveFloat(rdb,nr->test_error);
     RedisModule_SaveFloat(rdb,nr->test_class_error);
+    RedisModule_SaveUnsigned(rdb,nr->cache ? nr->cache->size : 0);
 
     /* Save the neural network weights and biases. We start
      * at layer 1 since the first layer are just outputs. */
     for (int j = 1; j < LAYERS(nr->nn); j++) {
         int weights = WEIGHTS(nr->nn,j);
-        for (int i = 0; i < weights; i++)
-            RedisModule_SaveFloat(rdb,nr->nn->layer[j].weight[i]);
-        for (int i = 0; i < weights; i++)
-            RedisModule_SaveFloat(rdb,nr->nn->layer[j].delta[i]);
-        for (int i = 0; i < weights; i++)
-            RedisModule_SaveFloat(rdb,nr->nn->layer[j].pgradient[i]);
+        NRRdbSaveFloats(rdb,nr->nn->layer[j].weight,weights);
+        NRRdbSaveFloats(rdb,nr->nn->layer[j].delta,weights);
+        NRRdbSaveFloats(rdb,nr->nn->layer[j].pgradient,weights);
     }
 
     /* Save the normalization vectors. */
     uint32_t ilen = INPUT_UNITS(nr->nn);
     uint32_t olen = OUTPUT_UNITS(nr->nn);
-    for (uint32_t j = 0; j < ilen; j++) RedisModule_SaveFloat(rdb,nr->inorm[j]);
-    for (uint32_t j = 0; j < olen; j++) RedisModule_SaveFloat(rdb,nr->onorm[j]);
+    NRRdbSaveFloats(rdb,nr->inorm,ilen);
+    NRRdbSaveFloats(rdb,nr->onorm,olen);
+    NRRdbSaveFloats(rdb,nr->ishift,ilen);
+
+    /* Save the PRNG state and the weights initialization methods. */
+    for (int j = 0; j < 4; j++) RedisModule_SaveUnsigned(rdb,nr->nn->rng[j]);
+    for (int j = 1; j < LAYERS(nr->nn); j++)
+        RedisModule_SaveUnsigned(rdb,nr->nn->layer[j].init);
 
     /* Save the dataset. */
     NRTypeRdbSaveDataset(rdb,&nr->dataset,ilen,olen);
     NRTypeRdbSaveDataset(rdb,&nr->test,ilen,olen);
 }
 
-/* Helper for NRTypeRdbLoad(): deserialize a NRDataset dataset from RDB. */
-void NRTypeRdbLoadDataset(RedisModuleIO *rdb, NRDataset *ds, uint32_t ilen, uint32_t olen) {
+/* Helper for NRTypeRdbLoad(): deserialize a NRDataset dataset from RDB.
+ * Returns REDISMODULE_ERR on format errors. */
+int NRTypeRdbLoadDataset(RedisModuleIO *rdb, int encver, NRDataset *ds, uint32_t ilen, uint32_t olen) {
     ds->len = RedisModule_LoadUnsigned(rdb);
     ds->maxlen = RedisModule_LoadUnsigned(rdb);
 
-    if (ds->len == 0) return;
-
-    ds->inputs = RedisModule_Alloc(ilen*ds->len*sizeof(float));
-    ds->outputs = RedisModule_Alloc(olen*ds->len*sizeof(float));
+    if (ds->len == 0) return REDISMODULE_OK;
+
+    NRDatasetAlloc(ds,ds->len,ilen,olen);
+    if (encver >= 7) {
+        for (uint32_t first = 0; first < ds->len; first += NR_CODEC_BLOCK_ROWS) {
+            uint32_t rows = ds->len-first;
+            if (rows > NR_CODEC_BLOCK_ROWS) rows = NR_CODEC_BLOCK_ROWS;
+            size_t len;
+            char *block = RedisModule_LoadStringBuffer(rdb,&len);
+            NRCodecReader r = {(unsigned char*)block,
+                               (unsigned char*)block+len, 0};
+            int retval = NRDatasetDecodeBlock(&r,ds,ilen,olen,first,rows);
+            RedisModule_Free(block);
+            if (retval != REDISMODULE_OK) {
+                RedisModule_LogIOError(rdb,"warning",
+                    "Neural Redis RDB: malformed dataset block.");
+                return REDISMODULE_ERR;
+            }
+        }
+        return REDISMODULE_OK;
+    }
 
-    for (uint32_t j = 0; j < ilen*ds->len; j++)
-        ds->inputs[j] = RedisModule_LoadFloat(rdb);
-    for (uint32_t j = 0; j < olen*ds->len; j++)
-        ds->outputs[j] = RedisModule_LoadFloat(rdb);
+    if (NRRdbLoadFloats(rdb,encver,ds->inputs,(size_t)ilen*ds->len) !=
+            REDISMODULE_OK ||
+        NRRdbLoadFloats(rdb,encver,ds->outputs,(size_t)olen*ds->len) !=
+            REDISMODULE_OK) return REDISMODULE_ERR;
+    return REDISMODULE_OK;
 }
 
 /* Load a neural network and its associated dataset from RDB. */
 void *NRTypeRdbLoad(RedisModuleIO *rdb, int encver) {
     /* As long as the module is not stable, we don't care about
-     * loading old versions of the encoding. */
-    if (encver != 2) {
-        RedisModule_LogIOError(rdb,"warning","Sorry the Neural Redis module only supports RDB files written with the encoding version %d. This file has encoding version %d, and was likely written by a previous version of this module that is now deprecated. Once the module will be stable we'll start supporting older versions of the encodings, in case we switch to newer encodings.", NR_RDB_ENC_VER, encver);
+     * loading old versions of the encoding. Version 2 is the same as
+     * version 3 without the cache size, version 3 is the same as
+     * version 4 without the inputs normalization offsets, version 4
+     * is the same as version 5 without PRNG state and init methods, and
+     * version 5 is the same as version 6 saving floats one by one, and
+     * version 6 is the same as version 7 with uncompressed datasets. */
+    if (encver < 2 || encver > NR_RDB_ENC_VER) {
+        RedisModule_LogIOError(rdb,"warning","Sorry the Neural Redis module only supports RDB files written with the encoding versions 2 to %d. This file has encoding version %d, and was likely written by a previous version of this module that is now deprecated. Once the module will be stable we'll start supporting older versions of the encodings, in case we switch to newer encodings.", NR_RDB_ENC_VER, encver);
         return NULL;
     }
 
@@ -1259,45 +5052,69 @@ void *NRTypeRdbLoad(RedisModuleIO *rdb, int encver) {
     nr->dataset_error = RedisModule_LoadFloat(rdb);
     nr->test_error = RedisModule_LoadFloat(rdb);
     nr->test_class_error = RedisModule_LoadFloat(rdb);
+    uint64_t cache_size = (encver >= 3) ? RedisModule_LoadUnsigned(rdb) : 0;
+    if (cache_size) nr->cache = NRCacheCreate(cache_size,
+        INPUT_UNITS(nr->nn),OUTPUT_UNITS(nr->nn));
 
     /* Load the neural network weights. */
     for (int j = 1; j < LAYERS(nr->nn); j++) {
         int weights = WEIGHTS(nr->nn,j);
-        for (int i = 0; i < weights; i++)
-            nr->nn->layer[j].weight[i] = RedisModule_LoadFloat(rdb);
-        for (int i = 0; i < weights; i++)
-            nr->nn->layer[j].delta[i] = RedisModule_LoadFloat(rdb);
-        for (int i = 0; i < weights; i++)
-            nr->nn->layer[j].pgradient[i] = RedisModule_LoadFloat(rdb);
+        if (NRRdbLoadFloats(rdb,encver,nr->nn->layer[j].weight,weights) ||
+            NRRdbLoadFloats(rdb,encver,nr->nn->layer[j].delta,weights) ||
+            NRRdbLoadFloats(rdb,encver,nr->nn->layer[j].pgradient,weights))
+            goto loaderr;
     }
 
     /* Load the normalization vector. */
     uint32_t ilen = INPUT_UNITS(nr->nn);
     uint32_t olen = OUTPUT_UNITS(nr->nn);
-    for (uint32_t j = 0; j < ilen; j++)
-        nr->inorm[j] = RedisModule_LoadFloat(rdb);
-    for (uint32_t j = 0; j < olen; j++)
-        nr->onorm[j] = RedisModule_LoadFloat(rdb);
-
-    /* Load the dataset. */
-    NRTypeRdbLoadDataset(rdb,&nr->dataset,ilen,olen);
-    NRTypeRdbLoadDataset(rdb,&nr->test,ilen,olen);
+    if (NRRdbLoadFloats(rdb,encver,nr->inorm,ilen) ||
+        NRRdbLoadFloats(rdb,encver,nr->onorm,olen) ||
+        (encver >= 4 && NRRdbLoadFloats(rdb,encver,nr->ishift,ilen)))
+        goto loaderr;
+    if (encver >= 5) {
+        for (int j = 0; j < 4; j++)
+            nr->nn->rng[j] = RedisModule_LoadUnsigned(rdb);
+        for (int j = 1; j < LAYERS(nr->nn); j++)
+            nr->nn->layer[j].init = RedisModule_LoadUnsigned(rdb);
+    }
 
+    /* Load the dataset. The statistics are not saved: rebuild them. */
+    if (NRTypeRdbLoadDataset(rdb,encver,&nr->dataset,ilen,olen) ||
+        NRTypeRdbLoadDataset(rdb,encver,&nr->test,ilen,olen))
+        goto loaderr;
+    NRStatsRebuild(&nr->stats,&nr->dataset,ilen,olen);
     return nr;
+
+loaderr:
+    NRTypeReleaseObject(nr);
+    return NULL;
 }
 
+/* Rewrite the network as an NR.SETWEIGHTS command creating it, followed
+ * by NR.LOADDATA commands loading the datasets, one block of rows at a
+ * time. */
 void NRTypeAofRewrite(RedisModuleIO *aof, RedisModuleString *key, void *value) {
-    UNUSED(aof);
-    UNUSED(key);
-    UNUSED(value);
-#if 0
-    NRTypeObject *hto = value;
-    struct NRTypeNode *node = hto->head;
-    while(node) {
-        RedisModule_EmitAOF(aof,"HELLOTYPE.INSERT","sl",key,node->value);
-        node = node->next;
+    NRTypeObject *nr = value;
+    uint32_t ilen = INPUT_UNITS(nr->nn);
+    uint32_t olen = OUTPUT_UNITS(nr->nn);
+    NRCodecBuf b = {NULL,0,0};
+
+    NRSerializeNet(&b,nr,0);
+    RedisModule_EmitAOF(aof,"NR.SETWEIGHTS","sb",key,(char*)b.p,b.len);
+
+    for (int j = 0; j < 2; j++) {
+        NRDataset *ds = j == 0 ? &nr->dataset : &nr->test;
+        for (uint32_t first = 0; first < ds->len; first += NR_CODEC_BLOCK_ROWS) {
+            uint32_t rows = ds->len-first;
+            if (rows > NR_CODEC_BLOCK_ROWS) rows = NR_CODEC_BLOCK_ROWS;
+            b.len = 0;
+            NRDatasetEncodeBlock(&b,ds,ilen,olen,first,rows);
+            RedisModule_EmitAOF(aof,"NR.LOADDATA","sclb",key,
+                j == 0 ? "TRAIN" : "TEST",(long long)rows,(char*)b.p,b.len);
+        }
     }
-#endif
+    RedisModule_Free(b.p);
 }
 
 void NRTypeDigest(RedisModuleDigest *digest, void *value) {
@@ -1306,57 +5123,99 @@ void NRTypeDigest(RedisModuleDigest *digest, void *value) {
     /* TODO: The DIGEST module interface is yet not implemented. */
 }
 
+/* Called when the key is deleted or overwritten: trainings in progress
+ * for this network are no longer useful, so we cancel them. */
 void NRTypeFree(void *value) {
+    NRTypeObject *nr = value;
+    if (nr->flags & NR_FLAG_TRAINING) NRCancelTrainings(nr->id);
     NRTypeReleaseObject(value);
 }
 
 /* This function must be present on each Redis module. It is used in order to
  * register the commands into the Redis server. */
-int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    UNUSED(argv);
-    UNUSED(argc);
+/* Commands of the module, registered in RedisModule_OnLoad(). */
+static struct NRCommand {
+    const char *name;
+    RedisModuleCmdFunc proc;
+    const char *flags;
+    int firstkey, lastkey, keystep;
+} NRCommandTable[] = {
+    {"nr.create",NRCreate_RedisCommand,"write deny-oom",1,1,1},
+    {"nr.explain",NRExplain_RedisCommand,"readonly getkeys-api",0,0,0},
+    {"nr.run",NRRun_RedisCommand,"readonly",1,1,1},
+    {"nr.class",NRClass_RedisCommand,"readonly",1,1,1},
+    {"nr.runkey",NRRunKey_RedisCommand,"readonly",1,2,1},
+    {"nr.runscan",NRRunScan_RedisCommand,"write deny-oom getkeys-api",1,1,1},
+    {"nr.observe",NRObserve_RedisCommand,"write deny-oom",1,1,1},
+    {"nr.info",NRInfo_RedisCommand,"readonly",1,1,1},
+    {"nr.train",NRTrain_RedisCommand,"write",1,1,1},
+    {"nr.reset",NRReset_RedisCommand,"write",1,1,1},
+    {"nr.setweights",NRSetWeights_RedisCommand,"write deny-oom",1,1,1},
+    {"nr.loaddata",NRLoadData_RedisCommand,"write deny-oom",1,1,1},
+    {"nr.export",NRExport_RedisCommand,"readonly",1,1,1},
+    {"nr.import",NRImport_RedisCommand,"write deny-oom",1,1,1},
+    {"nr.threads",NRThreads_RedisCommand,"write",0,0,0},
+    {"nr.getdata",NRGetdata_RedisCommand,"readonly",1,1,1},
+    {"nr.config",NRConfig_RedisCommand,"admin",0,0,0},
+    {"nr.stats",NRStats_RedisCommand,"admin",0,0,0},
+    {NULL,NULL,NULL,0,0,0}
+};
+
+/* Every command of the module is registered with this dispatcher, that
+ * looks up the command by name and calls it recording its statistics,
+ * see NRStatsCall(). */
+int NRDispatch_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    size_t len;
+    const char *name = RedisModule_StringPtrLen(argv[0],&len);
+
+    for (int j = 0; NRCommandTable[j].name; j++) {
+        struct NRCommand *cmd = &NRCommandTable[j];
+        if (strlen(cmd->name) != len || strcasecmp(cmd->name,name)) continue;
+        /* Requests of the keys positions are not command calls. */
+        if (RedisModule_IsKeysPositionRequest &&
+            RedisModule_IsKeysPositionRequest(ctx))
+            return cmd->proc(ctx,argv,argc);
+        return NRStatsCall(&NRCommandStatsTable[j],cmd->proc,ctx,argv,argc);
+    }
+    return RedisModule_ReplyWithError(ctx,"ERR unknown command");
+}
 
+int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     if (RedisModule_Init(ctx,"neuralredis",1,REDISMODULE_APIVER_1)
         == REDISMODULE_ERR) return REDISMODULE_ERR;
 
-    NRType = RedisModule_CreateDataType(ctx,"neural-NN",NR_RDB_ENC_VER,NRTypeRdbLoad,NRTypeRdbSave,NRTypeAofRewrite,NRTypeDigest,NRTypeFree);
-    if (NRType == NULL) return REDISMODULE_ERR;
-
-    if (RedisModule_CreateCommand(ctx,"nr.create",
-        NRCreate_RedisCommand,"write deny-oom",1,1,1) == REDISMODULE_ERR)
-        return REDISMODULE_ERR;
-
-    if (RedisModule_CreateCommand(ctx,"nr.run",
-        NRRun_RedisCommand,"readonly",1,1,1) == REDISMODULE_ERR)
-        return REDISMODULE_ERR;
-
-    if (RedisModule_CreateCommand(ctx,"nr.class",
-        NRClass_RedisCommand,"readonly",1,1,1) == REDISMODULE_ERR)
-        return REDISMODULE_ERR;
-
-    if (RedisModule_CreateCommand(ctx,"nr.observe",
-        NRObserve_RedisCommand,"write deny-oom",1,1,1) == REDISMODULE_ERR)
-        return REDISMODULE_ERR;
-
-    if (RedisModule_CreateCommand(ctx,"nr.info",
-        NRInfo_RedisCommand,"readonly",1,1,1) == REDISMODULE_ERR)
-        return REDISMODULE_ERR;
-
-    if (RedisModule_CreateCommand(ctx,"nr.train",
-        NRTrain_RedisCommand,"write",1,1,1) == REDISMODULE_ERR)
-        return REDISMODULE_ERR;
+    /* Networks are allocated with the Redis allocator, like everything
+     * else, so that they are accounted in the used memory. */
+    AnnSetAllocator(RedisModule_Alloc,RedisModule_Free);
 
-    if (RedisModule_CreateCommand(ctx,"nr.reset",
-        NRReset_RedisCommand,"write",1,1,1) == REDISMODULE_ERR)
+    /* Configuration options are passed as <option> <value> pairs. */
+    if (argc % 2) {
+        RedisModule_Log(ctx,"warning",
+            "Module arguments must be <option> <value> pairs");
         return REDISMODULE_ERR;
+    }
+    NRSchedUpdatePlacement();
+    for (int j = 0; j < argc; j += 2) {
+        const char *name = RedisModule_StringPtrLen(argv[j],NULL);
+        const char *value = RedisModule_StringPtrLen(argv[j+1],NULL);
+        const char *err;
+        if (NRConfigSet(name,value,&err) == REDISMODULE_ERR) {
+            RedisModule_Log(ctx,"warning","%s: %s", name, err);
+            return REDISMODULE_ERR;
+        }
+    }
 
-    if (RedisModule_CreateCommand(ctx,"nr.threads",
-        NRThreads_RedisCommand,"",1,1,1) == REDISMODULE_ERR)
-        return REDISMODULE_ERR;
+    NRType = RedisModule_CreateDataType(ctx,"neural-NN",NR_RDB_ENC_VER,NRTypeRdbLoad,NRTypeRdbSave,NRTypeAofRewrite,NRTypeDigest,NRTypeFree);
+    if (NRType == NULL) return REDISMODULE_ERR;
 
-    if (RedisModule_CreateCommand(ctx,"nr.getdata",
-        NRGetdata_RedisCommand,"readonly",1,1,1) == REDISMODULE_ERR)
-        return REDISMODULE_ERR;
+    for (int j = 0; NRCommandTable[j].name; j++) {
+        struct NRCommand *cmd = &NRCommandTable[j];
+        if (RedisModule_CreateCommand(ctx,cmd->name,NRDispatch_RedisCommand,
+            cmd->flags,cmd->firstkey,cmd->lastkey,cmd->keystep)
+            == REDISMODULE_ERR) return REDISMODULE_ERR;
+        NRCommandStatsTable[j].name = cmd->name;
+        NRCommandsCount++;
+    }
 
     return REDISMODULE_OK;
 }
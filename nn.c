@@ -29,11 +29,16 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _POSIX_C_SOURCE 199309L /* for clock_gettime() */
+#define _DEFAULT_SOURCE /* for madvise() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <time.h>
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #ifdef USE_AVX
 #include <xmmintrin.h>
@@ -43,6 +48,132 @@
 
 #include "nn.h"
 
+/* Allocator of all the memory of the networks, see AnnSetAllocator(). */
+static void *(*AnnMallocFn)(size_t size) = malloc;
+static void (*AnnFreeFn)(void *ptr) = free;
+
+/* Set the functions used to allocate and release the memory of the
+ * networks, by default malloc() and free(). The allocator may be called
+ * by different threads at the same time. Must be called before creating
+ * any network, since a network must be released with the allocator that
+ * created it. */
+void AnnSetAllocator(void *(*malloc_fn)(size_t), void (*free_fn)(void *)) {
+    AnnMallocFn = malloc_fn;
+    AnnFreeFn = free_fn;
+}
+
+/* Read-mostly data, like the weights of compiled networks and the
+ * datasets, is allocated in regions. Regions of at least
+ * ANN_REGION_ALIGN_MIN bytes are aligned and padded to whole pages, so
+ * they never share a page with memory written at every call: after a
+ * fork(), as when Redis saves the RDB file, their pages are not copied
+ * unless the data really changes. Regions of at least ANN_REGION_HUGE_MIN
+ * bytes are aligned to huge pages, and advised to be backed by them.
+ * Smaller regions are just aligned to a cache line.
+ *
+ * The header is stored just before the address returned to the caller. */
+typedef struct AnnRegion {
+    void *raw;      /* Address returned by the allocator. */
+    size_t alloc;   /* Bytes requested to the allocator. */
+    size_t huge;    /* Bytes aligned to huge pages, or zero. */
+} AnnRegion;
+
+/* Regions allocated, and bytes they take, see AnnRegionStats(). */
+static size_t AnnRegionCount = 0;
+static size_t AnnRegionBytes = 0;
+static size_t AnnRegionHugeBytes = 0;
+
+static size_t AnnPageSize(void) {
+    static size_t pagesize = 0;
+    if (pagesize == 0) {
+        long ps = sysconf(_SC_PAGESIZE);
+        pagesize = ps > 0 ? (size_t)ps : 4096;
+    }
+    return pagesize;
+}
+
+/* Return the alignment of a region of 'size' bytes. */
+static size_t AnnRegionAlign(size_t size) {
+    if (size >= ANN_REGION_HUGE_MIN) return ANN_REGION_HUGE_PAGE;
+    if (size >= ANN_REGION_ALIGN_MIN) return AnnPageSize();
+    return ANN_REGION_LINE;
+}
+
+/* Return the bytes AnnAllocRegion() allocates for a region of 'size'
+ * bytes: the size rounded to the alignment, plus the header and the
+ * room to align the region. */
+size_t AnnRegionAllocSize(size_t size) {
+    size_t align = AnnRegionAlign(size);
+    return sizeof(AnnRegion) + align + ((size+align-1) & ~(align-1));
+}
+
+/* Allocate a region of 'size' bytes, see the comment at the top of the
+ * regions code. On out of memory NULL is returned. The region must be
+ * released with AnnFreeRegion(). */
+void *AnnAllocRegion(size_t size) {
+    size_t align = AnnRegionAlign(size);
+    size_t alloc = AnnRegionAllocSize(size);
+    char *raw = AnnMallocFn(alloc);
+
+    if (raw == NULL) return NULL;
+    uintptr_t p = ((uintptr_t)raw + sizeof(AnnRegion) + align-1) &
+                  ~(uintptr_t)(align-1);
+    AnnRegion *r = (AnnRegion*)p - 1;
+    r->raw = raw;
+    r->alloc = alloc;
+    r->huge = 0;
+    if (align == ANN_REGION_HUGE_PAGE) {
+        r->huge = (size+align-1) & ~(align-1);
+#ifdef MADV_HUGEPAGE
+        /* Failures are not important: without transparent huge pages the
+         * region is just backed by normal pages. */
+        madvise((void*)p,r->huge,MADV_HUGEPAGE);
+#endif
+    }
+    __sync_add_and_fetch(&AnnRegionCount,1);
+    __sync_add_and_fetch(&AnnRegionBytes,alloc);
+    __sync_add_and_fetch(&AnnRegionHugeBytes,r->huge);
+    return (void*)p;
+}
+
+/* Release a region allocated with AnnAllocRegion(). NULL is ignored. */
+void AnnFreeRegion(void *region) {
+    if (region == NULL) return;
+    AnnRegion *r = (AnnRegion*)region - 1;
+    __sync_sub_and_fetch(&AnnRegionCount,1);
+    __sync_sub_and_fetch(&AnnRegionBytes,r->alloc);
+    __sync_sub_and_fetch(&AnnRegionHugeBytes,r->huge);
+    AnnFreeFn(r->raw);
+}
+
+/* Resize a region to 'size' bytes, preserving its first 'keep' bytes,
+ * that must not be more than the old and the new size. Like realloc()
+ * the region may be moved, and 'region' may be NULL. On out of memory NULL
+ * is returned and the old region is left untouched. */
+void *AnnReallocRegion(void *region, size_t keep, size_t size) {
+    void *p = AnnAllocRegion(size);
+    if (p == NULL) return NULL;
+    if (keep) memcpy(p,region,keep);
+    AnnFreeRegion(region);
+    return p;
+}
+
+/* Return the bytes allocated for the region, including the header and
+ * the alignment padding, or zero if 'region' is NULL. */
+size_t AnnRegionSize(void *region) {
+    if (region == NULL) return 0;
+    return ((AnnRegion*)region - 1)->alloc;
+}
+
+/* Report the number of regions currently allocated, the bytes allocated
+ * for them, and how many of those bytes are in regions aligned to huge
+ * pages. The counters are global, shared by all the networks. */
+void AnnRegionStats(size_t *count, size_t *bytes, size_t *huge) {
+    *count = __sync_add_and_fetch(&AnnRegionCount,0);
+    *bytes = __sync_add_and_fetch(&AnnRegionBytes,0);
+    *huge = __sync_add_and_fetch(&AnnRegionHugeBytes,0);
+}
+
 /* Node Transfer Function */
 float sigmoid(float x) {
     return (float)1/(1+exp(-x));
@@ -62,23 +193,34 @@ void AnnResetLayer(struct AnnLayer *layer) {
     layer->pgradient = NULL;
     layer->delta = NULL;
     layer->sgradient = NULL;
+    layer->init = ANN_INIT_UNIFORM;
 }
 
+/* Nets not explicitly seeded with AnnSeed() get a seed depending on the
+ * time and this counter. */
+static uint64_t AnnSeedCounter = 0;
+
 /* Allocate and return an initialized N-layers network */
 struct Ann *AnnAlloc(int layers) {
     struct Ann *net;
     int i;
 
     /* Alloc the net structure */
-    if ((net = malloc(sizeof(*net))) == NULL)
+    if ((net = AnnMallocFn(sizeof(*net))) == NULL)
         return NULL;
     /* Alloc layers */
-    if ((net->layer = malloc(sizeof(struct AnnLayer)*layers)) == NULL) {
-        free(net);
+    if ((net->layer = AnnMallocFn(sizeof(struct AnnLayer)*layers)) == NULL) {
+        AnnFreeFn(net);
         return NULL;
     }
     net->layers = layers;
     net->flags = 0;
+    net->refcount = 1;
+    AnnSeed(net, ((uint64_t)time(NULL) << 20) ^
+                 __sync_add_and_fetch(&AnnSeedCounter,1));
+    net->oscale = NULL;
+    net->region = NULL;
+    net->profile = NULL;
     net->rprop_nminus = DEFAULT_RPROP_NMINUS;
     net->rprop_nplus = DEFAULT_RPROP_NPLUS;
     net->rprop_maxupdate = DEFAULT_RPROP_MAXUPDATE;
@@ -92,13 +234,13 @@ struct Ann *AnnAlloc(int layers) {
 /* Free a single layer */
 void AnnFreeLayer(struct AnnLayer *layer)
 {
-    free(layer->output);
-    free(layer->error);
-    free(layer->weight);
-    free(layer->gradient);
-    free(layer->pgradient);
-    free(layer->delta);
-    free(layer->sgradient);
+    AnnFreeFn(layer->output);
+    AnnFreeFn(layer->error);
+    AnnFreeFn(layer->weight);
+    AnnFreeFn(layer->gradient);
+    AnnFreeFn(layer->pgradient);
+    AnnFreeFn(layer->delta);
+    AnnFreeFn(layer->sgradient);
     AnnResetLayer(layer);
 }
 
@@ -107,31 +249,53 @@ void AnnFree(struct Ann *net)
 {
     int i;
 
+    /* The weights of compiled networks are all in the same region. */
+    if (net->region) {
+        for (i = 0; i < net->layers; i++) net->layer[i].weight = NULL;
+        net->oscale = NULL;
+        AnnFreeRegion(net->region);
+    }
     /* Free layer data */
     for (i = 0; i < net->layers; i++) AnnFreeLayer(&net->layer[i]);
     /* Free allocated layers structures */
-    free(net->layer);
+    AnnFreeFn(net->layer);
+    AnnFreeFn(net->oscale);
     /* And the main structure itself */
-    free(net);
+    AnnFreeFn(net);
+}
+
+/* Take a reference to the net, so that it is not freed until a matching
+ * AnnRelease() is called. This is useful to use the net from other
+ * threads while the owner may release it in the meantime. Reference
+ * counting is atomic, however it is up to the caller to make sure that
+ * shared nets are not modified. */
+struct Ann *AnnRetain(struct Ann *net) {
+    __sync_add_and_fetch(&net->refcount,1);
+    return net;
+}
+
+/* Release a reference to the net, freeing it if it was the last one. */
+void AnnRelease(struct Ann *net) {
+    if (__sync_sub_and_fetch(&net->refcount,1) == 0) AnnFree(net);
 }
 
 /* Init a layer of the net with the specified number of units.
  * Return non-zero on out of memory. */
 int AnnInitLayer(struct Ann *net, int i, int units, int bias) {
     if (bias) units++; /* Take count of the bias unit */
-    net->layer[i].output = malloc(sizeof(float)*units);
-    net->layer[i].error = malloc(sizeof(float)*units);
+    net->layer[i].output = AnnMallocFn(sizeof(float)*units);
+    net->layer[i].error = AnnMallocFn(sizeof(float)*units);
     if (i) { /* not for output layer */
         net->layer[i].weight =
-            malloc(sizeof(float)*units*net->layer[i-1].units);
+            AnnMallocFn(sizeof(float)*units*net->layer[i-1].units);
         net->layer[i].gradient =
-            malloc(sizeof(float)*units*net->layer[i-1].units);
+            AnnMallocFn(sizeof(float)*units*net->layer[i-1].units);
         net->layer[i].pgradient =
-            malloc(sizeof(float)*units*net->layer[i-1].units);
+            AnnMallocFn(sizeof(float)*units*net->layer[i-1].units);
         net->layer[i].delta =
-            malloc(sizeof(float)*units*net->layer[i-1].units);
+            AnnMallocFn(sizeof(float)*units*net->layer[i-1].units);
         net->layer[i].sgradient =
-            malloc(sizeof(float)*units*net->layer[i-1].units);
+            AnnMallocFn(sizeof(float)*units*net->layer[i-1].units);
     }
     net->layer[i].units = units;
     /* Check for out of memory conditions */
@@ -206,9 +370,123 @@ struct Ann *AnnClone(struct Ann* net) {
     copy->rprop_maxupdate = net->rprop_maxupdate;
     copy->rprop_minupdate = net->rprop_minupdate;
     copy->flags = net->flags;
+    memcpy(copy->rng, net->rng, sizeof(net->rng));
+    for (j = 0; j < LAYERS(net); j++) copy->layer[j].init = net->layer[j].init;
+    if (net->oscale) {
+        if ((copy->oscale = AnnMallocFn(sizeof(float)*OUTPUT_UNITS(net))) == NULL) {
+            AnnFree(copy);
+            return NULL;
+        }
+        memcpy(copy->oscale, net->oscale, sizeof(float)*OUTPUT_UNITS(net));
+    }
+    return copy;
+}
+
+/* Round a number of floats to a multiple of the floats of a cache line. */
+#define ANN_LINE_FLOATS (ANN_REGION_LINE/sizeof(float))
+#define ANN_LINE_FLOATS_ROUND(n) (((n)+ANN_LINE_FLOATS-1) & ~(ANN_LINE_FLOATS-1))
+
+/* Return the floats of the region of the compiled copy of 'net', see
+ * AnnCompile(): the weights of every layer start at a cache line boundary,
+ * followed by the output scaling if 'oscale' is true. */
+static size_t AnnCompiledFloats(struct Ann *net, int oscale) {
+    size_t floats = 0;
+    for (int j = 1; j < LAYERS(net); j++)
+        floats += ANN_LINE_FLOATS_ROUND(WEIGHTS(net,j));
+    if (oscale) floats += OUTPUT_UNITS(net);
+    return floats;
+}
+
+/* Create an inference only copy of the network: only the weights are
+ * allocated, so the copy can only be used with AnnForward(). If 'ishift'
+ * and/or 'iscale' are not NULL, the inputs of the copy are transformed
+ * into (input[i]-ishift[i])/iscale[i]: the transformation is folded into
+ * the input layer weights and bias, so this costs nothing at inference
+ * time. If 'oscale' is not NULL, the outputs of the copy are multiplied
+ * by the values in the vector.
+ * The weights are stored in a read-mostly region, see AnnAllocRegion().
+ * On out of memory NULL is returned. */
+struct Ann *AnnCompile(struct Ann *net, float *ishift, float *iscale, float *oscale) {
+    struct Ann *copy;
+    int i, j;
+
+    if ((copy = AnnAlloc(LAYERS(net))) == NULL) return NULL;
+    size_t floats = AnnCompiledFloats(net,oscale != NULL);
+    if ((copy->region = AnnAllocRegion(sizeof(float)*floats)) == NULL) {
+        AnnFree(copy);
+        return NULL;
+    }
+    float *p = copy->region;
+    for (j = 0; j < LAYERS(net); j++) {
+        copy->layer[j].units = UNITS(net,j);
+        if (j == 0) continue;
+        size_t weights = WEIGHTS(net,j);
+        copy->layer[j].weight = p;
+        memcpy(p, net->layer[j].weight, sizeof(float)*weights);
+        p += ANN_LINE_FLOATS_ROUND(weights);
+    }
+    if (ishift || iscale) {
+        int l = LAYERS(net)-1;
+        int units = UNITS(net,l);
+        int bias = INPUT_UNITS(net);
+        for (j = 0; j < UNITS(net,l-1); j++) {
+            float *w = copy->layer[l].weight + j*units;
+            for (i = 0; i < INPUT_UNITS(net); i++) {
+                if (iscale) w[i] /= iscale[i];
+                if (ishift) w[bias] -= w[i]*ishift[i];
+            }
+        }
+    }
+    if (oscale) {
+        copy->oscale = p;
+        memcpy(copy->oscale, oscale, sizeof(float)*OUTPUT_UNITS(net));
+    }
     return copy;
 }
 
+/* Copy the weights of 'src' into 'dst', that must have the same layout
+ * (for instance 'dst' was obtained with AnnClone()). Unlike AnnClone() no
+ * memory is allocated, and only the weights are copied: outputs, errors,
+ * gradients and deltas of 'dst' are left untouched. */
+void AnnCopyWeights(struct Ann *dst, struct Ann *src) {
+    int j;
+
+    for (j = 1; j < LAYERS(src); j++)
+        memcpy(dst->layer[j].weight, src->layer[j].weight,
+            sizeof(float)*WEIGHTS(src,j));
+}
+
+/* Return the number of floats needed to store all the weights of the
+ * network with AnnSaveWeights(), including the ones of the bias units. */
+size_t AnnWeightsBufferLen(struct Ann *net) {
+    size_t len = 0;
+    int j;
+
+    for (j = 1; j < LAYERS(net); j++) len += WEIGHTS(net,j);
+    return len;
+}
+
+/* Save the weights of all the layers, one after the other, into 'buf',
+ * that must be at least AnnWeightsBufferLen() floats. */
+void AnnSaveWeights(struct Ann *net, float *buf) {
+    int j;
+
+    for (j = 1; j < LAYERS(net); j++) {
+        memcpy(buf, net->layer[j].weight, sizeof(float)*WEIGHTS(net,j));
+        buf += WEIGHTS(net,j);
+    }
+}
+
+/* Load the weights previously saved with AnnSaveWeights(). */
+void AnnLoadWeights(struct Ann *net, float *buf) {
+    int j;
+
+    for (j = 1; j < LAYERS(net); j++) {
+        memcpy(net->layer[j].weight, buf, sizeof(float)*WEIGHTS(net,j));
+        buf += WEIGHTS(net,j);
+    }
+}
+
 /* Create a N-layer input/hidden/output net.
  * The units array should specify the number of
  * units in every layer from the output to the input layer. */
@@ -229,6 +507,20 @@ struct Ann *AnnCreateNet(int layers, int *units) {
     return net;
 }
 
+/* Create a network with the specified layout, without allocating any
+ * array: it can't be used for anything but to inspect the layout, with
+ * AnnCountWeights(), AnnLayoutMemoryUsage() and so forth, so it is
+ * cheap even for huge layouts. The units array is like in AnnCreateNet().
+ * The network must be freed with AnnFree(). */
+struct Ann *AnnCreateLayout(int layers, int *units) {
+    struct Ann *net;
+    int i;
+
+    if ((net = AnnAlloc(layers)) == NULL) return NULL;
+    for (i = 0; i < layers; i++) net->layer[i].units = units[i] + (i > 0);
+    return net;
+}
+
 /* Return the total number of weights this NN has. */
 size_t AnnCountWeights(struct Ann *net) {
     size_t weights = 0;
@@ -236,11 +528,66 @@ size_t AnnCountWeights(struct Ann *net) {
         int nextunits = net->layer[i-1].units;
         int units = net->layer[i].units;
         if (i > 1) nextunits--; /* we don't output on bias units */
-        weights += units*nextunits;
+        weights += (size_t)units*nextunits;
     }
     return weights;
 }
 
+/* Return the number of bytes allocated for the network. Only the arrays
+ * actually allocated are counted, so this works for compiled networks. */
+size_t AnnMemoryUsage(struct Ann *net) {
+    size_t bytes = sizeof(*net) + sizeof(struct AnnLayer)*net->layers;
+    for (int i = 0; i < net->layers; i++) {
+        struct AnnLayer *l = &net->layer[i];
+        size_t units = l->units;
+        size_t weights = i ? units*net->layer[i-1].units : 0;
+        if (l->output) bytes += sizeof(float)*units;
+        if (l->error) bytes += sizeof(float)*units;
+        if (l->weight && !net->region) bytes += sizeof(float)*weights;
+        if (l->gradient) bytes += sizeof(float)*weights;
+        if (l->sgradient) bytes += sizeof(float)*weights;
+        if (l->pgradient) bytes += sizeof(float)*weights;
+        if (l->delta) bytes += sizeof(float)*weights;
+    }
+    if (net->oscale && !net->region) bytes += sizeof(float)*OUTPUT_UNITS(net);
+    return bytes + AnnRegionSize(net->region);
+}
+
+/* Return the number of bytes AnnCreateNet() allocates for a network with
+ * the layout of 'net', or AnnCompile() if 'compiled' is true (without
+ * output scaling). Only the units of 'net' are used. */
+size_t AnnLayoutMemoryUsage(struct Ann *net, int compiled) {
+    size_t bytes = sizeof(*net) + sizeof(struct AnnLayer)*net->layers;
+    for (int i = 0; i < net->layers; i++) {
+        size_t units = net->layer[i].units;
+        size_t weights = i ? units*net->layer[i-1].units : 0;
+        if (!compiled) bytes += sizeof(float)*(units*2 + weights*5);
+    }
+    if (compiled)
+        bytes += AnnRegionAllocSize(sizeof(float)*AnnCompiledFloats(net,0));
+    return bytes;
+}
+
+/* Return the name of the kernels in use, selected at compile time. */
+const char *AnnKernelName(void) {
+#ifdef USE_AVX
+    return "avx2-fma";
+#else
+    return "generic";
+#endif
+}
+
+/* Return the number of floats the kernels process at once: rows of
+ * weights are processed in blocks of this size, and the remaining
+ * weights one by one. */
+int AnnVectorWidth(void) {
+#ifdef USE_AVX
+    return 8;
+#else
+    return 1;
+#endif
+}
+
 /* Create a 4-layer input/hidden/output net */
 struct Ann *AnnCreateNet4(int iunits, int hunits, int hunits2, int ounits) {
     int units[4];
@@ -298,42 +645,89 @@ float avx_horizontal_sum(__m256 x) {
 }
 #endif
 
-void AnnSimulate(struct Ann *net) {
-    int i, j, k;
+/* Compute the outputs of layer i-1, given the outputs 'in' of layer i.
+ * The results are stored in 'out'. Bias units outputs are not written.
+ * If 'scale' is not NULL, every output is multiplied by scale[j]. */
+static void AnnSimulateLayer(struct Ann *net, int i, float *in, float *out, float *scale) {
+    int j, k;
+    int nextunits = net->layer[i-1].units;
+    int units = net->layer[i].units;
 
-    for (i = net->layers-1; i > 0; i--) {
-        int nextunits = net->layer[i-1].units;
-        int units = net->layer[i].units;
-        if (i > 1) nextunits--; /* dont output on bias units */
-        for (j = 0; j < nextunits; j++) {
-            float A = 0; /* Activation final value. */
-            float *w = net->layer[i].weight + j*units;
-            float *o = net->layer[i].output;
+    if (i > 1) nextunits--; /* dont output on bias units */
+    for (j = 0; j < nextunits; j++) {
+        float A = 0; /* Activation final value. */
+        float *w = net->layer[i].weight + j*units;
+        float *o = in;
 
-            k = 0;
+        k = 0;
 
 #ifdef USE_AVX
-            int psteps = units/8;
-            for (int x = 0; x < psteps; x++) {
-                __m256 weights = _mm256_loadu_ps(w);
-                __m256 outputs = _mm256_loadu_ps(o);
-                __m256 prod = _mm256_mul_ps(weights,outputs);
-                A += avx_horizontal_sum(prod);
-                w += 8;
-                o += 8;
-            }
-            k += 8*psteps;
+        int psteps = units/8;
+        for (int x = 0; x < psteps; x++) {
+            __m256 weights = _mm256_loadu_ps(w);
+            __m256 outputs = _mm256_loadu_ps(o);
+            __m256 prod = _mm256_mul_ps(weights,outputs);
+            A += avx_horizontal_sum(prod);
+            w += 8;
+            o += 8;
+        }
+        k += 8*psteps;
 #endif
 
-            /* Handle final piece shorter than 16 bytes. */
-            for (; k < units; k++) {
-                float W = *w++;
-                float O = *o++;
-                A += W*O;
-            }
-            OUTPUT(net, i-1, j) = sigmoid(A);
+        /* Handle final piece shorter than 16 bytes. */
+        for (; k < units; k++) {
+            float W = *w++;
+            float O = *o++;
+            A += W*O;
         }
+        out[j] = scale ? sigmoid(A)*scale[j] : sigmoid(A);
+    }
+}
+
+void AnnSimulate(struct Ann *net) {
+    int i;
+
+    for (i = net->layers-1; i > 0; i--)
+        AnnSimulateLayer(net, i, net->layer[i].output, net->layer[i-1].output,
+                         i == 1 ? net->oscale : NULL);
+}
+
+/* Return the number of floats of scratch space AnnForward() needs in order
+ * to simulate the specified network. */
+size_t AnnScratchLen(struct Ann *net) {
+    size_t len = 0;
+    int j;
+
+    for (j = 0; j < LAYERS(net); j++) len += UNITS(net,j);
+    return len;
+}
+
+/* Simulate the net like AnnSimulate() does, but without touching the
+ * network itself: all the activations are stored in 'scratch', that must
+ * be at least AnnScratchLen() floats. This way the same network can be
+ * simulated by multiple threads at the same time, as long as each thread
+ * uses its own scratch space.
+ *
+ * 'input' is the vector of INPUT_UNITS() inputs. It is also valid for
+ * 'input' to point to 'scratch' itself, so that the caller can fill the
+ * inputs directly into the scratch space.
+ *
+ * The return value is a pointer to the OUTPUT_UNITS() outputs, that are
+ * stored inside the scratch space. */
+float *AnnForward(struct Ann *net, float *input, float *scratch) {
+    float *in = scratch, *out;
+    int i;
+
+    if (input != scratch)
+        memcpy(scratch, input, sizeof(float)*INPUT_UNITS(net));
+    in[INPUT_UNITS(net)] = 1; /* Bias unit. */
+    for (i = net->layers-1; i > 0; i--) {
+        out = in + UNITS(net,i);
+        if (i > 1) out[UNITS(net,i-1)-1] = 1; /* Bias unit. */
+        AnnSimulateLayer(net, i, in, out, i == 1 ? net->oscale : NULL);
+        in = out;
     }
+    return in;
 }
 
 /* Create a Tcl procedure that simulates the neural network */
@@ -648,14 +1042,69 @@ void AnnResetSgradient(struct Ann *net) {
     }
 }
 
-/* Set random weights in the range -0.05,+0.05 */
+/* Every net has its own PRNG, so that nets can be used by different
+ * threads, and the same seed always creates the same weights. The
+ * generator is xoshiro256**, seeded with splitmix64 as suggested by its
+ * authors. */
+static uint64_t AnnSplitMix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+void AnnSeed(struct Ann *net, uint64_t seed) {
+    for (int i = 0; i < 4; i++) net->rng[i] = AnnSplitMix64(&seed);
+}
+
+static inline uint64_t AnnRotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+/* Return a 64 bit pseudo random number. */
+uint64_t AnnRandom(struct Ann *net) {
+    uint64_t *s = net->rng;
+    uint64_t result = AnnRotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = AnnRotl(s[3], 45);
+    return result;
+}
+
+/* Return a pseudo random number in the [0,1) interval. */
+float AnnRandomFloat(struct Ann *net) {
+    return (AnnRandom(net) >> 40) * (1.0f/16777216.0f);
+}
+
+/* Set random weights, using the initialization method of every layer.
+ * With ANN_INIT_XAVIER and ANN_INIT_HE the range of the weights depends
+ * on the number of units, so that the variance of the activations is
+ * about the same in every layer, and bias weights start at zero. */
 void AnnSetRandomWeights(struct Ann *net) {
     int i, j, k;
 
     for (i = 1; i < LAYERS(net); i++) {
+        int fanin = UNITS(net, i);
+        int fanout = UNITS(net, i-1);
+        int init = net->layer[i].init;
+        float range;
+
+        switch(init) {
+        case ANN_INIT_XAVIER: range = sqrt(6.0/(fanin+fanout)); break;
+        case ANN_INIT_HE: range = sqrt(6.0/fanin); break;
+        default: range = 0.05; break;
+        }
         for (k = 0; k < UNITS(net, i-1); k++) {
             for (j = 0; j < UNITS(net, i); j++) {
-                WEIGHT(net,i,j,k) = -0.05+.1*(rand()/(RAND_MAX+1.0));
+                if (init != ANN_INIT_UNIFORM && j == fanin-1)
+                    WEIGHT(net,i,j,k) = 0; /* Bias. */
+                else
+                    WEIGHT(net,i,j,k) = -range+2*range*AnnRandomFloat(net);
             }
         }
     }
@@ -735,20 +1184,77 @@ void AnnAdjustWeightsResilientBP(struct Ann *net) {
     }
 }
 
-/* Resilient Backpropagation Epoch */
+static uint64_t AnnNanoseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+/* Mark the start of a profiled phase, returning its start time. The hook
+ * is called before reading the clock, so that its cost is not accounted
+ * to the phase. */
+static uint64_t AnnProfileEnter(struct AnnProfile *prof, int phase) {
+    if (prof->hook) prof->hook(prof,phase);
+    return AnnNanoseconds();
+}
+
+/* Mark the end of a profiled phase, returning its duration. */
+static uint64_t AnnProfileLeave(struct AnnProfile *prof, uint64_t start) {
+    uint64_t elapsed = AnnNanoseconds()-start;
+    if (prof->hook) prof->hook(prof,ANN_PHASE_NONE);
+    return elapsed;
+}
+
+/* Resilient Backpropagation Epoch
+ *
+ * If net->profile is not NULL the time spent in every phase is added to
+ * it. In order to keep the overhead low, the per sample phases are timed
+ * only for one sample every ANN_PROFILE_STRIDE, and scaled to the full
+ * set. The profile hook, if any, sees the same timed phases. */
 float AnnResilientBPEpoch(struct Ann *net, float *input, float *desired, int setlen) {
     float error = 0;
     int j, inputs = INPUT_UNITS(net), outputs = OUTPUT_UNITS(net);
+    struct AnnProfile *prof = net->profile;
+    uint64_t t = 0, forward = 0, backward = 0, accumulate = 0;
+    int timed = 0;
 
+    if (prof) t = AnnProfileEnter(prof,ANN_PHASE_UPDATE);
     AnnResetSgradient(net);
+    if (prof) prof->update_ns += AnnProfileLeave(prof,t);
     for (j = 0; j < setlen; j++) {
+        int profile = prof && j % ANN_PROFILE_STRIDE == 0;
+        if (profile) t = AnnProfileEnter(prof,ANN_PHASE_FORWARD);
         error += AnnSimulateError(net, input, desired);
+        if (profile) {
+            forward += AnnProfileLeave(prof,t);
+            t = AnnProfileEnter(prof,ANN_PHASE_BACKWARD);
+        }
         AnnCalculateGradients(net, desired);
+        if (profile) {
+            backward += AnnProfileLeave(prof,t);
+            t = AnnProfileEnter(prof,ANN_PHASE_ACCUMULATE);
+        }
         AnnUpdateSgradient(net);
+        if (profile) {
+            accumulate += AnnProfileLeave(prof,t);
+            timed++;
+        }
         input += inputs;
         desired += outputs;
     }
-    AnnAdjustWeightsResilientBP(net);
+    if (prof) {
+        t = AnnProfileEnter(prof,ANN_PHASE_UPDATE);
+        AnnAdjustWeightsResilientBP(net);
+        prof->update_ns += AnnProfileLeave(prof,t);
+        if (timed) {
+            double scale = (double)setlen/timed;
+            prof->forward_ns += forward*scale;
+            prof->backward_ns += backward*scale;
+            prof->accumulate_ns += accumulate*scale;
+        }
+    } else {
+        AnnAdjustWeightsResilientBP(net);
+    }
     return error / setlen;
 }
 
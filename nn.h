@@ -32,6 +32,8 @@
 #ifndef __NN_H
 #define __NN_H
 
+#include <stdint.h>
+
 /* Data structures.
  * Nets are not so 'dynamic', but enough to support
  * an arbitrary number of layers, with arbitrary units for layer.
@@ -49,6 +51,27 @@ struct AnnLayer {
 				/* (t-1 sgradient for resilient BP) */
 	float *delta;		/* delta[(i*units)+j] cumulative update */
 				/* (per-weight delta for RPROP) */
+	int init;		/* ANN_INIT_... weights initialization. */
+};
+
+/* Phases of the training, see AnnResilientBPEpoch(). */
+#define ANN_PHASE_NONE -1
+#define ANN_PHASE_FORWARD 0
+#define ANN_PHASE_BACKWARD 1
+#define ANN_PHASE_ACCUMULATE 2
+#define ANN_PHASE_UPDATE 3
+#define ANN_PHASES 4
+
+/* Time spent in the phases of the training, see AnnResilientBPEpoch(). */
+struct AnnProfile {
+	uint64_t forward_ns;	/* Forward pass and error computation. */
+	uint64_t backward_ns;	/* Gradients computation. */
+	uint64_t accumulate_ns;	/* Gradients accumulation (sgradient). */
+	uint64_t update_ns;	/* RPROP weights update. */
+	/* If not NULL, called when a profiled phase starts, and with
+	 * ANN_PHASE_NONE when it ends, out of the timed region. */
+	void (*hook)(struct AnnProfile *prof, int phase);
+	void *privdata;		/* For the hook. */
 };
 
 /* Feed forward network structure */
@@ -60,6 +83,12 @@ struct Ann {
 	float rprop_maxupdate;
 	float rprop_minupdate;
         float learn_rate; /* Used for GD training. */
+	int refcount;	/* See AnnRetain() / AnnRelease(). */
+	float *oscale;	/* If not NULL, outputs are multiplied by oscale[i]. */
+	uint64_t rng[4];	/* PRNG state, see AnnRandom(). */
+	void *region;	/* If not NULL, region holding the weights and */
+			/* oscale of a compiled net, see AnnCompile(). */
+	struct AnnProfile *profile; /* If not NULL, training time is added here. */
 	struct AnnLayer *layer;
 };
 
@@ -73,7 +102,7 @@ struct Ann {
 #define DELTA(net,l,i,j) (net)->layer[l].delta[((j)*(net)->layer[l].units)+(i)]
 #define LAYERS(net) (net)->layers
 #define UNITS(net,l) (net)->layer[l].units
-#define WEIGHTS(net,l) (UNITS(net,l)*UNITS(net,l-1))
+#define WEIGHTS(net,l) ((size_t)UNITS(net,l)*UNITS(net,l-1))
 #define OUTPUT_NODE(net,i) OUTPUT(net,0,i)
 #define INPUT_NODE(net,i) OUTPUT(net,((net)->layers)-1,i)
 #define OUTPUT_UNITS(net) UNITS(net,0)
@@ -93,24 +122,62 @@ struct Ann {
 #define DEFAULT_LEARN_RATE 0.1
 #define NN_ALGO_BPROP 0
 #define NN_ALGO_GD 1
+#define ANN_INIT_UNIFORM 0	/* Uniform in -0.05, 0.05. */
+#define ANN_INIT_XAVIER 1	/* Uniform, scaled by fan-in and fan-out. */
+#define ANN_INIT_HE 2		/* Uniform, scaled by fan-in. */
+#define ANN_PROFILE_STRIDE 16	/* Profile one sample every 16. */
+
+/* Floating point operations per weight of the training phases, in order
+ * to estimate the FLOPs of a network. The RPROP update is not counted,
+ * it is mostly comparisons, once per epoch. */
+#define ANN_FLOPS_FORWARD 2	/* Multiply and add. */
+#define ANN_FLOPS_BACKWARD 3	/* Gradient, and error back propagation. */
+#define ANN_FLOPS_ACCUMULATE 1	/* Sum of the gradients. */
+
+/* Read-mostly regions, see AnnAllocRegion(). */
+#define ANN_REGION_LINE 64			/* Cache line. */
+#define ANN_REGION_ALIGN_MIN (64*1024)		/* Page aligned from 64k. */
+#define ANN_REGION_HUGE_PAGE (2*1024*1024)	/* x86-64 huge page. */
+#define ANN_REGION_HUGE_MIN (32*1024*1024)	/* Huge page aligned from 32M. */
 
 /* Misc */
 #define MAX(a,b) (((a)>(b))?(a):(b))
 #define MIN(a,b) (((a)<(b))?(a):(b))
 
 /* Prototypes */
+void AnnSetAllocator(void *(*malloc_fn)(size_t), void (*free_fn)(void *));
+void *AnnAllocRegion(size_t size);
+void AnnFreeRegion(void *region);
+void *AnnReallocRegion(void *region, size_t keep, size_t size);
+size_t AnnRegionSize(void *region);
+size_t AnnRegionAllocSize(size_t size);
+void AnnRegionStats(size_t *count, size_t *bytes, size_t *huge);
 void AnnResetLayer(struct AnnLayer *layer);
 struct Ann *AnnAlloc(int layers);
 void AnnFreeLayer(struct AnnLayer *layer);
 void AnnFree(struct Ann *net);
+struct Ann *AnnRetain(struct Ann *net);
+void AnnRelease(struct Ann *net);
 int AnnInitLayer(struct Ann *net, int i, int units, int bias);
 struct Ann *AnnCreateNet(int layers, int *units);
+struct Ann *AnnCreateLayout(int layers, int *units);
 struct Ann *AnnCreateNet2(int iunits, int ounits);
 struct Ann *AnnCreateNet3(int iunits, int hunits, int ounits);
 struct Ann *AnnCreateNet4(int iunits, int hunits, int hunits2, int ounits);
 struct Ann *AnnClone(struct Ann* net);
+struct Ann *AnnCompile(struct Ann *net, float *ishift, float *iscale, float *oscale);
+void AnnCopyWeights(struct Ann *dst, struct Ann *src);
+size_t AnnWeightsBufferLen(struct Ann *net);
+void AnnSaveWeights(struct Ann *net, float *buf);
+void AnnLoadWeights(struct Ann *net, float *buf);
 size_t AnnCountWeights(struct Ann *net);
+size_t AnnMemoryUsage(struct Ann *net);
+size_t AnnLayoutMemoryUsage(struct Ann *net, int compiled);
+const char *AnnKernelName(void);
+int AnnVectorWidth(void);
 void AnnSimulate(struct Ann *net);
+size_t AnnScratchLen(struct Ann *net);
+float *AnnForward(struct Ann *net, float *input, float *scratch);
 void Ann2Tcl(struct Ann *net);
 void AnnPrint(struct Ann *net);
 float AnnGlobalError(struct Ann *net, float *desidered);
@@ -121,6 +188,9 @@ void AnnCalculateGradients(struct Ann *net, float *desidered);
 void AnnSetDeltas(struct Ann *net, float val);
 void AnnResetDeltas(struct Ann *net);
 void AnnResetSgradient(struct Ann *net);
+void AnnSeed(struct Ann *net, uint64_t seed);
+uint64_t AnnRandom(struct Ann *net);
+float AnnRandomFloat(struct Ann *net);
 void AnnSetRandomWeights(struct Ann *net);
 void AnnScaleWeights(struct Ann *net, float factor);
 void AnnUpdateDeltasGD(struct Ann *net);
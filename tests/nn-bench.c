@@ -0,0 +1,231 @@
+/* Micro benchmark of the nn.c kernels.
+ *
+ * Every kernel is timed on a matrix of network shapes and, for the training
+ * epoch, of batch sizes, reporting the time per sample, the GFLOP/s and the
+ * effective memory bandwidth. Flops and bytes are estimated from the number
+ * of weights each kernel touches, so the numbers are comparable across
+ * builds and implementations of the same kernel, not with other libraries.
+ *
+ * Usage: nn-bench [--json] [--quick] [--min-time <milliseconds>]
+ *
+ * With --json the results are emitted as a JSON object, so that they can be
+ * stored and compared by regression tracking scripts. The build name
+ * ("generic" or "avx") is part of the output. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../nn.h"
+
+#ifdef USE_AVX
+#define BENCH_BUILD "avx"
+#else
+#define BENCH_BUILD "generic"
+#endif
+
+#define BENCH_SEED 1234
+
+/* Network shapes, from input to output layer, 0 terminated. */
+static int BenchShapes[][5] = {
+    {4, 8, 3, 0},               /* Iris-like. */
+    {32, 64, 10, 0},
+    {128, 256, 128, 32, 0},
+    {300, 600, 100, 0},         /* Same as nn-benchmark.c. */
+    {784, 128, 64, 10, 0},      /* MNIST-like. */
+};
+#define BENCH_SHAPES (sizeof(BenchShapes)/sizeof(BenchShapes[0]))
+
+static int BenchBatches[] = {1, 32, 1024};
+#define BENCH_BATCHES (sizeof(BenchBatches)/sizeof(BenchBatches[0]))
+
+static long long BenchMinTime = 200; /* Milliseconds per measurement. */
+static int BenchJSON = 0;
+static int BenchResults = 0;
+
+uint64_t ustime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/* Create the network for the shape 'shape', with deterministic weights. */
+struct Ann *bench_create_net(int *shape, char *name, size_t namelen) {
+    int units[5], layers = 0;
+
+    while (shape[layers]) layers++;
+    for (int j = 0; j < layers; j++) units[j] = shape[layers-1-j];
+
+    name[0] = '\0';
+    for (int j = 0; j < layers; j++) {
+        size_t len = strlen(name);
+        snprintf(name+len, namelen-len, "%s%d", j ? "-" : "", shape[j]);
+    }
+
+    struct Ann *net = AnnCreateNet(layers, units);
+    AnnSeed(net, BENCH_SEED);
+    AnnSetRandomWeights(net);
+    return net;
+}
+
+/* Number of weights actually used by the network: the allocated matrices
+ * also contain a row for the bias unit of every hidden layer, that has no
+ * inputs. */
+double bench_used_weights(struct Ann *net) {
+    double w = 0;
+    for (int j = 1; j < LAYERS(net); j++)
+        w += (double)UNITS(net,j) * (UNITS(net,j-1) - (j-1 > 0));
+    return w;
+}
+
+/* Fill a dataset of 'len' samples with random inputs and one-hot outputs. */
+void bench_gen_dataset(struct Ann *net, float *inputs, float *outputs, int len) {
+    int ilen = INPUT_UNITS(net), olen = OUTPUT_UNITS(net);
+
+    for (int j = 0; j < len; j++) {
+        for (int k = 0; k < ilen; k++) inputs[k] = AnnRandomFloat(net);
+        int r = AnnRandom(net) % olen;
+        for (int k = 0; k < olen; k++) outputs[k] = (k == r);
+        inputs += ilen;
+        outputs += olen;
+    }
+}
+
+/* Emit one result. 'flops' and 'bytes' are per sample. */
+void bench_report(const char *kernel, const char *shape, int batch,
+                  double weights, uint64_t samples, uint64_t us,
+                  double flops, double bytes)
+{
+    double ns = (double)us*1000/samples;
+    double gflops = flops/ns;
+    double gbs = bytes/ns;
+
+    if (BenchJSON) {
+        printf("%s\n    {\"kernel\":\"%s\",\"shape\":\"%s\",\"batch\":%d,"
+               "\"weights\":%.0f,\"samples\":%llu,\"ns_per_sample\":%.2f,"
+               "\"gflops\":%.3f,\"gbytes_per_sec\":%.3f}",
+            BenchResults ? "," : "", kernel, shape, batch, weights,
+            (unsigned long long)samples, ns, gflops, gbs);
+    } else {
+        printf("%-28s %-18s %6d %14.2f %9.3f %9.3f\n",
+            kernel, shape, batch, ns, gflops, gbs);
+    }
+    BenchResults++;
+}
+
+/* Time the kernels on a network shape. */
+void bench_shape(int *shape) {
+    char name[64];
+    struct Ann *net = bench_create_net(shape, name, sizeof(name));
+    int ilen = INPUT_UNITS(net), olen = OUTPUT_UNITS(net);
+    int maxbatch = BenchBatches[BENCH_BATCHES-1];
+    float *inputs = malloc(sizeof(float)*ilen*maxbatch);
+    float *outputs = malloc(sizeof(float)*olen*maxbatch);
+    double w = bench_used_weights(net);
+    double wall = AnnCountWeights(net);
+    uint64_t start, elapsed, count;
+
+    bench_gen_dataset(net, inputs, outputs, maxbatch);
+
+    /* Forward pass: a multiply and an add per weight, and every weight
+     * is loaded once. */
+    count = 0;
+    start = ustime();
+    do {
+        AnnSetInput(net, inputs + (count % maxbatch)*ilen);
+        AnnSimulate(net);
+        count++;
+    } while ((elapsed = ustime()-start) < (uint64_t)BenchMinTime*1000);
+    bench_report("AnnSimulate", name, 1, w, count, elapsed, 2*w, 4*w);
+
+    /* Backward pass: the gradient is a multiply per weight, the error
+     * propagation a multiply and an add, weights are loaded and gradients
+     * stored. */
+    count = 0;
+    AnnSetInput(net, inputs);
+    AnnSimulate(net);
+    start = ustime();
+    do {
+        AnnCalculateGradients(net, outputs);
+        count++;
+    } while ((elapsed = ustime()-start) < (uint64_t)BenchMinTime*1000);
+    bench_report("AnnCalculateGradients", name, 1, w, count, elapsed,
+                 3*w, 8*w);
+
+    /* Gradients accumulation: an add per weight, two loads and a store. */
+    count = 0;
+    AnnResetSgradient(net);
+    start = ustime();
+    do {
+        AnnUpdateSgradient(net);
+        count++;
+    } while ((elapsed = ustime()-start) < (uint64_t)BenchMinTime*1000);
+    bench_report("AnnUpdateSgradient", name, 1, wall, count, elapsed,
+                 wall, 12*wall);
+
+    /* RPROP weights update, once per batch: about four operations per
+     * weight, four arrays loaded and three stored. The accumulated
+     * gradient is random, so that all the branches are exercised. */
+    for (int j = 1; j < LAYERS(net); j++) {
+        for (size_t k = 0; k < WEIGHTS(net,j); k++)
+            net->layer[j].sgradient[k] = AnnRandomFloat(net)-0.5;
+    }
+    count = 0;
+    start = ustime();
+    do {
+        AnnAdjustWeightsResilientBP(net);
+        count++;
+    } while ((elapsed = ustime()-start) < (uint64_t)BenchMinTime*1000);
+    bench_report("AnnAdjustWeightsResilientBP", name, 1, w, count, elapsed,
+                 4*w, 28*w);
+
+    /* Full epochs, where the update is amortized on the batch. */
+    for (size_t b = 0; b < BENCH_BATCHES; b++) {
+        int batch = BenchBatches[b];
+        count = 0;
+        start = ustime();
+        do {
+            AnnResilientBPEpoch(net, inputs, outputs, batch);
+            count += batch;
+        } while ((elapsed = ustime()-start) < (uint64_t)BenchMinTime*1000);
+        bench_report("AnnResilientBPEpoch", name, batch, w, count, elapsed,
+                     6*w+4*w/batch, 24*w+28*w/batch);
+    }
+
+    free(inputs);
+    free(outputs);
+    AnnFree(net);
+}
+
+int main(int argc, char **argv) {
+    size_t shapes = BENCH_SHAPES;
+
+    for (int j = 1; j < argc; j++) {
+        if (!strcmp(argv[j],"--json")) {
+            BenchJSON = 1;
+        } else if (!strcmp(argv[j],"--quick")) {
+            BenchMinTime = 20;
+            shapes = 3;
+        } else if (!strcmp(argv[j],"--min-time") && j+1 < argc) {
+            BenchMinTime = atoll(argv[++j]);
+        } else {
+            fprintf(stderr,
+                "Usage: %s [--json] [--quick] [--min-time <ms>]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if (BenchJSON) {
+        printf("{\n  \"build\":\"%s\",\n  \"min_time_ms\":%lld,\n"
+               "  \"results\":[", BENCH_BUILD, BenchMinTime);
+    } else {
+        printf("Build: %s\n\n", BENCH_BUILD);
+        printf("%-28s %-18s %6s %14s %9s %9s\n",
+            "kernel", "shape", "batch", "ns/sample", "GFLOP/s", "GB/s");
+    }
+    for (size_t j = 0; j < shapes; j++) bench_shape(BenchShapes[j]);
+    if (BenchJSON) printf("\n  ]\n}\n");
+    return 0;
+}
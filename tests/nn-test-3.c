@@ -0,0 +1,191 @@
+/* Differential test of the nn.c kernels.
+ *
+ * Random networks of many shapes are created, with unit counts that are
+ * often not a multiple of 8, so that both the vectorized loops and their
+ * scalar tails are exercised. For every network:
+ *
+ * 1. AnnSimulate(), AnnForward() and AnnCalculateGradients() are compared
+ *    with a plain scalar implementation, computed in double precision.
+ * 2. On small networks the back propagation gradients are compared with
+ *    the finite difference ones of AnnCalculateGradientsTrivial().
+ *
+ * The test is built both in the generic and in the AVX variant, and with
+ * "make check-sanitize" under AddressSanitizer and UBSan, see the Makefile.
+ * The exit code is non zero if any value is out of tolerance. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../nn.h"
+
+#define NETS 300            /* Random networks to test. */
+#define MAX_UNITS 40        /* Max units per layer, without bias. */
+#define GRADCHECK_MAX_WEIGHTS 400 /* Finite differences are O(weights^2). */
+
+static int Failures = 0;
+
+/* Check that 'got' is within an absolute tolerance 'abstol', plus a
+ * tolerance 'reltol' relative to the magnitude of 'expected'. */
+void check(const char *what, int netid, int l, int i, double got,
+           double expected, double abstol, double reltol)
+{
+    double err = fabs(got-expected);
+    if (err <= abstol + reltol*fabs(expected)) return;
+    if (Failures++ < 20) {
+        fprintf(stderr,"net %d: %s mismatch at layer %d index %d: "
+                       "got %.9g expected %.9g\n",
+                       netid, what, l, i, got, expected);
+    }
+}
+
+/* The reference scalar implementation: compute in 'out' the outputs of all
+ * the units of the network, with layers stored like in struct Ann, and in
+ * 'grad' the gradient of every weight, given the inputs already set in the
+ * network. */
+void reference(struct Ann *net, float *desired, double **out, double **err,
+               double **grad)
+{
+    int L = LAYERS(net);
+
+    for (int i = 0; i < UNITS(net,L-1); i++)
+        out[L-1][i] = INPUT_NODE(net,i);
+    for (int l = L-1; l > 0; l--) {
+        int units = UNITS(net,l);
+        int next = UNITS(net,l-1) - (l-1 != 0);
+        for (int j = 0; j < next; j++) {
+            double a = 0;
+            for (int i = 0; i < units; i++) a += WEIGHT(net,l,i,j)*out[l][i];
+            out[l-1][j] = 1/(1+exp(-a));
+        }
+        if (l-1 != 0) out[l-1][next] = 1; /* Bias. */
+    }
+
+    int ounits = OUTPUT_UNITS(net);
+    for (int j = 0; j < ounits; j++)
+        err[0][j] = 2.0/ounits*(out[0][j]-desired[j]);
+    for (int l = 0; l < L-1; l++) {
+        int units = UNITS(net,l) - (l != 0);
+        int prev = UNITS(net,l+1);
+        for (int i = 0; i < prev; i++) err[l+1][i] = 0;
+        for (int j = 0; j < units; j++) {
+            double signal = err[l][j]*out[l][j]*(1-out[l][j]);
+            for (int i = 0; i < prev; i++) {
+                grad[l+1][j*prev+i] = signal*out[l+1][i];
+                err[l+1][i] += signal*WEIGHT(net,l+1,i,j);
+            }
+        }
+    }
+}
+
+/* Return a random unit count, biased towards sizes around multiples of 8. */
+int random_units(void) {
+    if (rand() % 2) {
+        int base = 8*(1+rand()%4);
+        return base + rand()%3 - 1;
+    }
+    return 1+rand()%MAX_UNITS;
+}
+
+void test_net(int netid) {
+    int layers = 2+rand()%4, units[5];
+    for (int j = 0; j < layers; j++) units[j] = random_units();
+
+    struct Ann *net = AnnCreateNet(layers, units);
+    AnnSeed(net, netid);
+    net->layer[1].init = rand()%3;
+    AnnSetRandomWeights(net);
+    /* Larger weights than the default ones, so that the outputs are not
+     * all near 0.5 and the gradients are not tiny. */
+    AnnScaleWeights(net, 10);
+
+    int ilen = INPUT_UNITS(net), olen = OUTPUT_UNITS(net);
+    float *input = malloc(sizeof(float)*ilen);
+    float *desired = malloc(sizeof(float)*olen);
+    for (int j = 0; j < ilen; j++) input[j] = AnnRandomFloat(net)*2-1;
+    for (int j = 0; j < olen; j++) desired[j] = AnnRandomFloat(net);
+
+    double *out[5], *err[5], *grad[5];
+    for (int l = 0; l < layers; l++) {
+        out[l] = calloc(UNITS(net,l),sizeof(double));
+        err[l] = calloc(UNITS(net,l),sizeof(double));
+        grad[l] = l ? calloc(WEIGHTS(net,l),sizeof(double)) : NULL;
+    }
+
+    AnnSetInput(net, input);
+    AnnSimulate(net);
+    reference(net, desired, out, err, grad);
+
+    /* 1. Forward pass, in place and with scratch space. */
+    float *scratch = malloc(sizeof(float)*AnnScratchLen(net));
+    float *fwd = AnnForward(net, input, scratch);
+    for (int l = 0; l < layers-1; l++) {
+        int n = UNITS(net,l) - (l != 0);
+        for (int j = 0; j < n; j++) {
+            check("AnnSimulate output",netid,l,j,OUTPUT(net,l,j),
+                  out[l][j],1e-6,1e-5);
+        }
+    }
+    for (int j = 0; j < olen; j++)
+        check("AnnForward output",netid,0,j,fwd[j],out[0][j],1e-6,1e-5);
+
+    /* 2. Back propagation. */
+    AnnCalculateGradients(net, desired);
+    for (int l = 1; l < layers; l++) {
+        int rows = UNITS(net,l-1) - (l-1 != 0), cols = UNITS(net,l);
+        for (int j = 0; j < rows; j++) {
+            for (int i = 0; i < cols; i++) {
+                int idx = j*cols+i;
+                check("AnnCalculateGradients",netid,l,idx,
+                      net->layer[l].gradient[idx],grad[l][idx],1e-6,1e-5);
+            }
+        }
+    }
+
+    /* 3. Finite differences. AnnGlobalError() is half the sum of the
+     * squared errors, while back propagation uses the mean squared error,
+     * so the gradients differ by a factor of 2/outputs. The forward
+     * difference of a single precision error has an absolute noise of
+     * about 1e-4, hence the tolerance. */
+    if (AnnCountWeights(net) <= GRADCHECK_MAX_WEIGHTS) {
+        AnnCalculateGradientsTrivial(net, desired);
+        for (int l = 1; l < layers; l++) {
+            int rows = UNITS(net,l-1) - (l-1 != 0), cols = UNITS(net,l);
+            for (int j = 0; j < rows; j++) {
+                for (int i = 0; i < cols; i++) {
+                    int idx = j*cols+i;
+                    check("finite difference gradient",netid,l,idx,
+                          net->layer[l].gradient[idx]*2/olen,grad[l][idx],
+                          2e-4,0.05);
+                }
+            }
+        }
+    }
+
+    for (int l = 0; l < layers; l++) {
+        free(out[l]);
+        free(err[l]);
+        free(grad[l]);
+    }
+    free(scratch);
+    free(input);
+    free(desired);
+    AnnFree(net);
+}
+
+int main(void) {
+    srand(1234);
+    for (int j = 0; j < NETS; j++) test_net(j);
+#ifdef USE_AVX
+    const char *build = "avx";
+#else
+    const char *build = "generic";
+#endif
+    if (Failures) {
+        printf("%s: %d values out of tolerance\n", build, Failures);
+        return 1;
+    }
+    printf("%s: all %d networks OK\n", build, NETS);
+    return 0;
+}
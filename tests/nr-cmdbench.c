@@ -0,0 +1,256 @@
+/* In-process benchmark of the Neural Redis commands.
+ *
+ * The module is linked with the mock Redis modules API of
+ * redismodule-mock.c, and its commands are called directly, so that the
+ * time measured is only the one spent in the module, without network,
+ * event loop and client noise. For every command the latency distribution
+ * of the whole call, and of its parsing, execution and reply phases (see
+ * redismodule-mock.h for how phases are delimited), is reported.
+ *
+ * Usage: nr-cmdbench [--requests <count>] [--layout <in>,<hidden>,<out>]
+ *                    [--rows <count>] */
+
+#define _GNU_SOURCE /* memmem() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "redismodule-mock.h"
+
+#define MAX_ARGS 4096
+
+/* Latency samples of a command. */
+typedef struct bench {
+    const char *name;
+    uint64_t *parse, *exec, *reply, *total;
+    int count, size, errors;
+    size_t reply_bytes;
+} bench;
+
+static int Inputs = 10, Hidden = 20, Outputs = 3;
+
+void bench_init(bench *b, const char *name, int size) {
+    b->name = name;
+    b->parse = malloc(sizeof(uint64_t)*size);
+    b->exec = malloc(sizeof(uint64_t)*size);
+    b->reply = malloc(sizeof(uint64_t)*size);
+    b->total = malloc(sizeof(uint64_t)*size);
+    b->count = 0;
+    b->size = size;
+    b->errors = 0;
+    b->reply_bytes = 0;
+}
+
+void bench_free(bench *b) {
+    free(b->parse);
+    free(b->exec);
+    free(b->reply);
+    free(b->total);
+}
+
+/* Call the command, recording its timings in 'b'. */
+void bench_call(bench *b, int argc, const char **argv) {
+    MockCallStats st;
+
+    if (MockCommand(&st,argc,argv,NULL) != 0) {
+        fprintf(stderr,"Unknown command %s\n", argv[0]);
+        exit(1);
+    }
+    if (st.error && b->errors++ == 0) {
+        size_t len;
+        const char *reply = MockLastReply(&len);
+        fprintf(stderr,"%s: %.*s", b->name, (int)len, reply);
+    }
+    if (b->count == b->size) return;
+    b->parse[b->count] = st.parse_ns;
+    b->exec[b->count] = st.exec_ns;
+    b->reply[b->count] = st.reply_ns;
+    b->total[b->count] = st.total_ns;
+    b->reply_bytes += st.reply_len;
+    b->count++;
+}
+
+int cmp_uint64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* Sort the samples and print the distribution in microseconds. */
+void print_phase(const char *name, const char *phase, uint64_t *v, int count) {
+    double sum = 0;
+
+    qsort(v,count,sizeof(uint64_t),cmp_uint64);
+    for (int j = 0; j < count; j++) sum += v[j];
+    printf("%-16s %-6s %9.3f %9.3f %9.3f %9.3f %9.3f %10.3f\n",
+        name, phase, sum/count/1000,
+        v[count*50/100]/1000.0, v[count*90/100]/1000.0,
+        v[count*99/100]/1000.0, v[count*999/1000]/1000.0,
+        v[count-1]/1000.0);
+}
+
+void bench_report(bench *b) {
+    if (b->count == 0) return;
+    print_phase(b->name,"total",b->total,b->count);
+    print_phase("","parse",b->parse,b->count);
+    print_phase("","exec",b->exec,b->count);
+    print_phase("","reply",b->reply,b->count);
+    printf("%-16s %zu bytes per reply\n", "", b->reply_bytes/b->count);
+    if (b->errors) printf("%-16s %d errors\n", "", b->errors);
+}
+
+/* Fill argv[first...] with 'count' random numbers, formatted in 'buf'. */
+void random_args(const char **argv, int first, int count, char (*buf)[32]) {
+    for (int j = 0; j < count; j++) {
+        snprintf(buf[first+j],32,"%.6f",(double)rand()/RAND_MAX);
+        argv[first+j] = buf[first+j];
+    }
+}
+
+/* Wait for the training of 'key' to terminate. */
+void wait_training(const char *key) {
+    const char *argv[] = {"NR.INFO", key};
+    while (1) {
+        size_t len;
+        MockCommand(NULL,2,argv,NULL);
+        const char *reply = MockLastReply(&len);
+        if (memmem(reply,len,"+training\r\n:0",13)) break;
+        usleep(1000);
+    }
+}
+
+int main(int argc, char **argv) {
+    int requests = 100000, rows = 32;
+    static char buf[MAX_ARGS][32];
+    static const char *args[MAX_ARGS];
+    char layout[3][32];
+
+    for (int j = 1; j < argc; j++) {
+        if (!strcmp(argv[j],"--requests") && j+1 < argc) {
+            requests = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--layout") && j+1 < argc) {
+            if (sscanf(argv[++j],"%d,%d,%d",&Inputs,&Hidden,&Outputs) != 3) {
+                fprintf(stderr,"Invalid layout\n");
+                exit(1);
+            }
+        } else if (!strcmp(argv[j],"--rows") && j+1 < argc) {
+            rows = atoi(argv[++j]);
+        } else {
+            fprintf(stderr,"Usage: %s [--requests <count>] "
+                "[--layout <in>,<hidden>,<out>] [--rows <count>]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (requests <= 0 || rows <= 0 || Inputs <= 0 || Hidden <= 0 ||
+        Outputs <= 0 || Inputs*rows+4 > MAX_ARGS)
+    {
+        fprintf(stderr,"Invalid parameters\n");
+        exit(1);
+    }
+
+    if (MockLoadModule(0,NULL) != 0) {
+        fprintf(stderr,"Error loading the module\n");
+        exit(1);
+    }
+    srand(1234);
+    snprintf(layout[0],32,"%d",Inputs);
+    snprintf(layout[1],32,"%d",Hidden);
+    snprintf(layout[2],32,"%d",Outputs);
+
+    bench create, observe, run, class, runrows, runkey, train, info;
+    int creates = requests/100 ? requests/100 : 1;
+    int trains = requests/1000 ? requests/1000 : 1;
+    bench_init(&create,"NR.CREATE",creates);
+    bench_init(&observe,"NR.OBSERVE",requests);
+    bench_init(&run,"NR.RUN",requests);
+    bench_init(&class,"NR.CLASS",requests);
+    bench_init(&runrows,"NR.RUN ROWS",requests);
+    bench_init(&runkey,"NR.RUNKEY",requests);
+    bench_init(&train,"NR.TRAIN",trains);
+    bench_init(&info,"NR.INFO",requests);
+
+    /* NR.CREATE, on different keys. */
+    for (int j = 0; j < creates; j++) {
+        char key[32];
+        snprintf(key,sizeof(key),"net:%d",j);
+        const char *a[] = {"NR.CREATE", key, "CLASSIFIER", layout[0],
+            layout[1], "->", layout[2], "NORMALIZE", "DATASET", "1000",
+            "TEST", "500"};
+        bench_call(&create,12,a);
+    }
+
+    /* NR.OBSERVE, filling the datasets and then replacing samples. The
+     * network is a classifier, so the output is the class ID. */
+    for (int j = 0; j < requests; j++) {
+        args[0] = "NR.OBSERVE";
+        args[1] = "net:0";
+        random_args(args,2,Inputs,buf);
+        args[2+Inputs] = "->";
+        snprintf(buf[3+Inputs],32,"%d",rand() % Outputs);
+        args[3+Inputs] = buf[3+Inputs];
+        bench_call(&observe,4+Inputs,args);
+    }
+
+    /* NR.TRAIN. Only the time to start the training is measured, since
+     * the training itself runs in a thread. */
+    for (int j = 0; j < trains; j++) {
+        const char *a[] = {"NR.TRAIN", "net:0", "MAXCYCLES", "10"};
+        bench_call(&train,4,a);
+        wait_training("net:0");
+    }
+
+    /* Inference. */
+    for (int j = 0; j < requests; j++) {
+        args[1] = "net:0";
+        random_args(args,2,Inputs,buf);
+        args[0] = "NR.RUN";
+        bench_call(&run,2+Inputs,args);
+        args[0] = "NR.CLASS";
+        bench_call(&class,2+Inputs,args);
+    }
+
+    char rowsbuf[32];
+    snprintf(rowsbuf,sizeof(rowsbuf),"%d",rows);
+    for (int j = 0; j < requests; j++) {
+        args[0] = "NR.RUN";
+        args[1] = "net:0";
+        args[2] = "ROWS";
+        args[3] = rowsbuf;
+        random_args(args,4,Inputs*rows,buf);
+        bench_call(&runrows,4+Inputs*rows,args);
+    }
+
+    /* NR.RUNKEY, reading a row of packed floats from a string key. */
+    float *packed = malloc(sizeof(float)*Inputs);
+    for (int j = 0; j < Inputs; j++) packed[j] = (float)rand()/RAND_MAX;
+    const char *set[] = {"SET", "input:0", (char*)packed};
+    size_t setlen[] = {3, 7, sizeof(float)*Inputs};
+    MockCommand(NULL,3,set,setlen);
+    free(packed);
+    for (int j = 0; j < requests; j++) {
+        const char *a[] = {"NR.RUNKEY", "net:0", "input:0"};
+        bench_call(&runkey,3,a);
+    }
+
+    for (int j = 0; j < requests; j++) {
+        const char *a[] = {"NR.INFO", "net:0"};
+        bench_call(&info,2,a);
+    }
+
+    printf("Layout %d -> %d -> %d, %d requests, NR.RUN ROWS %d\n\n",
+        Inputs, Hidden, Outputs, requests, rows);
+    printf("%-16s %-6s %9s %9s %9s %9s %9s %10s\n", "command", "phase",
+        "avg(us)", "p50", "p90", "p99", "p99.9", "max");
+    bench *all[] = {&create, &observe, &train, &run, &class, &runrows,
+                    &runkey, &info};
+    for (size_t j = 0; j < sizeof(all)/sizeof(all[0]); j++) {
+        bench_report(all[j]);
+        bench_free(all[j]);
+    }
+    printf("\n%llu commands propagated to replicas / AOF.\n",
+        (unsigned long long)MockReplicated());
+    MockFlushAll();
+    return 0;
+}
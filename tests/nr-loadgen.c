@@ -0,0 +1,892 @@
+/* End to end load generator for Neural Redis.
+ *
+ * Replays the datasets bundled in the examples directory against a running
+ * redis-server with the module loaded, as the Ruby examples do, but with
+ * pipelining and multiple connections, so that it can be used as a
+ * performance regression suite before upgrading. For every dataset:
+ *
+ * 1. The network is created like in the corresponding example.
+ * 2. The dataset is loaded with pipelined NR.OBSERVE commands.
+ * 3. The network is trained with NR.TRAIN AUTOSTOP BACKTRACK, polling
+ *    NR.INFO in order to measure the time to the target accuracy.
+ * 4. The dataset is replayed with pipelined NR.CLASS commands, measuring
+ *    the accuracy of the predictions.
+ *
+ * For the load phases the throughput and latency percentiles are reported,
+ * while a monitoring connection samples the server RSS via INFO memory.
+ * MNIST images are not bundled (only the labels are), so that dataset is
+ * only used if the images file is found in the mnist-data directory.
+ *
+ * Usage: nr-loadgen [--host <ip>] [--port <port>] [--clients <count>]
+ *                   [--pipeline <count>] [--requests <count>]
+ *                   [--datasets iris,titanic,sentiment,mnist]
+ *                   [--examples <dir>] [--train-ms <ms>] [--target <perc>]
+ *                   [--json] */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_RSS_SAMPLES 100000
+
+static const char *Host = "127.0.0.1";
+static int Port = 6379;
+static int Clients = 4;
+static int Pipeline = 32;
+static int Requests = 20000;        /* NR.CLASS commands per dataset. */
+static long long TrainMs = 10000;
+static double Target = 0;           /* 0 means the dataset default. */
+static const char *Examples = "../examples";
+static int JSON = 0;
+
+static uint64_t ustime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static void *zmalloc(size_t size) {
+    void *p = malloc(size);
+    if (p == NULL) {
+        fprintf(stderr,"Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void *zrealloc(void *ptr, size_t size) {
+    void *p = realloc(ptr,size);
+    if (p == NULL) {
+        fprintf(stderr,"Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+/* ============================== RESP client =============================== */
+
+typedef struct buffer {
+    char *p;
+    size_t len, size;
+} buffer;
+
+static void bufAppend(buffer *b, const void *p, size_t len) {
+    if (b->len+len > b->size) {
+        b->size = (b->len+len)*2;
+        b->p = zrealloc(b->p,b->size);
+    }
+    memcpy(b->p+b->len,p,len);
+    b->len += len;
+}
+
+static void bufPrintf(buffer *b, const char *fmt, ...) {
+    char tmp[64];
+    va_list ap;
+    va_start(ap,fmt);
+    int len = vsnprintf(tmp,sizeof(tmp),fmt,ap);
+    va_end(ap);
+    bufAppend(b,tmp,len);
+}
+
+/* Append a command to 'b', encoded as a RESP array of bulk strings. */
+static void bufCommand(buffer *b, int argc, const char **argv) {
+    bufPrintf(b,"*%d\r\n",argc);
+    for (int j = 0; j < argc; j++) {
+        size_t len = strlen(argv[j]);
+        bufPrintf(b,"$%zu\r\n",len);
+        bufAppend(b,argv[j],len);
+        bufAppend(b,"\r\n",2);
+    }
+}
+
+typedef struct conn {
+    int fd;
+    char *buf;          /* Read buffer. */
+    size_t len, pos, size;
+} conn;
+
+typedef struct reply {
+    char type;          /* One of + - : $ * */
+    long long integer;
+    char *str;          /* For + - and $, NULL for null bulks. */
+    size_t len;
+    struct reply **element;
+    size_t elements;
+} reply;
+
+static conn *connConnect(void) {
+    struct addrinfo hints, *res;
+    char port[16];
+
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port,sizeof(port),"%d",Port);
+    if (getaddrinfo(Host,port,&hints,&res) != 0) {
+        fprintf(stderr,"Can't resolve %s\n", Host);
+        exit(1);
+    }
+    int fd = socket(res->ai_family,res->ai_socktype,res->ai_protocol);
+    if (fd == -1 || connect(fd,res->ai_addr,res->ai_addrlen) == -1) {
+        fprintf(stderr,"Can't connect to %s:%d: %s\n", Host, Port,
+            strerror(errno));
+        exit(1);
+    }
+    freeaddrinfo(res);
+    int yes = 1;
+    setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&yes,sizeof(yes));
+
+    conn *c = zmalloc(sizeof(*c));
+    c->fd = fd;
+    c->size = 1024*64;
+    c->buf = zmalloc(c->size);
+    c->len = c->pos = 0;
+    return c;
+}
+
+static void connClose(conn *c) {
+    close(c->fd);
+    free(c->buf);
+    free(c);
+}
+
+static void connWrite(conn *c, const char *p, size_t len) {
+    while (len) {
+        ssize_t n = write(c->fd,p,len);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) continue;
+            fprintf(stderr,"Error writing to the server\n");
+            exit(1);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+/* Make sure at least 'need' unread bytes are in the buffer. */
+static void connFill(conn *c, size_t need) {
+    if (c->len-c->pos >= need) return;
+    if (c->pos) {
+        memmove(c->buf,c->buf+c->pos,c->len-c->pos);
+        c->len -= c->pos;
+        c->pos = 0;
+    }
+    while (c->len < need) {
+        if (c->size-c->len < 4096 || need > c->size) {
+            c->size = (need > c->size*2) ? need : c->size*2;
+            c->buf = zrealloc(c->buf,c->size);
+        }
+        ssize_t n = read(c->fd,c->buf+c->len,c->size-c->len);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) continue;
+            fprintf(stderr,"Connection closed by the server\n");
+            exit(1);
+        }
+        c->len += n;
+    }
+}
+
+/* Read a line terminated by CRLF, returning a pointer to it inside the
+ * buffer, valid until the next read. */
+static char *connReadLine(conn *c, size_t *len) {
+    size_t need = 2;
+    while (1) {
+        connFill(c,need);
+        char *p = c->buf+c->pos, *nl;
+        nl = memmem(p,c->len-c->pos,"\r\n",2);
+        if (nl) {
+            *len = nl-p;
+            *nl = '\0';
+            c->pos += *len+2;
+            return p;
+        }
+        need = c->len-c->pos+1;
+    }
+}
+
+static reply *connReadReply(conn *c) {
+    size_t len;
+    char *line = connReadLine(c,&len);
+    reply *r = calloc(1,sizeof(*r));
+
+    r->type = line[0];
+    switch(r->type) {
+    case '+': case '-':
+        r->str = strdup(line+1);
+        r->len = len-1;
+        break;
+    case ':':
+        r->integer = strtoll(line+1,NULL,10);
+        break;
+    case '$': {
+        long long blen = strtoll(line+1,NULL,10);
+        if (blen < 0) break;
+        connFill(c,blen+2);
+        r->str = zmalloc(blen+1);
+        memcpy(r->str,c->buf+c->pos,blen);
+        r->str[blen] = '\0';
+        r->len = blen;
+        c->pos += blen+2;
+        break;
+    }
+    case '*': {
+        long long n = strtoll(line+1,NULL,10);
+        if (n <= 0) break;
+        r->elements = n;
+        r->element = zmalloc(sizeof(reply*)*n);
+        for (long long j = 0; j < n; j++) r->element[j] = connReadReply(c);
+        break;
+    }
+    default:
+        fprintf(stderr,"Protocol error\n");
+        exit(1);
+    }
+    return r;
+}
+
+static void freeReply(reply *r) {
+    for (size_t j = 0; j < r->elements; j++) freeReply(r->element[j]);
+    free(r->element);
+    free(r->str);
+    free(r);
+}
+
+/* Send a command and wait for its reply. */
+static reply *connCommand(conn *c, int argc, const char **argv) {
+    buffer b = {NULL,0,0};
+    bufCommand(&b,argc,argv);
+    connWrite(c,b.p,b.len);
+    free(b.p);
+    return connReadReply(c);
+}
+
+/* Return the value of 'field' in a reply made of field/value pairs, like
+ * the one of NR.INFO, or NULL. */
+static reply *replyField(reply *r, const char *field) {
+    for (size_t j = 0; j+1 < r->elements; j += 2) {
+        if (r->element[j]->str && !strcmp(r->element[j]->str,field))
+            return r->element[j+1];
+    }
+    return NULL;
+}
+
+/* ================================ Datasets ================================ */
+
+typedef struct dataset {
+    const char *name;
+    int inputs, classes, hidden;
+    int maxlen, testlen;        /* NR.CREATE DATASET and TEST. */
+    int normalize;
+    double target;              /* Default target accuracy, percentage. */
+    int count;                  /* Number of samples. */
+    float *x;                   /* count*inputs values. */
+    int *y;                     /* count labels. */
+} dataset;
+
+static void dsAdd(dataset *ds, float *x, int y) {
+    ds->x = zrealloc(ds->x,sizeof(float)*ds->inputs*(ds->count+1));
+    ds->y = zrealloc(ds->y,sizeof(int)*(ds->count+1));
+    memcpy(ds->x+(size_t)ds->count*ds->inputs,x,sizeof(float)*ds->inputs);
+    ds->y[ds->count++] = y;
+}
+
+/* Split a CSV line in fields, handling quoted fields. Returns the number
+ * of fields. The line is modified in place. */
+static int csvSplit(char *line, char **fields, int max) {
+    int n = 0;
+    char *p = line;
+
+    while (n < max) {
+        if (*p == '"') {
+            fields[n++] = ++p;
+            while (*p && !(*p == '"' && p[1] != '"')) p += (*p == '"') ? 2 : 1;
+            if (*p) *p++ = '\0';
+        } else {
+            fields[n++] = p;
+        }
+        p += strcspn(p,",\r\n");
+        if (*p != ',') {
+            *p = '\0';
+            break;
+        }
+        *p++ = '\0';
+    }
+    return n;
+}
+
+static FILE *openExample(const char *name) {
+    char path[1024];
+    snprintf(path,sizeof(path),"%s/%s",Examples,name);
+    return fopen(path,"r");
+}
+
+/* id,sepal length,sepal width,petal length,petal width,class */
+static int loadIris(dataset *ds) {
+    FILE *fp = openExample("Iris.csv");
+    char line[1024], *f[8];
+    if (fp == NULL) return -1;
+    while (fgets(line,sizeof(line),fp)) {
+        if (csvSplit(line,f,8) != 6) continue;
+        float x[4];
+        for (int j = 0; j < 4; j++) x[j] = atof(f[j+1]);
+        dsAdd(ds,x,atoi(f[5]));
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* PassengerId,Survived,Pclass,Name,Sex,Age,SibSp,Parch,Ticket,Fare,...
+ * Inputs are encoded like in titanic.rb. */
+static int loadTitanic(dataset *ds) {
+    FILE *fp = openExample("titanic.csv");
+    char line[4096], *f[16];
+    if (fp == NULL) return -1;
+    while (fgets(line,sizeof(line),fp)) {
+        if (csvSplit(line,f,16) < 10) continue;
+        int pclass = atoi(f[2]);
+        if (pclass < 1 || pclass > 3) continue;
+        float x[9] = {0};
+        x[pclass-1] = 1;
+        x[3] = !strcmp(f[4],"male");
+        x[4] = !strcmp(f[4],"female");
+        x[5] = f[5][0] ? atof(f[5]) : 30; /* Average age if missing. */
+        x[6] = atof(f[6]);
+        x[7] = atof(f[7]);
+        x[8] = atof(f[9]);
+        dsAdd(ds,x,atoi(f[1]) == 1);
+    }
+    fclose(fp);
+    return 0;
+}
+
+static uint32_t crc32(const char *p, size_t len) {
+    static uint32_t table[256];
+    if (table[1] == 0) {
+        for (uint32_t j = 0; j < 256; j++) {
+            uint32_t c = j;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+            table[j] = c;
+        }
+    }
+    uint32_t crc = 0xffffffff;
+    while (len--) crc = table[(crc ^ (unsigned char)*p++) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffff;
+}
+
+/* Map a review to the inputs, hashing words and pairs of words like
+ * sentiment.rb does. */
+static void sentimentInputs(dataset *ds, FILE *fp, float *x) {
+    char line[65536], *words[8192];
+    int half = ds->inputs/2;
+    double sum = 0;
+
+    memset(x,0,sizeof(float)*ds->inputs);
+    while (fgets(line,sizeof(line),fp)) {
+        int n = 0;
+        for (char *p = line; *p; p++) {
+            if (!((*p >= 'a' && *p <= 'z') || *p == ',' || *p == '!'))
+                *p = ' ';
+        }
+        for (char *w = strtok(line," "); w && n < 8192; w = strtok(NULL," "))
+            words[n++] = w;
+        for (int j = 0; j < n; j++) {
+            x[crc32(words[j],strlen(words[j])) % half]++;
+            sum++;
+        }
+        for (int j = 0; j < n-1; j++) {
+            char pair[1024];
+            if (!strcmp(words[j+1],",") || !strcmp(words[j+1],"!")) continue;
+            int len = snprintf(pair,sizeof(pair),"%s.%s",words[j],words[j+1]);
+            if (len >= (int)sizeof(pair)) continue;
+            x[half + crc32(pair,len) % half]++;
+            sum++;
+        }
+    }
+    if (sum == 0) sum = 1;
+    for (int j = 0; j < ds->inputs; j++) x[j] /= sum;
+}
+
+static int loadSentiment(dataset *ds) {
+    const char *dirs[2] = {"neg", "pos"};
+    float *x = zmalloc(sizeof(float)*ds->inputs);
+
+    for (int label = 0; label < 2; label++) {
+        char path[1024];
+        snprintf(path,sizeof(path),"%s/sentiment/txt_sentoken/%s",
+            Examples,dirs[label]);
+        DIR *dir = opendir(path);
+        if (dir == NULL) {
+            free(x);
+            return -1;
+        }
+        struct dirent *de;
+        while ((de = readdir(dir)) != NULL) {
+            char file[2048];
+            if (de->d_name[0] == '.') continue;
+            snprintf(file,sizeof(file),"%s/%s",path,de->d_name);
+            FILE *fp = fopen(file,"r");
+            if (fp == NULL) continue;
+            sentimentInputs(ds,fp,x);
+            fclose(fp);
+            dsAdd(ds,x,label);
+        }
+        closedir(dir);
+    }
+    free(x);
+    return 0;
+}
+
+/* The IDX files of the MNIST database. */
+static int loadMnist(dataset *ds) {
+    FILE *fi = openExample("mnist-data/train-images-idx3-ubyte");
+    FILE *fl = openExample("mnist-data/train-labels-idx1-ubyte");
+    unsigned char pixels[28*28];
+    float x[28*28];
+    int label;
+
+    if (fi == NULL || fl == NULL) {
+        if (fi) fclose(fi);
+        if (fl) fclose(fl);
+        return -1;
+    }
+    fseek(fi,16,SEEK_SET);
+    fseek(fl,8,SEEK_SET);
+    while (ds->count < ds->maxlen+ds->testlen &&
+           fread(pixels,sizeof(pixels),1,fi) == 1 &&
+           (label = fgetc(fl)) != EOF)
+    {
+        for (int j = 0; j < 28*28; j++) x[j] = pixels[j];
+        dsAdd(ds,x,label);
+    }
+    fclose(fi);
+    fclose(fl);
+    return 0;
+}
+
+static struct {
+    dataset ds;
+    int (*load)(dataset *ds);
+} Datasets[] = {
+    {{"iris", 4, 3, 15, 1000, 500, 1, 90, 0, NULL, NULL}, loadIris},
+    {{"titanic", 9, 2, 15, 1000, 500, 1, 75, 0, NULL, NULL}, loadTitanic},
+    {{"sentiment", 3000, 2, 50, 1400, 600, 0, 70, 0, NULL, NULL},
+        loadSentiment},
+    {{"mnist", 28*28, 10, 100, 60000, 10000, 1, 90, 0, NULL, NULL},
+        loadMnist},
+};
+#define NUM_DATASETS (sizeof(Datasets)/sizeof(Datasets[0]))
+
+/* ============================== Load phases =============================== */
+
+/* Commands to replay, already encoded, with the expected class if the
+ * reply is checked. */
+typedef struct workload {
+    buffer *cmds;
+    int *expected;
+    int count;
+} workload;
+
+typedef struct worker {
+    pthread_t tid;
+    workload *w;
+    int first, count;           /* Commands to send. */
+    uint64_t *latency;          /* Microseconds, one for each command. */
+    int errors, correct;
+} worker;
+
+static void *workerMain(void *arg) {
+    worker *wk = arg;
+    conn *c = connConnect();
+    buffer b = {NULL,0,0};
+
+    for (int j = 0; j < wk->count; j += Pipeline) {
+        int batch = (wk->count-j < Pipeline) ? wk->count-j : Pipeline;
+        b.len = 0;
+        for (int k = 0; k < batch; k++) {
+            buffer *cmd = &wk->w->cmds[(wk->first+j+k) % wk->w->count];
+            bufAppend(&b,cmd->p,cmd->len);
+        }
+        uint64_t start = ustime();
+        connWrite(c,b.p,b.len);
+        for (int k = 0; k < batch; k++) {
+            int idx = (wk->first+j+k) % wk->w->count;
+            reply *r = connReadReply(c);
+            wk->latency[j+k] = ustime()-start;
+            if (r->type == '-') {
+                if (wk->errors++ == 0) fprintf(stderr,"Error: %s\n",r->str);
+            } else if (wk->w->expected && r->type == ':' &&
+                       r->integer == wk->w->expected[idx]) {
+                wk->correct++;
+            }
+            freeReply(r);
+        }
+    }
+    free(b.p);
+    connClose(c);
+    return NULL;
+}
+
+typedef struct phaseStats {
+    int count, errors, correct;
+    double seconds;
+    double avg, p50, p90, p99, p999, max; /* Milliseconds. */
+} phaseStats;
+
+static int cmpUint64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* Send 'total' commands of the workload, cycling over it, using Clients
+ * connections. */
+static phaseStats runWorkload(workload *w, int total) {
+    worker *wk = zmalloc(sizeof(worker)*Clients);
+    uint64_t *lat = zmalloc(sizeof(uint64_t)*(total ? total : 1));
+    phaseStats ps;
+
+    memset(&ps,0,sizeof(ps));
+    uint64_t start = ustime();
+    int first = 0;
+    for (int j = 0; j < Clients; j++) {
+        wk[j].w = w;
+        wk[j].first = first;
+        wk[j].count = total/Clients + (j < total%Clients);
+        wk[j].latency = lat+first;
+        wk[j].errors = wk[j].correct = 0;
+        first += wk[j].count;
+        pthread_create(&wk[j].tid,NULL,workerMain,&wk[j]);
+    }
+    for (int j = 0; j < Clients; j++) {
+        pthread_join(wk[j].tid,NULL);
+        ps.errors += wk[j].errors;
+        ps.correct += wk[j].correct;
+    }
+    ps.seconds = (double)(ustime()-start)/1e6;
+    ps.count = total;
+
+    if (total) {
+        double sum = 0;
+        qsort(lat,total,sizeof(uint64_t),cmpUint64);
+        for (int j = 0; j < total; j++) sum += lat[j];
+        ps.avg = sum/total/1000;
+        ps.p50 = lat[total*50/100]/1000.0;
+        ps.p90 = lat[total*90/100]/1000.0;
+        ps.p99 = lat[total*99/100]/1000.0;
+        ps.p999 = lat[total*999/1000]/1000.0;
+        ps.max = lat[total-1]/1000.0;
+    }
+    free(lat);
+    free(wk);
+    return ps;
+}
+
+/* Encode an NR.OBSERVE (or NR.CLASS if 'observe' is false) command for
+ * every sample of the dataset. */
+static workload buildWorkload(dataset *ds, const char *key, int observe) {
+    workload w;
+    const char **argv = zmalloc(sizeof(char*)*(ds->inputs+4));
+    char (*num)[32] = zmalloc(32*(ds->inputs+1));
+
+    w.count = ds->count;
+    w.cmds = calloc(ds->count,sizeof(buffer));
+    w.expected = observe ? NULL : zmalloc(sizeof(int)*ds->count);
+    for (int j = 0; j < ds->count; j++) {
+        int argc = 0;
+        argv[argc++] = observe ? "NR.OBSERVE" : "NR.CLASS";
+        argv[argc++] = key;
+        for (int k = 0; k < ds->inputs; k++) {
+            snprintf(num[k],32,"%.9g",ds->x[(size_t)j*ds->inputs+k]);
+            argv[argc++] = num[k];
+        }
+        if (observe) {
+            argv[argc++] = "->";
+            snprintf(num[ds->inputs],32,"%d",ds->y[j]);
+            argv[argc++] = num[ds->inputs];
+        } else {
+            w.expected[j] = ds->y[j];
+        }
+        bufCommand(&w.cmds[j],argc,argv);
+    }
+    free(argv);
+    free(num);
+    return w;
+}
+
+static void freeWorkload(workload *w) {
+    for (int j = 0; j < w->count; j++) free(w->cmds[j].p);
+    free(w->cmds);
+    free(w->expected);
+}
+
+/* ================================ RSS monitor ============================== */
+
+static struct {
+    pthread_t tid;
+    pthread_mutex_t lock;
+    volatile int stop;
+    uint64_t start;
+    uint64_t *ms, *rss;         /* Samples: time and RSS in bytes. */
+    int count;
+} Monitor = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void *monitorMain(void *arg) {
+    conn *c = connConnect();
+    const char *argv[] = {"INFO", "memory"};
+    (void)arg;
+
+    while (!Monitor.stop && Monitor.count < MAX_RSS_SAMPLES) {
+        reply *r = connCommand(c,2,argv);
+        char *p = r->str ? strstr(r->str,"used_memory_rss:") : NULL;
+        if (p) {
+            pthread_mutex_lock(&Monitor.lock);
+            Monitor.ms[Monitor.count] = (ustime()-Monitor.start)/1000;
+            Monitor.rss[Monitor.count] = strtoull(p+16,NULL,10);
+            Monitor.count++;
+            pthread_mutex_unlock(&Monitor.lock);
+        }
+        freeReply(r);
+        usleep(250000);
+    }
+    connClose(c);
+    return NULL;
+}
+
+/* Return the peak RSS sampled since sample 'from'. */
+static uint64_t monitorPeak(int from) {
+    uint64_t peak = 0;
+    pthread_mutex_lock(&Monitor.lock);
+    for (int j = from; j < Monitor.count; j++)
+        if (Monitor.rss[j] > peak) peak = Monitor.rss[j];
+    pthread_mutex_unlock(&Monitor.lock);
+    return peak;
+}
+
+static int monitorCount(void) {
+    pthread_mutex_lock(&Monitor.lock);
+    int count = Monitor.count;
+    pthread_mutex_unlock(&Monitor.lock);
+    return count;
+}
+
+/* ================================== Main ================================== */
+
+static void printPhase(const char *dsname, const char *phase, phaseStats *ps,
+                       int *first)
+{
+    double rps = ps->seconds > 0 ? ps->count/ps->seconds : 0;
+    if (JSON) {
+        printf("%s\n    {\"dataset\":\"%s\",\"phase\":\"%s\",\"requests\":%d,"
+               "\"errors\":%d,\"seconds\":%.3f,\"rps\":%.1f,"
+               "\"latency_ms\":{\"avg\":%.3f,\"p50\":%.3f,\"p90\":%.3f,"
+               "\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}}",
+               *first ? "" : ",", dsname, phase, ps->count, ps->errors,
+               ps->seconds, rps, ps->avg, ps->p50, ps->p90, ps->p99,
+               ps->p999, ps->max);
+        *first = 0;
+    } else {
+        printf("  %-10s %8d requests %10.1f req/s  latency ms: avg %.3f "
+               "p50 %.3f p90 %.3f p99 %.3f p99.9 %.3f max %.3f\n",
+               phase, ps->count, rps, ps->avg, ps->p50, ps->p90, ps->p99,
+               ps->p999, ps->max);
+        if (ps->errors) printf("  %-10s %d errors\n", "", ps->errors);
+    }
+}
+
+/* Train the network, returning the training time, and setting '*reached'
+ * to the time the target accuracy was reached, or -1. Times in seconds. */
+static double train(conn *c, const char *key, double target, double *reached,
+                    double *accuracy)
+{
+    char maxtime[32];
+    snprintf(maxtime,sizeof(maxtime),"%lld",TrainMs);
+    const char *argv[] = {"NR.TRAIN", key, "AUTOSTOP", "BACKTRACK",
+                          "MAXTIME", maxtime};
+    const char *info[] = {"NR.INFO", key};
+
+    *reached = -1;
+    *accuracy = 0;
+    uint64_t start = ustime();
+    reply *r = connCommand(c,6,argv);
+    if (r->type == '-') fprintf(stderr,"NR.TRAIN: %s\n", r->str);
+    freeReply(r);
+
+    while (1) {
+        r = connCommand(c,2,info);
+        reply *training = replyField(r,"training");
+        reply *errperc = replyField(r,"classification-errors-perc");
+        double elapsed = (double)(ustime()-start)/1e6;
+        if (errperc && errperc->str) {
+            *accuracy = 100-atof(errperc->str);
+            if (*reached < 0 && *accuracy >= target) *reached = elapsed;
+        }
+        int done = training == NULL || training->integer == 0;
+        freeReply(r);
+        if (done) return elapsed;
+        usleep(50000);
+    }
+}
+
+static void benchDataset(dataset *ds, int *first) {
+    char key[64];
+    char hidden[16], inputs[16], classes[16], maxlen[16], testlen[16];
+    conn *c = connConnect();
+    int rssfrom = monitorCount();
+
+    snprintf(key,sizeof(key),"nr-loadgen:%s",ds->name);
+    snprintf(inputs,sizeof(inputs),"%d",ds->inputs);
+    snprintf(hidden,sizeof(hidden),"%d",ds->hidden);
+    snprintf(classes,sizeof(classes),"%d",ds->classes);
+    snprintf(maxlen,sizeof(maxlen),"%d",ds->maxlen);
+    snprintf(testlen,sizeof(testlen),"%d",ds->testlen);
+
+    const char *del[] = {"DEL", key};
+    freeReply(connCommand(c,2,del));
+    const char *create[] = {"NR.CREATE", key, "CLASSIFIER", inputs, hidden,
+        "->", classes, "DATASET", maxlen, "TEST", testlen, "NORMALIZE"};
+    reply *r = connCommand(c,ds->normalize ? 12 : 11,create);
+    if (r->type == '-') {
+        fprintf(stderr,"NR.CREATE: %s\n", r->str);
+        exit(1);
+    }
+    freeReply(r);
+
+    if (!JSON) printf("%s: %d samples, %d inputs\n",
+        ds->name, ds->count, ds->inputs);
+
+    workload w = buildWorkload(ds,key,1);
+    phaseStats observe = runWorkload(&w,w.count);
+    freeWorkload(&w);
+    printPhase(ds->name,"observe",&observe,first);
+
+    double target = Target ? Target : ds->target;
+    double reached, accuracy;
+    double seconds = train(c,key,target,&reached,&accuracy);
+
+    w = buildWorkload(ds,key,0);
+    phaseStats classify = runWorkload(&w,Requests);
+    freeWorkload(&w);
+    printPhase(ds->name,"class",&classify,first);
+
+    double replay = classify.count ?
+                    100.0*classify.correct/classify.count : 0;
+    uint64_t peak = monitorPeak(rssfrom);
+    if (JSON) {
+        printf(",\n    {\"dataset\":\"%s\",\"phase\":\"train\","
+               "\"seconds\":%.3f,\"target_accuracy\":%.1f,"
+               "\"time_to_target\":%.3f,\"test_accuracy\":%.2f,"
+               "\"replay_accuracy\":%.2f,\"peak_rss\":%llu}",
+               ds->name, seconds, target, reached, accuracy, replay,
+               (unsigned long long)peak);
+    } else {
+        printf("  %-10s %.3f seconds, test accuracy %.2f%%, ", "train",
+               seconds, accuracy);
+        if (reached >= 0)
+            printf("%.1f%% reached in %.3f seconds\n", target, reached);
+        else
+            printf("%.1f%% not reached\n", target);
+        printf("  %-10s %.2f%% of the replayed samples classified "
+               "correctly\n", "accuracy", replay);
+        printf("  %-10s peak %.1f MB\n\n", "rss", peak/1048576.0);
+    }
+    freeReply(connCommand(c,2,del));
+    connClose(c);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [--host <ip>] [--port <port>] [--clients <count>]\n"
+        "       [--pipeline <count>] [--requests <count>]\n"
+        "       [--datasets iris,titanic,sentiment,mnist]\n"
+        "       [--examples <dir>] [--train-ms <ms>] [--target <perc>]\n"
+        "       [--json]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    char *names = strdup("iris,titanic,sentiment,mnist");
+
+    for (int j = 1; j < argc; j++) {
+        int more = j+1 < argc;
+        if (!strcmp(argv[j],"--host") && more) {
+            Host = argv[++j];
+        } else if (!strcmp(argv[j],"--port") && more) {
+            Port = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--clients") && more) {
+            Clients = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--pipeline") && more) {
+            Pipeline = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--requests") && more) {
+            Requests = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--datasets") && more) {
+            free(names);
+            names = strdup(argv[++j]);
+        } else if (!strcmp(argv[j],"--examples") && more) {
+            Examples = argv[++j];
+        } else if (!strcmp(argv[j],"--train-ms") && more) {
+            TrainMs = atoll(argv[++j]);
+        } else if (!strcmp(argv[j],"--target") && more) {
+            Target = atof(argv[++j]);
+        } else if (!strcmp(argv[j],"--json")) {
+            JSON = 1;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (Clients <= 0 || Pipeline <= 0 || Requests < 0) usage(argv[0]);
+
+    Monitor.ms = zmalloc(sizeof(uint64_t)*MAX_RSS_SAMPLES);
+    Monitor.rss = zmalloc(sizeof(uint64_t)*MAX_RSS_SAMPLES);
+    Monitor.start = ustime();
+    pthread_create(&Monitor.tid,NULL,monitorMain,NULL);
+
+    int first = 1;
+    if (JSON) printf("{\n  \"clients\":%d,\n  \"pipeline\":%d,\n"
+                     "  \"results\":[", Clients, Pipeline);
+    for (char *name = strtok(names,","); name; name = strtok(NULL,",")) {
+        size_t j;
+        for (j = 0; j < NUM_DATASETS; j++)
+            if (!strcasecmp(name,Datasets[j].ds.name)) break;
+        if (j == NUM_DATASETS) {
+            fprintf(stderr,"Unknown dataset %s\n", name);
+            exit(1);
+        }
+        dataset *ds = &Datasets[j].ds;
+        if (Datasets[j].load(ds) == -1 || ds->count == 0) {
+            fprintf(stderr,"Skipping %s: data not found in %s\n",
+                ds->name, Examples);
+            continue;
+        }
+        benchDataset(ds,&first);
+        free(ds->x);
+        free(ds->y);
+    }
+
+    Monitor.stop = 1;
+    pthread_join(Monitor.tid,NULL);
+    if (JSON) {
+        printf("\n  ],\n  \"rss\":[");
+        for (int j = 0; j < Monitor.count; j++)
+            printf("%s[%llu,%llu]", j ? "," : "",
+                (unsigned long long)Monitor.ms[j],
+                (unsigned long long)Monitor.rss[j]);
+        printf("]\n}\n");
+    }
+    free(Monitor.ms);
+    free(Monitor.rss);
+    free(names);
+    return 0;
+}
@@ -0,0 +1,126 @@
+/* Test of the module configuration options.
+ *
+ * The module is linked with the mock Redis modules API of
+ * redismodule-mock.c. The example "loadmodule" lines of the README that
+ * pass options are parsed, and the module is loaded with their options,
+ * exactly like the server would do, then the values are read back with
+ * NR.CONFIG GET. Finally the options are set at runtime with NR.CONFIG SET,
+ * checking that valid values are accepted and invalid ones refused.
+ *
+ * Usage: nr-test-config [<path of README.md>]
+ * The exit code is non zero if any check fails. */
+
+#define _GNU_SOURCE /* memmem() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "redismodule-mock.h"
+
+#define MAX_ARGS 64
+
+static int Failures = 0;
+
+/* Run the command and check that it succeeds or fails as expected. If
+ * 'expected' is not NULL, the reply must also contain it. */
+void check(int ok, const char *expected, int argc, const char **argv) {
+    size_t len;
+
+    MockCommand(NULL,argc,argv,NULL);
+    const char *reply = MockLastReply(&len);
+    int error = len && reply[0] == '-';
+    if (error == ok || (expected &&
+        memmem(reply,len,expected,strlen(expected)) == NULL))
+    {
+        printf("FAILED:");
+        for (int j = 0; j < argc; j++) printf(" %s", argv[j]);
+        printf(" -> %.*s", (int)len, reply);
+        Failures++;
+    }
+}
+
+void check_set(int ok, const char *name, const char *value) {
+    const char *argv[] = {"NR.CONFIG", "SET", name, value};
+    check(ok,NULL,4,argv);
+}
+
+void check_get(const char *name, const char *value) {
+    const char *argv[] = {"NR.CONFIG", "GET", name};
+    char expected[256];
+    snprintf(expected,sizeof(expected),"\r\n+%s\r\n",value);
+    check(1,expected,3,argv);
+}
+
+int main(int argc, char **argv) {
+    const char *readme = argc > 1 ? argv[1] : "../README.md";
+    static char words[MAX_ARGS][128];
+    const char *opts[MAX_ARGS];
+    int numopts = 0, lines = 0;
+    char line[1024];
+
+    /* Collect the options of the README "loadmodule" examples. */
+    FILE *fp = fopen(readme,"r");
+    if (fp == NULL) {
+        perror(readme);
+        exit(1);
+    }
+    while (fgets(line,sizeof(line),fp)) {
+        char *p = strstr(line,"loadmodule ");
+        if (p == NULL || (p != line && p[-1] != ' ')) continue;
+        char *tok = strtok(p+strlen("loadmodule ")," \t\r\n");
+        if (tok == NULL || strstr(tok,"neuralredis.so") == NULL) continue;
+        int first = numopts;
+        while ((tok = strtok(NULL," \t\r\n")) != NULL && numopts < MAX_ARGS) {
+            snprintf(words[numopts],sizeof(words[0]),"%s",tok);
+            opts[numopts] = words[numopts];
+            numopts++;
+        }
+        if (numopts != first) lines++;
+    }
+    fclose(fp);
+    if (lines == 0 || numopts % 2) {
+        printf("FAILED: no valid loadmodule example with options in %s\n",
+            readme);
+        exit(1);
+    }
+
+    if (MockLoadModule(numopts,opts) != 0) {
+        printf("FAILED: the module does not load with the README options:");
+        for (int j = 0; j < numopts; j++) printf(" %s", opts[j]);
+        printf("\n");
+        exit(1);
+    }
+    for (int j = 0; j < numopts; j += 2) check_get(opts[j],opts[j+1]);
+
+    /* Quotas are either a number of CPUs, up to the max number of
+     * trainings, or a percentage up to 100%. */
+    check_set(1,"training-cpu-quota","4");
+    check_set(1,"training-cpu-quota","32");
+    check_set(0,"training-cpu-quota","33");
+    check_set(1,"training-cpu-quota","33%");
+    check_set(1,"training-cpu-quota","100%");
+    check_get("training-cpu-quota","100%");
+    check_set(0,"training-cpu-quota","101%");
+    check_set(0,"training-cpu-quota","-1");
+    check_set(0,"training-cpu-quota","5%%");
+    check_set(1,"training-cpu-quota","0");
+
+    check_set(1,"training-reserved-cpu","0");
+    check_get("training-reserved-cpu","0");
+    check_set(1,"training-reserved-cpu","none");
+    check_get("training-reserved-cpu","none");
+    check_set(0,"training-reserved-cpu","auto");
+
+    check_set(1,"training-memory-budget","10mb");
+    check_get("training-memory-budget","10485760");
+    check_set(0,"training-memory-budget","10xb");
+    check_set(0,"no-such-option","1");
+
+    MockFlushAll();
+    if (Failures) {
+        printf("%d configuration checks FAILED\n", Failures);
+        return 1;
+    }
+    printf("config: all checks OK (%d README loadmodule lines)\n", lines);
+    return 0;
+}
@@ -0,0 +1,734 @@
+/* A minimal in-process stand-in for the Redis modules API.
+ *
+ * This file implements the subset of the API used by Neural Redis, so that
+ * the module can be linked into a normal program, and its commands called
+ * directly with MockCommand(), without a server, a network and a client.
+ * This is useful in order to measure the overhead of the module itself, see
+ * nr-cmdbench.c.
+ *
+ * What is implemented:
+ *
+ * - Strings, with automatic memory management and reference counting.
+ * - A single keyspace of module type values and plain strings. The SET
+ *   command is provided by the mock itself, so that NR.RUNKEY can be used.
+ * - Replies, that are serialized in RESP into a buffer, so that their cost
+ *   is the same as in the server, minus the socket write.
+ * - Commands registration and the creation of the module data type.
+ *
+ * Everything else (RDB and AOF I/O, hashes, RedisModule_Call, blocked
+ * clients) is not exported: the API pointers the module gets are NULL, so
+ * inference is never offloaded to threads. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+/* Only the common defines of the header are needed, the module API is
+ * implemented here. */
+#define REDISMODULE_CORE
+#include "../redismodule.h"
+#undef RedisModuleString
+#include "redismodule-mock.h"
+
+typedef struct RedisModuleString {
+    char *ptr;
+    size_t len;
+    int refcount;
+} RedisModuleString;
+
+typedef struct RedisModuleCtx RedisModuleCtx;
+typedef int (*RedisModuleCmdFunc)(RedisModuleCtx *ctx,
+                                  RedisModuleString **argv, int argc);
+typedef void *(*RedisModuleTypeLoadFunc)(void *rdb, int encver);
+typedef void (*RedisModuleTypeSaveFunc)(void *rdb, void *value);
+typedef void (*RedisModuleTypeRewriteFunc)(void *aof, RedisModuleString *key,
+                                           void *value);
+typedef void (*RedisModuleTypeDigestFunc)(void *digest, void *value);
+typedef void (*RedisModuleTypeFreeFunc)(void *value);
+
+typedef struct RedisModuleType {
+    char name[10];
+    int encver;
+    RedisModuleTypeFreeFunc free;
+} RedisModuleType;
+
+/* An entry of the keyspace. */
+typedef struct MockEntry {
+    char *name;
+    size_t len;
+    int type;                   /* REDISMODULE_KEYTYPE_... */
+    RedisModuleType *mt;        /* Module type, if type is MODULE. */
+    void *value;                /* Module value, or RedisModuleString. */
+    struct MockEntry *next;
+} MockEntry;
+
+typedef struct RedisModuleKey {
+    RedisModuleCtx *ctx;
+    RedisModuleString *name;
+    MockEntry *entry;           /* NULL if the key is empty. */
+    int mode;
+    struct RedisModuleKey *next;/* Keys opened by the same command. */
+} RedisModuleKey;
+
+typedef struct MockReply {
+    char *buf;
+    size_t len, size;
+} MockReply;
+
+struct RedisModuleCtx {
+    void *getapifuncptr;        /* Must be the first field, see
+                                   RedisModule_Init(). */
+    int automemory;
+    RedisModuleString **autostr;/* Strings to release at the end. */
+    int autostr_len, autostr_size;
+    RedisModuleKey *keys;       /* Keys to close at the end. */
+    void **pool;                /* PoolAlloc() allocations. */
+    int pool_len, pool_size;
+    uint64_t args_time;         /* Last argument conversion time. */
+    uint64_t reply_time;        /* First reply time. */
+    int error;
+};
+
+#define MOCK_BUCKETS 4096
+#define MOCK_MAX_COMMANDS 64
+
+static MockEntry *Keyspace[MOCK_BUCKETS];
+static struct {
+    char name[32];
+    RedisModuleCmdFunc func;
+} Commands[MOCK_MAX_COMMANDS];
+static int NumCommands = 0;
+static MockReply Reply;
+static uint64_t Replicated = 0;
+
+static uint64_t nstime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static void *xalloc(size_t size) {
+    void *p = malloc(size);
+    if (p == NULL) {
+        fprintf(stderr,"Out of memory allocating %zu bytes\n", size);
+        abort();
+    }
+    return p;
+}
+
+static void *xrealloc(void *ptr, size_t size) {
+    void *p = realloc(ptr,size);
+    if (p == NULL && size) {
+        fprintf(stderr,"Out of memory allocating %zu bytes\n", size);
+        abort();
+    }
+    return p;
+}
+
+static void *xcalloc(size_t nmemb, size_t size) {
+    void *p = calloc(nmemb,size);
+    if (p == NULL && nmemb && size) {
+        fprintf(stderr,"Out of memory allocating %zu bytes\n", nmemb*size);
+        abort();
+    }
+    return p;
+}
+
+static char *xstrdup(const char *s) {
+    size_t len = strlen(s)+1;
+    char *p = xalloc(len);
+    memcpy(p,s,len);
+    return p;
+}
+
+/* ------------------------------- Strings --------------------------------- */
+
+static RedisModuleString *mockNewString(const char *ptr, size_t len) {
+    RedisModuleString *s = xalloc(sizeof(*s));
+    s->ptr = xalloc(len+1);
+    memcpy(s->ptr,ptr,len);
+    s->ptr[len] = '\0';
+    s->len = len;
+    s->refcount = 1;
+    return s;
+}
+
+static void mockDecrRefCount(RedisModuleString *s) {
+    if (--s->refcount) return;
+    free(s->ptr);
+    free(s);
+}
+
+static RedisModuleString *mockAutoString(RedisModuleCtx *ctx,
+                                         RedisModuleString *s)
+{
+    if (ctx == NULL || !ctx->automemory) return s;
+    if (ctx->autostr_len == ctx->autostr_size) {
+        ctx->autostr_size = ctx->autostr_size ? ctx->autostr_size*2 : 16;
+        ctx->autostr = xrealloc(ctx->autostr,
+            sizeof(RedisModuleString*)*ctx->autostr_size);
+    }
+    ctx->autostr[ctx->autostr_len++] = s;
+    return s;
+}
+
+static RedisModuleString *RM_CreateString(RedisModuleCtx *ctx, const char *ptr,
+                                          size_t len)
+{
+    return mockAutoString(ctx,mockNewString(ptr,len));
+}
+
+static RedisModuleString *RM_CreateStringFromLongLong(RedisModuleCtx *ctx,
+                                                      long long ll)
+{
+    char buf[32];
+    int len = snprintf(buf,sizeof(buf),"%lld",ll);
+    return RM_CreateString(ctx,buf,len);
+}
+
+static RedisModuleString *RM_CreateStringFromString(RedisModuleCtx *ctx,
+                                                    const RedisModuleString *s)
+{
+    return RM_CreateString(ctx,s->ptr,s->len);
+}
+
+static void RM_FreeString(RedisModuleCtx *ctx, RedisModuleString *s) {
+    if (ctx && ctx->automemory) {
+        for (int j = ctx->autostr_len-1; j >= 0; j--) {
+            if (ctx->autostr[j] == s) {
+                ctx->autostr[j] = ctx->autostr[--ctx->autostr_len];
+                break;
+            }
+        }
+    }
+    mockDecrRefCount(s);
+}
+
+static void RM_RetainString(RedisModuleCtx *ctx, RedisModuleString *s) {
+    (void)ctx;
+    s->refcount++;
+}
+
+static int RM_StringAppendBuffer(RedisModuleCtx *ctx, RedisModuleString *s,
+                                 const char *buf, size_t len)
+{
+    (void)ctx;
+    s->ptr = xrealloc(s->ptr,s->len+len+1);
+    memcpy(s->ptr+s->len,buf,len);
+    s->len += len;
+    s->ptr[s->len] = '\0';
+    return REDISMODULE_OK;
+}
+
+/* Argument conversions also mark the end of the parsing phase, as long as
+ * the command did not start to reply yet. */
+static RedisModuleCtx *CurrentCtx = NULL;
+
+static void mockArgsTime(void) {
+    if (CurrentCtx && !CurrentCtx->reply_time)
+        CurrentCtx->args_time = nstime();
+}
+
+static const char *RM_StringPtrLen(const RedisModuleString *s, size_t *len) {
+    mockArgsTime();
+    if (len) *len = s->len;
+    return s->ptr;
+}
+
+static int RM_StringToLongLong(const RedisModuleString *s, long long *ll) {
+    char *eptr;
+    mockArgsTime();
+    if (s->len == 0 || s->len > 20) return REDISMODULE_ERR;
+    errno = 0;
+    long long value = strtoll(s->ptr,&eptr,10);
+    if (*eptr != '\0' || errno == ERANGE) return REDISMODULE_ERR;
+    *ll = value;
+    return REDISMODULE_OK;
+}
+
+static int RM_StringToDouble(const RedisModuleString *s, double *d) {
+    char *eptr;
+    mockArgsTime();
+    if (s->len == 0) return REDISMODULE_ERR;
+    errno = 0;
+    double value = strtod(s->ptr,&eptr);
+    if (*eptr != '\0' || isnan(value) || errno == ERANGE)
+        return REDISMODULE_ERR;
+    *d = value;
+    return REDISMODULE_OK;
+}
+
+/* -------------------------------- Keys ----------------------------------- */
+
+static unsigned int mockHash(const char *p, size_t len) {
+    unsigned int h = 5381;
+    while (len--) h = (h << 5) + h + (unsigned char)*p++;
+    return h % MOCK_BUCKETS;
+}
+
+static MockEntry *mockLookup(const char *name, size_t len) {
+    MockEntry *e = Keyspace[mockHash(name,len)];
+    while (e && (e->len != len || memcmp(e->name,name,len))) e = e->next;
+    return e;
+}
+
+static void mockFreeValue(MockEntry *e) {
+    if (e->type == REDISMODULE_KEYTYPE_MODULE) e->mt->free(e->value);
+    else mockDecrRefCount(e->value);
+}
+
+static void mockDelete(const char *name, size_t len) {
+    MockEntry **prev = &Keyspace[mockHash(name,len)], *e;
+    while ((e = *prev) != NULL) {
+        if (e->len == len && !memcmp(e->name,name,len)) {
+            *prev = e->next;
+            mockFreeValue(e);
+            free(e->name);
+            free(e);
+            return;
+        }
+        prev = &e->next;
+    }
+}
+
+static MockEntry *mockAdd(const char *name, size_t len) {
+    unsigned int h = mockHash(name,len);
+    MockEntry *e = xcalloc(1,sizeof(*e));
+    e->name = xalloc(len);
+    memcpy(e->name,name,len);
+    e->len = len;
+    e->next = Keyspace[h];
+    Keyspace[h] = e;
+    return e;
+}
+
+static void *RM_OpenKey(RedisModuleCtx *ctx, RedisModuleString *name,
+                        int mode)
+{
+    MockEntry *e = mockLookup(name->ptr,name->len);
+    if (e == NULL && !(mode & REDISMODULE_WRITE)) return NULL;
+
+    RedisModuleKey *key = xalloc(sizeof(*key));
+    key->ctx = ctx;
+    key->name = name;
+    key->entry = e;
+    key->mode = mode;
+    name->refcount++;
+    key->next = ctx->keys;
+    ctx->keys = key;
+    return key;
+}
+
+static void RM_CloseKey(RedisModuleKey *key) {
+    (void)key; /* Closed at the end of the command. */
+}
+
+static int RM_KeyType(RedisModuleKey *key) {
+    if (key == NULL || key->entry == NULL) return REDISMODULE_KEYTYPE_EMPTY;
+    return key->entry->type;
+}
+
+static int RM_DeleteKey(RedisModuleKey *key) {
+    if (!(key->mode & REDISMODULE_WRITE)) return REDISMODULE_ERR;
+    if (key->entry) mockDelete(key->name->ptr,key->name->len);
+    key->entry = NULL;
+    return REDISMODULE_OK;
+}
+
+static char *RM_StringDMA(RedisModuleKey *key, size_t *len, int mode) {
+    (void)mode;
+    if (RM_KeyType(key) != REDISMODULE_KEYTYPE_STRING) {
+        *len = 0;
+        return NULL;
+    }
+    RedisModuleString *s = key->entry->value;
+    *len = s->len;
+    return s->ptr;
+}
+
+static RedisModuleType *RM_CreateDataType(RedisModuleCtx *ctx,
+    const char *name, int encver, RedisModuleTypeLoadFunc rdb_load,
+    RedisModuleTypeSaveFunc rdb_save, RedisModuleTypeRewriteFunc aof_rewrite,
+    RedisModuleTypeDigestFunc digest, RedisModuleTypeFreeFunc free)
+{
+    (void)ctx; (void)rdb_load; (void)rdb_save; (void)aof_rewrite;
+    (void)digest;
+    RedisModuleType *mt = xcalloc(1,sizeof(*mt));
+    snprintf(mt->name,sizeof(mt->name),"%s",name);
+    mt->encver = encver;
+    mt->free = free;
+    return mt;
+}
+
+static int RM_ModuleTypeSetValue(RedisModuleKey *key, RedisModuleType *mt,
+                                 void *value)
+{
+    if (!(key->mode & REDISMODULE_WRITE)) return REDISMODULE_ERR;
+    if (key->entry) mockDelete(key->name->ptr,key->name->len);
+    key->entry = mockAdd(key->name->ptr,key->name->len);
+    key->entry->type = REDISMODULE_KEYTYPE_MODULE;
+    key->entry->mt = mt;
+    key->entry->value = value;
+    return REDISMODULE_OK;
+}
+
+static RedisModuleType *RM_ModuleTypeGetType(RedisModuleKey *key) {
+    if (RM_KeyType(key) != REDISMODULE_KEYTYPE_MODULE) return NULL;
+    return key->entry->mt;
+}
+
+static void *RM_ModuleTypeGetValue(RedisModuleKey *key) {
+    if (RM_KeyType(key) != REDISMODULE_KEYTYPE_MODULE) return NULL;
+    return key->entry->value;
+}
+
+/* ------------------------------- Replies --------------------------------- */
+
+static void mockReplyAppend(RedisModuleCtx *ctx, const char *buf,
+                            size_t len)
+{
+    if (!ctx->reply_time) ctx->reply_time = nstime();
+    if (Reply.len+len > Reply.size) {
+        Reply.size = (Reply.len+len)*2;
+        Reply.buf = xrealloc(Reply.buf,Reply.size);
+    }
+    memcpy(Reply.buf+Reply.len,buf,len);
+    Reply.len += len;
+}
+
+static int mockReplyFormat(RedisModuleCtx *ctx, const char *fmt, ...) {
+    char buf[128];
+    va_list ap;
+
+    va_start(ap,fmt);
+    int len = vsnprintf(buf,sizeof(buf),fmt,ap);
+    va_end(ap);
+    mockReplyAppend(ctx,buf,len);
+    return REDISMODULE_OK;
+}
+
+static int RM_ReplyWithLongLong(RedisModuleCtx *ctx, long long ll) {
+    return mockReplyFormat(ctx,":%lld\r\n",ll);
+}
+
+static int RM_ReplyWithError(RedisModuleCtx *ctx, const char *err) {
+    ctx->error = 1;
+    mockReplyAppend(ctx,"-",1);
+    mockReplyAppend(ctx,err,strlen(err));
+    mockReplyAppend(ctx,"\r\n",2);
+    return REDISMODULE_OK;
+}
+
+static int RM_WrongArity(RedisModuleCtx *ctx) {
+    return RM_ReplyWithError(ctx,
+        "ERR wrong number of arguments for this command");
+}
+
+static int RM_ReplyWithSimpleString(RedisModuleCtx *ctx, const char *msg) {
+    mockReplyAppend(ctx,"+",1);
+    mockReplyAppend(ctx,msg,strlen(msg));
+    mockReplyAppend(ctx,"\r\n",2);
+    return REDISMODULE_OK;
+}
+
+static int RM_ReplyWithArray(RedisModuleCtx *ctx, long len) {
+    /* Postponed lengths are not patched, the reply is never parsed. */
+    return mockReplyFormat(ctx,"*%ld\r\n",len);
+}
+
+static void RM_ReplySetArrayLength(RedisModuleCtx *ctx, long len) {
+    (void)ctx; (void)len;
+}
+
+static int RM_ReplyWithStringBuffer(RedisModuleCtx *ctx, const char *buf,
+                                    size_t len)
+{
+    mockReplyFormat(ctx,"$%zu\r\n",len);
+    mockReplyAppend(ctx,buf,len);
+    mockReplyAppend(ctx,"\r\n",2);
+    return REDISMODULE_OK;
+}
+
+static int RM_ReplyWithString(RedisModuleCtx *ctx, RedisModuleString *s) {
+    return RM_ReplyWithStringBuffer(ctx,s->ptr,s->len);
+}
+
+static int RM_ReplyWithNull(RedisModuleCtx *ctx) {
+    mockReplyAppend(ctx,"$-1\r\n",5);
+    return REDISMODULE_OK;
+}
+
+static int RM_ReplyWithDouble(RedisModuleCtx *ctx, double d) {
+    char buf[64];
+    int len = snprintf(buf,sizeof(buf),"%.17g",d);
+    return RM_ReplyWithStringBuffer(ctx,buf,len);
+}
+
+/* --------------------------------- Misc ---------------------------------- */
+
+static void RM_AutoMemory(RedisModuleCtx *ctx) {
+    ctx->automemory = 1;
+}
+
+static void *RM_PoolAlloc(RedisModuleCtx *ctx, size_t bytes) {
+    if (ctx->pool_len == ctx->pool_size) {
+        ctx->pool_size = ctx->pool_size ? ctx->pool_size*2 : 8;
+        ctx->pool = xrealloc(ctx->pool,sizeof(void*)*ctx->pool_size);
+    }
+    return ctx->pool[ctx->pool_len++] = xalloc(bytes);
+}
+
+static int RM_Replicate(RedisModuleCtx *ctx, const char *cmdname,
+                        const char *fmt, ...)
+{
+    (void)ctx; (void)cmdname; (void)fmt;
+    Replicated++;
+    return REDISMODULE_OK;
+}
+
+static int RM_ReplicateVerbatim(RedisModuleCtx *ctx) {
+    (void)ctx;
+    Replicated++;
+    return REDISMODULE_OK;
+}
+
+static int RM_GetSelectedDb(RedisModuleCtx *ctx) {
+    (void)ctx;
+    return 0;
+}
+
+static int RM_SelectDb(RedisModuleCtx *ctx, int id) {
+    (void)ctx;
+    return id == 0 ? REDISMODULE_OK : REDISMODULE_ERR;
+}
+
+static void RM_Log(RedisModuleCtx *ctx, const char *level, const char *fmt,
+                   ...)
+{
+    va_list ap;
+    (void)ctx;
+
+    fprintf(stderr,"[module %s] ",level);
+    va_start(ap,fmt);
+    vfprintf(stderr,fmt,ap);
+    va_end(ap);
+    fprintf(stderr,"\n");
+}
+
+static int RM_CreateCommand(RedisModuleCtx *ctx, const char *name,
+    RedisModuleCmdFunc func, const char *strflags, int firstkey,
+    int lastkey, int keystep)
+{
+    (void)ctx; (void)strflags; (void)firstkey; (void)lastkey; (void)keystep;
+    if (NumCommands == MOCK_MAX_COMMANDS) return REDISMODULE_ERR;
+    snprintf(Commands[NumCommands].name,sizeof(Commands[0].name),"%s",name);
+    Commands[NumCommands].func = func;
+    NumCommands++;
+    return REDISMODULE_OK;
+}
+
+static int RM_SetModuleAttribs(RedisModuleCtx *ctx, const char *name, int ver,
+                               int apiver)
+{
+    (void)ctx; (void)name; (void)ver; (void)apiver;
+    return REDISMODULE_OK;
+}
+
+/* ------------------------------- The API --------------------------------- */
+
+#define MOCK_API(name) {"RedisModule_" #name, (void*)RM_ ## name}
+
+static struct {
+    const char *name;
+    void *func;
+} Api[] = {
+    {"RedisModule_Alloc", (void*)xalloc},
+    {"RedisModule_Calloc", (void*)xcalloc},
+    {"RedisModule_Realloc", (void*)xrealloc},
+    {"RedisModule_Free", (void*)free},
+    {"RedisModule_Strdup", (void*)xstrdup},
+    MOCK_API(CreateCommand),
+    MOCK_API(SetModuleAttribs),
+    MOCK_API(WrongArity),
+    MOCK_API(ReplyWithLongLong),
+    MOCK_API(ReplyWithError),
+    MOCK_API(ReplyWithSimpleString),
+    MOCK_API(ReplyWithArray),
+    MOCK_API(ReplySetArrayLength),
+    MOCK_API(ReplyWithStringBuffer),
+    MOCK_API(ReplyWithString),
+    MOCK_API(ReplyWithNull),
+    MOCK_API(ReplyWithDouble),
+    MOCK_API(GetSelectedDb),
+    MOCK_API(SelectDb),
+    MOCK_API(OpenKey),
+    MOCK_API(CloseKey),
+    MOCK_API(KeyType),
+    MOCK_API(DeleteKey),
+    MOCK_API(StringDMA),
+    MOCK_API(StringToLongLong),
+    MOCK_API(StringToDouble),
+    MOCK_API(CreateString),
+    MOCK_API(CreateStringFromLongLong),
+    MOCK_API(CreateStringFromString),
+    MOCK_API(FreeString),
+    MOCK_API(RetainString),
+    MOCK_API(StringAppendBuffer),
+    MOCK_API(StringPtrLen),
+    MOCK_API(AutoMemory),
+    MOCK_API(PoolAlloc),
+    MOCK_API(Replicate),
+    MOCK_API(ReplicateVerbatim),
+    MOCK_API(CreateDataType),
+    MOCK_API(ModuleTypeSetValue),
+    MOCK_API(ModuleTypeGetType),
+    MOCK_API(ModuleTypeGetValue),
+    MOCK_API(Log),
+    {NULL, NULL}
+};
+
+static int RM_GetApi(const char *name, void *targetPtrPtr) {
+    for (int j = 0; Api[j].name; j++) {
+        if (!strcmp(Api[j].name,name)) {
+            *(void**)targetPtrPtr = Api[j].func;
+            return REDISMODULE_OK;
+        }
+    }
+    *(void**)targetPtrPtr = NULL;
+    return REDISMODULE_ERR;
+}
+
+/* ------------------------------ Execution -------------------------------- */
+
+int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv,
+                       int argc);
+
+static void mockInitCtx(RedisModuleCtx *ctx) {
+    memset(ctx,0,sizeof(*ctx));
+    ctx->getapifuncptr = (void*)(unsigned long)RM_GetApi;
+}
+
+/* Release everything the command left in the context. */
+static void mockFreeCtx(RedisModuleCtx *ctx) {
+    for (int j = 0; j < ctx->autostr_len; j++)
+        mockDecrRefCount(ctx->autostr[j]);
+    free(ctx->autostr);
+    while (ctx->keys) {
+        RedisModuleKey *next = ctx->keys->next;
+        mockDecrRefCount(ctx->keys->name);
+        free(ctx->keys);
+        ctx->keys = next;
+    }
+    for (int j = 0; j < ctx->pool_len; j++) free(ctx->pool[j]);
+    free(ctx->pool);
+}
+
+static RedisModuleString **mockArgv(int argc, const char **argv,
+                                     const size_t *argvlen)
+{
+    RedisModuleString **v = xalloc(sizeof(RedisModuleString*)*(argc ? argc : 1));
+    for (int j = 0; j < argc; j++) {
+        size_t len = argvlen ? argvlen[j] : strlen(argv[j]);
+        v[j] = mockNewString(argv[j],len);
+    }
+    return v;
+}
+
+static void mockFreeArgv(RedisModuleString **v, int argc) {
+    for (int j = 0; j < argc; j++) mockDecrRefCount(v[j]);
+    free(v);
+}
+
+/* Load the module, passing it the given arguments. */
+int MockLoadModule(int argc, const char **argv) {
+    RedisModuleCtx ctx;
+    mockInitCtx(&ctx);
+    RedisModuleString **v = mockArgv(argc,argv,NULL);
+    int retval = RedisModule_OnLoad(&ctx,v,argc);
+    mockFreeCtx(&ctx);
+    mockFreeArgv(v,argc);
+    return retval;
+}
+
+/* The SET command, so that string keys can be used as inputs. */
+static int mockSet(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 3) return RM_WrongArity(ctx);
+    mockDelete(argv[1]->ptr,argv[1]->len);
+    MockEntry *e = mockAdd(argv[1]->ptr,argv[1]->len);
+    e->type = REDISMODULE_KEYTYPE_STRING;
+    e->value = mockNewString(argv[2]->ptr,argv[2]->len);
+    return RM_ReplyWithSimpleString(ctx,"OK");
+}
+
+/* Execute a command. The arguments are C strings, unless 'argvlen' is not
+ * NULL, in which case it holds the length of every argument. The reply can
+ * be obtained with MockLastReply(), and if 'stats' is not NULL the command
+ * timings are stored there. Returns REDISMODULE_ERR if the command does
+ * not exist. */
+int MockCommand(MockCallStats *stats, int argc, const char **argv,
+                const size_t *argvlen)
+{
+    RedisModuleCmdFunc func = NULL;
+
+    if (argc == 0) return REDISMODULE_ERR;
+    if (!strcasecmp(argv[0],"set")) func = mockSet;
+    for (int j = 0; func == NULL && j < NumCommands; j++) {
+        if (!strcasecmp(Commands[j].name,argv[0])) func = Commands[j].func;
+    }
+    if (func == NULL) return REDISMODULE_ERR;
+
+    RedisModuleCtx ctx;
+    RedisModuleString **v = mockArgv(argc,argv,argvlen);
+    mockInitCtx(&ctx);
+    Reply.len = 0;
+
+    CurrentCtx = &ctx;
+    uint64_t start = nstime();
+    func(&ctx,v,argc);
+    uint64_t end = nstime();
+    CurrentCtx = NULL;
+
+    if (stats) {
+        uint64_t args = ctx.args_time ? ctx.args_time : start;
+        uint64_t reply = ctx.reply_time ? ctx.reply_time : end;
+        if (args > reply) args = reply;
+        stats->parse_ns = args-start;
+        stats->exec_ns = reply-args;
+        stats->reply_ns = end-reply;
+        stats->total_ns = end-start;
+        stats->error = ctx.error;
+        stats->reply_len = Reply.len;
+    }
+    mockFreeCtx(&ctx);
+    mockFreeArgv(v,argc);
+    return REDISMODULE_OK;
+}
+
+/* Return the RESP reply of the last command executed. */
+const char *MockLastReply(size_t *len) {
+    *len = Reply.len;
+    return Reply.buf ? Reply.buf : "";
+}
+
+/* Remove all the keys. */
+void MockFlushAll(void) {
+    for (int j = 0; j < MOCK_BUCKETS; j++) {
+        while (Keyspace[j]) {
+            MockEntry *e = Keyspace[j];
+            Keyspace[j] = e->next;
+            mockFreeValue(e);
+            free(e->name);
+            free(e);
+        }
+    }
+}
+
+/* Return the number of commands the module propagated so far. */
+uint64_t MockReplicated(void) {
+    return Replicated;
+}
@@ -0,0 +1,34 @@
+/* A minimal in-process stand-in for the Redis modules API, see
+ * redismodule-mock.c. */
+
+#ifndef __REDISMODULE_MOCK_H
+#define __REDISMODULE_MOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Timings of the last command executed with MockCommand(), in nanoseconds.
+ *
+ * The phases are delimited by the API calls of the command implementation:
+ * 'parse' ends at the last argument conversion (StringPtrLen,
+ * StringToLongLong, StringToDouble) before the first reply call, 'reply'
+ * starts at the first reply call, and includes what the command does after
+ * replying, like propagating the change to replicas. Everything in the
+ * middle, like running the network, is accounted as 'exec'. */
+typedef struct MockCallStats {
+    uint64_t parse_ns;
+    uint64_t exec_ns;
+    uint64_t reply_ns;
+    uint64_t total_ns;
+    int error;              /* True if the command replied with an error. */
+    size_t reply_len;       /* Bytes of the RESP reply. */
+} MockCallStats;
+
+int MockLoadModule(int argc, const char **argv);
+int MockCommand(MockCallStats *stats, int argc, const char **argv,
+                const size_t *argvlen);
+const char *MockLastReply(size_t *len);
+void MockFlushAll(void);
+uint64_t MockReplicated(void);
+
+#endif /* __REDISMODULE_MOCK_H */